@@ -218,7 +218,7 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
 }
 
 
-CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activeTxn(NULL)
+CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), plog(NULL), activeTxn(NULL), fLogTxn(false)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -226,6 +226,20 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
         return;
 
     bool fCreate = strchr(pszMode, 'c') != NULL;
+
+    // a wallet kept in a wallet log does not touch Berkeley DB at all
+    plog = walletlogs.Get(strFilename);
+    if (plog) {
+        strFile = strFilename;
+        if (fCreate && !Exists(string("version"))) {
+            bool fTmp = fReadOnly;
+            fReadOnly = false;
+            WriteVersion(CLIENT_VERSION);
+            fReadOnly = fTmp;
+        }
+        return;
+    }
+
     unsigned int nFlags = DB_THREAD;
     if (fCreate)
         nFlags |= DB_CREATE;
@@ -278,7 +292,8 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
 
 void CDB::Flush()
 {
-    if (activeTxn)
+    // wallet logs are synced by ThreadFlushWalletDB and on shutdown
+    if (activeTxn || plog)
         return;
 
     // Flush database activity from memory pool to disk log
@@ -291,6 +306,12 @@ void CDB::Flush()
 
 void CDB::Close()
 {
+    if (plog) {
+        vLogTxn.clear();
+        fLogTxn = false;
+        plog = NULL;
+        return;
+    }
     if (!pdb)
         return;
     if (activeTxn)
@@ -306,6 +327,78 @@ void CDB::Close()
     }
 }
 
+bool CDB::ReadLog(const CDataStream& ssKey, std::vector<unsigned char>& vchValueRet)
+{
+    std::vector<unsigned char> vchKey(ssKey.begin(), ssKey.end());
+    // changes of the active transaction come first
+    for (std::vector<CWalletLogRecord>::reverse_iterator it = vLogTxn.rbegin(); it != vLogTxn.rend(); ++it) {
+        if (it->vchKey == vchKey) {
+            if (it->fErase)
+                return false;
+            vchValueRet = it->vchValue;
+            return true;
+        }
+    }
+    return plog->Read(vchKey, vchValueRet);
+}
+
+bool CDB::ExistsLog(const CDataStream& ssKey)
+{
+    std::vector<unsigned char> vchValue;
+    return ReadLog(ssKey, vchValue);
+}
+
+bool CDB::WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    if (!fOverwrite && ExistsLog(ssKey))
+        return false;
+    CWalletLogRecord record(std::vector<unsigned char>(ssKey.begin(), ssKey.end()), std::vector<unsigned char>(ssValue.begin(), ssValue.end()));
+    if (fLogTxn) {
+        vLogTxn.push_back(record);
+        return true;
+    }
+    return plog->Write(std::vector<CWalletLogRecord>(1, record));
+}
+
+bool CDB::EraseLog(const CDataStream& ssKey)
+{
+    CWalletLogRecord record(std::vector<unsigned char>(ssKey.begin(), ssKey.end()));
+    if (fLogTxn) {
+        vLogTxn.push_back(record);
+        return true;
+    }
+    return plog->Write(std::vector<CWalletLogRecord>(1, record));
+}
+
+int CDB::ReadAtLogCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    // Records are looked up by key on every step, so the cursor stays valid while the log changes
+    std::vector<unsigned char> vchKey, vchValue;
+    bool fFound;
+    if (fFlags == DB_SET || fFlags == DB_SET_RANGE) {
+        std::vector<unsigned char> vchSeek(ssKey.begin(), ssKey.end());
+        fFound = pcursor->plog->Seek(vchSeek, false, vchKey, vchValue) && (fFlags == DB_SET_RANGE || vchKey == vchSeek);
+    } else if (fFlags == DB_NEXT) {
+        fFound = pcursor->plog->Seek(pcursor->vchKey, pcursor->fStarted, vchKey, vchValue);
+    } else {
+        return 99999;
+    }
+    if (!fFound)
+        return DB_NOTFOUND;
+    pcursor->vchKey = vchKey;
+    pcursor->fStarted = true;
+
+    // Convert to streams
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write((const char*)&vchKey[0], vchKey.size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    if (!vchValue.empty())
+        ssValue.write((const char*)&vchValue[0], vchValue.size());
+    return 0;
+}
+
 void CDBEnv::CloseDb(const string& strFile)
 {
     {
@@ -331,6 +424,15 @@ bool CDBEnv::RemoveDb(const string& strFile)
 
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
+    CWalletLog* plogRewrite = walletlogs.Get(strFile);
+    if (plogRewrite) {
+        LogPrintf("CDB::Rewrite : Compacting %s...\n", strFile);
+        if (!plogRewrite->Compact(pszSkip))
+            return false;
+        CDB db(strFile);
+        return db.WriteVersion(CLIENT_VERSION);
+    }
+
     while (true) {
         {
             LOCK(bitdb.cs_db);
@@ -358,7 +460,7 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess) {
                             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
@@ -0,0 +1,262 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_EXPIRINGMAP_H
+#define BITCOIN_EXPIRINGMAP_H
+
+#include "utiltime.h"
+
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <boost/function.hpp>
+
+/**
+ * STL-like map container for relayed messages. Entries are forgotten nMaxAge seconds
+ * after they were inserted, and the oldest entries are dropped once there are more than
+ * nMaxSize of them; zero disables either bound. A keep function given at construction
+ * holds entries back from both (votes that are still counted, ...), so a flood of new
+ * entries cannot push them out. Entries can be inserted under a parent key (the proposal
+ * a vote is for, the height a payment vote is for, ...) and found by it.
+ *
+ * Insertion order is kept in a queue, so expiry only ever looks at the entries that are
+ * due. Erasing an entry leaves its queue slot behind; stale slots are skipped when they
+ * reach the front and the queue is compacted once they outnumber the live entries.
+ */
+template <typename K, typename V, typename P = K>
+class expiringmap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef P parent_type;
+    typedef std::pair<const key_type, mapped_type> value_type;
+    typedef typename std::map<K, V>::iterator iterator;
+    typedef typename std::map<K, V>::const_iterator const_iterator;
+    typedef typename std::map<K, V>::size_type size_type;
+    typedef boost::function<bool(const value_type&)> keep_function;
+
+protected:
+    typedef typename std::multimap<P, K>::iterator parent_iterator;
+    typedef typename std::multimap<P, K>::const_iterator parent_const_iterator;
+    struct entryinfo {
+        uint64_t nSequence; // of the entry's live slot in the queue
+        bool fParent;
+        parent_iterator itParent; // the entry's own slot in mapByParent
+    };
+    struct queueslot {
+        int64_t nTime;
+        uint64_t nSequence;
+        K key;
+    };
+    typedef typename std::map<K, entryinfo>::iterator info_iterator;
+
+    std::map<K, V> map;
+    std::map<K, entryinfo> mapInfo;
+    std::multimap<P, K> mapByParent;
+    std::deque<queueslot> queue;
+    uint64_t nSequence;
+    size_type nMaxSize;
+    int64_t nMaxAge;
+    keep_function keep;
+
+    /** Keep nothing back from expiry */
+    struct keep_none {
+        bool operator()(const value_type& item) const { return false; }
+    };
+
+    bool kept(const value_type& item) const { return keep && keep(item); }
+
+    void push(const K& key, entryinfo& info, int64_t nTime)
+    {
+        queueslot slot;
+        slot.nTime = nTime;
+        slot.nSequence = info.nSequence = ++nSequence;
+        slot.key = key;
+        queue.push_back(slot);
+    }
+
+    bool live(const queueslot& slot) const
+    {
+        typename std::map<K, entryinfo>::const_iterator it = mapInfo.find(slot.key);
+        return it != mapInfo.end() && it->second.nSequence == slot.nSequence;
+    }
+
+    void pop_stale()
+    {
+        while (!queue.empty() && !live(queue.front()))
+            queue.pop_front();
+    }
+
+    void compact()
+    {
+        if (queue.size() <= 2 * map.size() + 64)
+            return;
+        std::deque<queueslot> queueLive;
+        for (typename std::deque<queueslot>::const_iterator it = queue.begin(); it != queue.end(); ++it)
+            if (live(*it))
+                queueLive.push_back(*it);
+        queue.swap(queueLive);
+    }
+
+    std::pair<iterator, bool> insert_entry(const value_type& x, const P* pParent)
+    {
+        std::pair<iterator, bool> ret = map.insert(x);
+        if (!ret.second)
+            return ret;
+        entryinfo& info = mapInfo[x.first];
+        info.fParent = pParent != NULL;
+        if (pParent)
+            info.itParent = mapByParent.insert(std::make_pair(*pParent, x.first));
+        push(x.first, info, GetTime());
+        if (nMaxSize && map.size() > nMaxSize)
+            evict(x.first);
+        return ret;
+    }
+
+    /**
+     * Drop the oldest entry that is not kept, other than keyNew. The kept entries in front of it
+     * start over at the back of the queue, so each is only passed over once per round. If all
+     * of them are kept the map stays over nMaxSize; they are bounded by what keeps them.
+     */
+    void evict(const K& keyNew)
+    {
+        int64_t nNow = GetTime();
+        for (size_type n = map.size(); n > 0; n--) {
+            pop_stale();
+            iterator it = map.find(queue.front().key);
+            if (it->first != keyNew && !kept(*it)) {
+                erase(it);
+                return;
+            }
+            push(it->first, mapInfo[it->first], nNow);
+            queue.pop_front();
+        }
+    }
+
+    void copy_from(const expiringmap& other)
+    {
+        map = other.map;
+        mapInfo = other.mapInfo;
+        queue = other.queue;
+        nSequence = other.nSequence;
+        nMaxSize = other.nMaxSize;
+        nMaxAge = other.nMaxAge;
+        keep = other.keep;
+        // the parent slots still point into other's index
+        mapByParent.clear();
+        for (info_iterator it = mapInfo.begin(); it != mapInfo.end(); ++it) {
+            if (it->second.fParent)
+                it->second.itParent = mapByParent.insert(std::make_pair(it->second.itParent->first, it->first));
+        }
+    }
+
+public:
+    expiringmap(size_type nMaxSizeIn = 0, int64_t nMaxAgeIn = 0, const keep_function& keepIn = keep_function()) : nSequence(0), nMaxSize(nMaxSizeIn), nMaxAge(nMaxAgeIn), keep(keepIn) {}
+    expiringmap(const expiringmap& other) { copy_from(other); }
+    expiringmap& operator=(const expiringmap& other)
+    {
+        if (this != &other)
+            copy_from(other);
+        return *this;
+    }
+
+    iterator begin() { return map.begin(); }
+    iterator end() { return map.end(); }
+    const_iterator begin() const { return map.begin(); }
+    const_iterator end() const { return map.end(); }
+    size_type size() const { return map.size(); }
+    bool empty() const { return map.empty(); }
+    iterator find(const key_type& k) { return map.find(k); }
+    const_iterator find(const key_type& k) const { return map.find(k); }
+    size_type count(const key_type& k) const { return map.count(k); }
+
+    std::pair<iterator, bool> insert(const value_type& x) { return insert_entry(x, NULL); }
+    std::pair<iterator, bool> insert(const value_type& x, const parent_type& parent) { return insert_entry(x, &parent); }
+
+    mapped_type& operator[](const key_type& k)
+    {
+        iterator it = map.find(k);
+        if (it == map.end())
+            it = insert(value_type(k, mapped_type())).first;
+        return it->second;
+    }
+
+    void erase(iterator it)
+    {
+        info_iterator itInfo = mapInfo.find(it->first);
+        if (itInfo->second.fParent)
+            mapByParent.erase(itInfo->second.itParent);
+        mapInfo.erase(itInfo);
+        map.erase(it);
+        compact();
+    }
+
+    size_type erase(const key_type& k)
+    {
+        iterator it = map.find(k);
+        if (it == map.end())
+            return 0;
+        erase(it);
+        return 1;
+    }
+
+    void clear()
+    {
+        map.clear();
+        mapInfo.clear();
+        mapByParent.clear();
+        queue.clear();
+    }
+
+    /** The keys of the entries inserted under parent */
+    void find_by_parent(const parent_type& parent, std::vector<key_type>& vKeysRet) const
+    {
+        std::pair<parent_const_iterator, parent_const_iterator> range = mapByParent.equal_range(parent);
+        for (parent_const_iterator it = range.first; it != range.second; ++it)
+            vKeysRet.push_back(it->second);
+    }
+
+    /** Forget the entries older than max_age() that are not kept; returns how many were erased */
+    size_type expire()
+    {
+        if (!keep)
+            return expire(keep_none());
+        return expire(keep);
+    }
+
+    /**
+     * Forget the entries older than max_age(), except those keepExpiry(entry) holds on to.
+     * Those start a new max_age() period, so each is only looked at once per period.
+     */
+    template <typename Keep>
+    size_type expire(Keep keepExpiry)
+    {
+        size_type nErased = 0;
+        if (nMaxAge <= 0)
+            return nErased;
+        int64_t nNow = GetTime();
+        while (true) {
+            pop_stale();
+            if (queue.empty() || queue.front().nTime > nNow - nMaxAge)
+                break;
+            iterator it = map.find(queue.front().key);
+            if (keepExpiry(*it)) {
+                push(it->first, mapInfo[it->first], nNow);
+                queue.pop_front();
+            } else {
+                erase(it);
+                nErased++;
+            }
+        }
+        return nErased;
+    }
+
+    size_type max_size() const { return nMaxSize; }
+    int64_t max_age() const { return nMaxAge; }
+};
+
+#endif // BITCOIN_EXPIRINGMAP_H
@@ -42,6 +42,7 @@
 #include "wallet.h"
 #include "walletdb.h"
 #include "accumulators.h"
+#include "zerocoinmintpool.h"
 
 #endif
 
@@ -183,9 +184,12 @@ void PrepareShutdown()
     mempool.AddTransactionsUpdated(1);
     StopRPCThreads();
 #ifdef ENABLE_WALLET
-    if (pwalletMain)
+    if (pwalletMain) {
         bitdb.Flush(false);
+        walletlogs.Flush(false);
+    }
     GenerateBitcoins(false, NULL, 0);
+    zerocoinMintPool.Stop();
 #endif
     StopNode();
     InterruptTorControl();
@@ -227,8 +231,10 @@ void PrepareShutdown()
         pSporkDB = NULL;
     }
 #ifdef ENABLE_WALLET
-    if (pwalletMain)
+    if (pwalletMain) {
         bitdb.Flush(true);
+        walletlogs.Flush(true);
+    }
 #endif
 
 #if ENABLE_ZMQ
@@ -384,6 +390,7 @@ std::string HelpMessage(HelpMessageMode mode)
 
 #ifdef ENABLE_WALLET
     strUsage += HelpMessageGroup(_("Wallet options:"));
+    strUsage += HelpMessageOpt("-coinselectiontime=<n>", strprintf(_("Time in milliseconds coin selection may search for the best set of coins to spend (default: %u)"), DEFAULT_COIN_SELECTION_TIME));
     strUsage += HelpMessageOpt("-createwalletbackups=<n>", _("Number of automatic wallet backups (default: 10)"));
     strUsage += HelpMessageOpt("-disablewallet", _("Do not load the wallet and disable wallet RPC calls"));
     strUsage += HelpMessageOpt("-keypool=<n>", strprintf(_("Set key pool size to <n> (default: %u)"), 100));
@@ -401,6 +408,7 @@ std::string HelpMessage(HelpMessageMode mode)
         FormatMoney(maxTxFee)));
     strUsage += HelpMessageOpt("-upgradewallet", _("Upgrade wallet to latest format") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-wallet=<file>", _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), "wallet.dat"));
+    strUsage += HelpMessageOpt("-walletlog", strprintf(_("Keep the wallet in an append-only log (<file>.log) instead of Berkeley DB, migrating the wallet file on startup and moving it to <file>.migrated; once the log exists it is always used (default: %u)"), 0));
     strUsage += HelpMessageOpt("-walletnotify=<cmd>", _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)"));
     if (mode == HMM_BITCOIN_QT)
         strUsage += HelpMessageOpt("-windowtitle=<name>", _("Wallet window title"));
@@ -433,7 +441,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-stopafterblockimport", strprintf(_("Stop running after importing blocks from disk (default: %u)"), 0));
         strUsage += HelpMessageOpt("-sporkkey=<privkey>", _("Enable spork administration functionality with the appropriate private key."));
     }
-    string debugCategories = "addrman, alert, bench, coindb, db, lock, rand, rpc, selectcoins, tor, mempool, net, proxy, wagerr, (obfuscation, swiftx, masternode, mnpayments, mnbudget, zero)"; // Don't translate these and qt below
+    string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, lock, rand, rpc, selectcoins, tor, mempool, net, proxy, wagerr, (obfuscation, swiftx, masternode, mnpayments, mnbudget, zero)"; // Don't translate these and qt below
     if (mode == HMM_BITCOIN_QT)
         debugCategories += ", qt";
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
@@ -487,6 +495,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-enablezeromint=<n>", strprintf(_("Enable automatic Zerocoin minting (0-1, default: %u)"), 1));
     strUsage += HelpMessageOpt("-zeromintpercentage=<n>", strprintf(_("Percentage of automatically minted Zerocoin  (10-100, default: %u)"), 10));
     strUsage += HelpMessageOpt("-preferredDenom=<n>", strprintf(_("Preferred Denomination for automatically minted Zerocoin  (1/5/10/50/100/500/1000/5000), 0 for no preference. default: %u)"), 0));
+    strUsage += HelpMessageOpt("-zeromintpool=<n>", strprintf(_("Keep this many Zerocoin mints pregenerated in the background, 0 to disable (default: %u)"), DEFAULT_ZEROMINT_POOL_SIZE));
     strUsage += HelpMessageOpt("-backupzwgr=<n>", strprintf(_("Enable automatic wallet backups triggered after each zWgr minting (0-1, default: %u)"), 1));
 
 //    strUsage += "  -anonymizewagerramount=<n>     " + strprintf(_("Keep N WGR anonymized (default: %u)"), 0) + "\n";
@@ -904,6 +913,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     nTxConfirmTarget = GetArg("-txconfirmtarget", 1);
     bSpendZeroConfChange = GetBoolArg("-spendzeroconfchange", false);
+    nCoinSelectionTime = std::max(GetArg("-coinselectiontime", DEFAULT_COIN_SELECTION_TIME), (int64_t)0);
     bdisableSystemnotifications = GetBoolArg("-disablesystemnotifications", false);
     fSendFreeTransactions = GetBoolArg("-sendfreetransactions", false);
 
@@ -964,6 +974,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (nScriptCheckThreads) {
         for (int i = 0; i < nScriptCheckThreads - 1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        // as many threads recover the signers of masternode gossip ahead of the message handler
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            threadGroup.create_thread(&ThreadSignatureRecovery);
     }
 
     if (mapArgs.count("-sporkkey")) // spork priv key
@@ -996,6 +1009,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             // Always create backup folder to not confuse the operating system's file browser
             filesystem::create_directories(backupDir);
         }
+        // Once a wallet log exists it holds the wallet, and wallet.dat is no longer used
+        bool fWalletLogExists = filesystem::exists(CWalletLogEnv::GetPath(strWalletFile));
+        std::string strWalletStoreFile = fWalletLogExists ? CWalletLogEnv::GetPath(strWalletFile).filename().string() : strWalletFile;
+
         nWalletBackups = GetArg("-createwalletbackups", 10);
         nWalletBackups = std::max(0, std::min(10, nWalletBackups));
         if (nWalletBackups > 0) {
@@ -1003,9 +1020,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 // Create backup of the wallet
                 std::string dateTimeStr = DateTimeStrFormat(".%Y-%m-%d-%H-%M", GetTime());
                 std::string backupPathStr = backupDir.string();
-                backupPathStr += "/" + strWalletFile;
+                backupPathStr += "/" + strWalletStoreFile;
                 std::string sourcePathStr = GetDataDir().string();
-                sourcePathStr += "/" + strWalletFile;
+                sourcePathStr += "/" + strWalletStoreFile;
                 boost::filesystem::path sourceFile = sourcePathStr;
                 boost::filesystem::path backupFile = backupPathStr + dateTimeStr;
                 sourceFile.make_preferred();
@@ -1037,7 +1054,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     if (boost::filesystem::is_regular_file(dir_iter->status())) {
                         currentFile = dir_iter->path().filename();
                         // Only add the backups for the current wallet, e.g. wallet.dat.*
-                        if (dir_iter->path().stem().string() == strWalletFile) {
+                        if (dir_iter->path().stem().string() == strWalletStoreFile) {
                             folder_set.insert(folder_set_t::value_type(boost::filesystem::last_write_time(dir_iter->path()), *dir_iter));
                         }
                     }
@@ -1116,13 +1133,13 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             }
         }
 
-        if (GetBoolArg("-salvagewallet", false)) {
+        if (GetBoolArg("-salvagewallet", false) && !fWalletLogExists) {
             // Recover readable keypairs:
             if (!CWalletDB::Recover(bitdb, strWalletFile, true))
                 return false;
         }
 
-        if (filesystem::exists(GetDataDir() / strWalletFile)) {
+        if (filesystem::exists(GetDataDir() / strWalletFile) && !fWalletLogExists) {
             CDBEnv::VerifyResult r = bitdb.Verify(strWalletFile, CWalletDB::Recover);
             if (r == CDBEnv::RECOVER_OK) {
                 string msg = strprintf(_("Warning: wallet.dat corrupt, data salvaged!"
@@ -1136,6 +1153,22 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 return InitError(_("wallet.dat corrupt, salvage failed"));
         }
 
+        if (GetBoolArg("-walletlog", false) || fWalletLogExists) {
+            if (!fWalletLogExists && filesystem::exists(GetDataDir() / strWalletFile)) {
+                uiInterface.InitMessage(_("Migrating wallet to the wallet log..."));
+                if (!CWalletDB::MigrateToLog(strWalletFile))
+                    return InitError(strprintf(_("Error migrating %s to a wallet log"), strWalletFile));
+            }
+            if (!walletlogs.Open(strWalletFile, true))
+                return InitError(strprintf(_("Error loading wallet log %s, see debug.log for details"), CWalletLogEnv::GetPath(strWalletFile).string()));
+
+            filesystem::path pathPreLog;
+            if (CWalletDB::GetPreLogFile(strWalletFile, pathPreLog))
+                InitWarning(strprintf(_("Warning: %s is left from before the wallet was migrated to a wallet log. It holds the keys as they were then, "
+                                        "unencrypted unless the wallet already was. Delete it once you have made a new backup; "
+                                        "the wallet cannot be encrypted while it exists."), pathPreLog.string()));
+        }
+
     }  // (!fDisableWallet)
 #endif // ENABLE_WALLET
     // ********************************************************* Step 6: network initialization
@@ -1618,6 +1651,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
     }
 
+    // Track collateral spends from here on, and catch the ones made while we were offline
+    RegisterValidationInterface(&mnodeman);
+    mnodeman.CheckCollaterals();
+
     uiInterface.InitMessage(_("Loading budget cache..."));
 
     CBudgetDB budgetdb;
@@ -1719,6 +1756,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         nPreferredDenom = 0;
     }
 
+    if (pwalletMain) {
+        int nZeromintPool = GetArg("-zeromintpool", DEFAULT_ZEROMINT_POOL_SIZE);
+        zerocoinMintPool.Start(std::max(nZeromintPool, 0));
+    }
+
 // XX42 Remove/refactor code below. Until then provide safe defaults
     nAnonymizeWagerrAmount = 2;
 
@@ -13,6 +13,25 @@
 
 #include <boost/foreach.hpp>
 
+bool GetScriptTemplateId(const CScript& script, uint160& idRet)
+{
+    // the forms Solver() matches for these types, for the pubkeys the usual sizes only
+    if (script.size() == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+        script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG) {
+        memcpy(idRet.begin(), &script[3], 20);
+        return true;
+    }
+    if (script.IsPayToScriptHash()) {
+        memcpy(idRet.begin(), &script[2], 20);
+        return true;
+    }
+    if (((script.size() == 35 && script[0] == 33) || (script.size() == 67 && script[0] == 65)) && script.back() == OP_CHECKSIG) {
+        idRet = CPubKey(script.begin() + 1, script.end() - 1).GetID();
+        return true;
+    }
+    return false;
+}
+
 bool CKeyStore::GetPubKey(const CKeyID& address, CPubKey& vchPubKeyOut) const
 {
     CKey key;
@@ -31,6 +50,7 @@ bool CBasicKeyStore::AddKeyPubKey(const CKey& key, const CPubKey& pubkey)
 {
     LOCK(cs_KeyStore);
     mapKeys[pubkey.GetID()] = key;
+    setTemplateIds.insert(pubkey.GetID());
     return true;
 }
 
@@ -41,6 +61,7 @@ bool CBasicKeyStore::AddCScript(const CScript& redeemScript)
 
     LOCK(cs_KeyStore);
     mapScripts[CScriptID(redeemScript)] = redeemScript;
+    setTemplateIds.insert(CScriptID(redeemScript));
     return true;
 }
 
@@ -65,6 +86,9 @@ bool CBasicKeyStore::AddWatchOnly(const CScript& dest)
 {
     LOCK(cs_KeyStore);
     setWatchOnly.insert(dest);
+    uint160 id;
+    if (GetScriptTemplateId(dest, id))
+        setTemplateIds.insert(id);
     return true;
 }
 
@@ -91,6 +115,9 @@ bool CBasicKeyStore::AddMultiSig(const CScript& dest)
 {
     LOCK(cs_KeyStore);
     setMultiSig.insert(dest);
+    uint160 id;
+    if (GetScriptTemplateId(dest, id))
+        setTemplateIds.insert(id);
     return true;
 }
 
@@ -112,3 +139,9 @@ bool CBasicKeyStore::HaveMultiSig() const
     LOCK(cs_KeyStore);
     return (!setMultiSig.empty());
 }
+
+bool CBasicKeyStore::MayHaveTemplateId(const uint160& id) const
+{
+    LOCK(cs_KeyStore);
+    return setTemplateIds.count(id) > 0;
+}
@@ -11,11 +11,18 @@
 #include "sync.h"
 
 #include <boost/signals2/signal.hpp>
+#include <boost/unordered_set.hpp>
 #include <boost/variant.hpp>
 
 class CScript;
 class CScriptID;
 
+/**
+ * The key or script id a pay to pubkey hash, pay to script hash or pay to pubkey script
+ * pays to (the hash of the pubkey for the latter); false for other scripts.
+ */
+bool GetScriptTemplateId(const CScript& script, uint160& idRet);
+
 /** A virtual base class for key stores */
 class CKeyStore
 {
@@ -51,6 +58,9 @@ public:
     virtual bool RemoveMultiSig(const CScript& dest) = 0;
     virtual bool HaveMultiSig(const CScript& dest) const = 0;
     virtual bool HaveMultiSig() const = 0;
+
+    //! Whether a script with this GetScriptTemplateId() may be ours; false rules it out
+    virtual bool MayHaveTemplateId(const uint160& id) const { return true; }
 };
 
 typedef std::map<CKeyID, CKey> KeyMap;
@@ -58,6 +68,11 @@ typedef std::map<CScriptID, CScript> ScriptMap;
 typedef std::set<CScript> WatchOnlySet;
 typedef std::set<CScript> MultiSigScriptSet;
 
+struct CTemplateIdHasher {
+    size_t operator()(const uint160& id) const { return id.GetLow64(); }
+};
+typedef boost::unordered_set<uint160, CTemplateIdHasher> TemplateIdSet;
+
 /** Basic key store, that keeps keys in an address->secret map */
 class CBasicKeyStore : public CKeyStore
 {
@@ -66,6 +81,9 @@ protected:
     ScriptMap mapScripts;
     WatchOnlySet setWatchOnly;
     MultiSigScriptSet setMultiSig;
+    //! Template ids of the keys, scripts, watch-only and multisig scripts ever added; removing
+    //! a script leaves its id behind, which only costs IsMine the full check for it
+    TemplateIdSet setTemplateIds;
 
 public:
     bool AddKeyPubKey(const CKey& key, const CPubKey& pubkey);
@@ -115,6 +133,8 @@ public:
     virtual bool RemoveMultiSig(const CScript& dest);
     virtual bool HaveMultiSig(const CScript& dest) const;
     virtual bool HaveMultiSig() const;
+
+    virtual bool MayHaveTemplateId(const uint160& id) const;
 };
 
 typedef std::vector<unsigned char, secure_allocator<unsigned char> > CKeyingMaterial;
@@ -11,6 +11,7 @@
 #include "accumulators.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -35,12 +36,14 @@
 #include "primitives/zerocoin.h"
 #include "libzerocoin/Denominations.h"
 
+#include <deque>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace boost;
@@ -170,6 +173,7 @@ struct QueuedBlock {
     int64_t nTime;              //! Time of "getdata" request in microseconds.
     int nValidatedQueuedBefore; //! Number of blocks queued with validated headers (globally) at the time this one is requested.
     bool fValidatedHeaders;     //! Whether this block has validated headers at the time of request.
+    boost::shared_ptr<PartiallyDownloadedBlock> partialBlock; //! Optional, set when rebuilding from a cmpctblock.
 };
 map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -179,6 +183,31 @@ int nQueuedValidatedHeaders = 0;
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
+/** Peers we asked to announce new blocks with cmpctblock (high-bandwidth mode), oldest first. Protected by cs_main. */
+list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
+/**
+ * The "block" and "cmpctblock" messages for our current tip, serialized once and
+ * queued as-is to every peer it is announced or served to. Protected by cs_main.
+ */
+uint256 hashMostRecentBlock;
+CSerializedNetMsgRef msgMostRecentBlock;
+CSerializedNetMsgRef msgMostRecentCompactBlock;
+
+/**
+ * Blocks downloaded ahead of their parent during headers-first sync. A proof-of-stake
+ * block can only be checked once the chain below it is connected, so these wait here
+ * and are processed in chain order as their parents come in. Protected by cs_main.
+ */
+struct CBlockAwaitingParent {
+    NodeId nodeid;
+    int nHeight;
+    boost::shared_ptr<CBlock> pblock;
+};
+map<uint256, CBlockAwaitingParent> mapBlocksAwaitingParent;
+multimap<uint256, uint256> mapBlocksAwaitingParentByPrev;
+size_t nBlocksAwaitingParentSize = 0;
+
 /** Dirty block index entries. */
 set<CBlockIndex*> setDirtyBlockIndex;
 
@@ -298,6 +327,16 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer can give us compact blocks (it sent us a "sendcmpct").
+    bool fProvidesHeaderAndIDs;
+    //! Whether this peer wants new blocks pushed as "cmpctblock" instead of announced with an inv.
+    bool fPreferHeaderAndIDs;
+    //! Number of "headers" messages in a row from this peer that did not connect to our block index.
+    int nUnconnectingHeaders;
+    //! Index entries created from this peer's headers whose block we did not have yet when last checked.
+    std::vector<CBlockIndex*> vUnvalidatedHeaders;
+    //! Where to continue requesting headers from once vUnvalidatedHeaders has room again, or NULL.
+    CBlockIndex* pindexHeadersDeferred;
 
     CNodeState()
     {
@@ -311,6 +350,10 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
+        nUnconnectingHeaders = 0;
+        pindexHeadersDeferred = NULL;
     }
 };
 
@@ -372,6 +415,7 @@ void FinalizeNode(NodeId nodeid)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -391,7 +435,8 @@ void MarkBlockAsReceived(const uint256& hash)
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL)
+// If ppartialBlock is given, the entry gets a fresh PartiallyDownloadedBlock, returned through it.
+void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL, boost::shared_ptr<PartiallyDownloadedBlock>* ppartialBlock = NULL)
 {
     CNodeState* state = State(nodeid);
     assert(state != NULL);
@@ -399,13 +444,98 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
-    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL};
+    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL, boost::shared_ptr<PartiallyDownloadedBlock>()};
+    if (ppartialBlock) {
+        newentry.partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+        *ppartialBlock = newentry.partialBlock;
+    }
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+// Requires cs_main.
+// Keep a block whose parent we only know the header of until that parent has been processed.
+// When over the memory limit, the blocks furthest ahead are dropped again; they are simply
+// downloaded another time once the download window gets to them.
+void AddBlockAwaitingParent(NodeId nodeid, const CBlock& block, int nHeight)
+{
+    uint256 hash = block.GetHash();
+    if (mapBlocksAwaitingParent.count(hash))
+        return;
+
+    CBlockAwaitingParent entry;
+    entry.nodeid = nodeid;
+    entry.nHeight = nHeight;
+    entry.pblock.reset(new CBlock(block));
+    mapBlocksAwaitingParent.insert(std::make_pair(hash, entry));
+    mapBlocksAwaitingParentByPrev.insert(std::make_pair(block.hashPrevBlock, hash));
+    nBlocksAwaitingParentSize += ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+
+    while (nBlocksAwaitingParentSize > MAX_BLOCKS_AWAITING_PARENT_SIZE) {
+        map<uint256, CBlockAwaitingParent>::iterator itHighest = mapBlocksAwaitingParent.begin();
+        for (map<uint256, CBlockAwaitingParent>::iterator it = mapBlocksAwaitingParent.begin(); it != mapBlocksAwaitingParent.end(); ++it) {
+            if (it->second.nHeight > itHighest->second.nHeight)
+                itHighest = it;
+        }
+        const CBlock& blockEvict = *itHighest->second.pblock;
+        LogPrint("net", "dropping block %s (%d) awaiting its parent, buffer full\n", itHighest->first.ToString(), itHighest->second.nHeight);
+        nBlocksAwaitingParentSize -= ::GetSerializeSize(blockEvict, SER_NETWORK, PROTOCOL_VERSION);
+        pair<multimap<uint256, uint256>::iterator, multimap<uint256, uint256>::iterator> range = mapBlocksAwaitingParentByPrev.equal_range(blockEvict.hashPrevBlock);
+        for (multimap<uint256, uint256>::iterator it = range.first; it != range.second; ++it) {
+            if (it->second == itHighest->first) {
+                mapBlocksAwaitingParentByPrev.erase(it);
+                break;
+            }
+        }
+        mapBlocksAwaitingParent.erase(itHighest);
+    }
+}
+
+// Requires cs_main.
+// Remove and return the buffered children of a block that has just been processed.
+void TakeBlocksAwaitingParent(const uint256& hashParent, std::vector<CBlockAwaitingParent>& vChildren)
+{
+    pair<multimap<uint256, uint256>::iterator, multimap<uint256, uint256>::iterator> range = mapBlocksAwaitingParentByPrev.equal_range(hashParent);
+    for (multimap<uint256, uint256>::iterator it = range.first; it != range.second; ++it) {
+        map<uint256, CBlockAwaitingParent>::iterator itBlock = mapBlocksAwaitingParent.find(it->second);
+        assert(itBlock != mapBlocksAwaitingParent.end());
+        nBlocksAwaitingParentSize -= ::GetSerializeSize(*itBlock->second.pblock, SER_NETWORK, PROTOCOL_VERSION);
+        vChildren.push_back(itBlock->second);
+        mapBlocksAwaitingParent.erase(itBlock);
+    }
+    mapBlocksAwaitingParentByPrev.erase(range.first, range.second);
+}
+
+/**
+ * Ask a peer that just gave us a new tip to push future blocks to us as cmpctblock
+ * (high-bandwidth mode). Once MAX_CMPCTBLOCK_HB_PEERS peers do so, the longest
+ * serving one is switched back to inv announcements. Requires cs_main.
+ */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom)
+{
+    CNodeState* nodestate = State(pfrom->GetId());
+    if (nodestate == NULL || !nodestate->fProvidesHeaderAndIDs)
+        return;
+    if (std::find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), pfrom->GetId()) != lNodesAnnouncingHeaderAndIDs.end())
+        return;
+
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_HB_PEERS) {
+        NodeId nodeOldest = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeOldest) {
+                pnode->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+                break;
+            }
+        }
+    }
+    pfrom->PushMessage("sendcmpct", true, CMPCTBLOCKS_VERSION);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+}
+
 /** Check whether the last unknown block a peer advertized is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid)
 {
@@ -441,6 +571,20 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256& hash)
     }
 }
 
+/** Whether the block of an index entry has been received or found invalid since its header came in. */
+bool static IsHeaderResolved(const CBlockIndex* pindex)
+{
+    return pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_FAILED_MASK);
+}
+
+/** Forget the entries a peer added from headers whose block has since come in, and return how many are left. Requires cs_main. */
+unsigned int CountUnvalidatedHeaders(CNodeState* state)
+{
+    state->vUnvalidatedHeaders.erase(std::remove_if(state->vUnvalidatedHeaders.begin(), state->vUnvalidatedHeaders.end(), IsHeaderResolved),
+        state->vUnvalidatedHeaders.end());
+    return state->vUnvalidatedHeaders.size();
+}
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb)
@@ -523,6 +667,9 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             if (pindex->nStatus & BLOCK_HAVE_DATA) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
+            } else if (mapBlocksAwaitingParent.count(pindex->GetBlockHash())) {
+                // Already downloaded, it only waits for its parent to be processed.
+                continue;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
                 // The block is not already downloaded, and not yet in flight.
                 if (pindex->nHeight > nWindowEnd) {
@@ -1427,13 +1574,11 @@ bool CheckZerocoinSpend(const CTransaction tx, bool fVerifySignature, CValidatio
 
     // Send signal to wallet if this is ours
     if (pwalletMain) {
-        CWalletDB walletdb(pwalletMain->strWalletFile);
-        list <CBigNum> listMySerials = walletdb.ListMintedCoinsSerial();
         for (const auto& newSpend : vSpends) {
-            list<CBigNum>::iterator it = find(listMySerials.begin(), listMySerials.end(), newSpend.getCoinSerialNumber());
-            if (it != listMySerials.end()) {
-                LogPrintf("%s: %s detected spent zerocoin mint in transaction %s \n", __func__, it->GetHex(), tx.GetHash().GetHex());
-                pwalletMain->NotifyZerocoinChanged(pwalletMain, it->GetHex(), "Used", CT_UPDATED);
+            const CBigNum& bnSerial = newSpend.getCoinSerialNumber();
+            if (pwalletMain->zerocoinTracker.HasUnusedSerial(bnSerial)) {
+                LogPrintf("%s: %s detected spent zerocoin mint in transaction %s \n", __func__, bnSerial.GetHex(), tx.GetHash().GetHex());
+                pwalletMain->NotifyZerocoinChanged(pwalletMain, bnSerial.GetHex(), "Used", CT_UPDATED);
             }
         }
     }
@@ -4001,6 +4146,55 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex)
     return true;
 }
 
+/** Compute the ppcoin chain trust, stake entropy bit and stake modifier of a block index entry. */
+void static SetBlockIndexStakeData(CBlockIndex* pindexNew)
+{
+    assert(pindexNew->pprev);
+    uint256 hash = pindexNew->GetBlockHash();
+
+    // ppcoin: compute chain trust score
+    pindexNew->bnChainTrust = pindexNew->pprev->bnChainTrust + pindexNew->GetBlockTrust();
+
+    // ppcoin: compute stake entropy bit for stake modifier
+    if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
+        LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
+
+    // ppcoin: record proof-of-stake hash value
+    if (pindexNew->IsProofOfStake()) {
+        if (!mapProofOfStake.count(hash))
+            LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
+        pindexNew->hashProofOfStake = mapProofOfStake[hash];
+    }
+
+    // ppcoin: compute stake modifier
+    uint64_t nStakeModifier = 0;
+    bool fGeneratedStakeModifier = false;
+    if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
+        LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
+    pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+    pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
+    if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
+        LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, boost::lexical_cast<std::string>(nStakeModifier));
+}
+
+/**
+ * Complete a block index entry that was created from a bare header once the
+ * full block is known: record its proof-of-stake data and recompute its stake
+ * modifier, which could not be derived from the header alone.
+ */
+void static UpdateBlockIndexFromBlock(CBlockIndex* pindex, const CBlock& block)
+{
+    if (block.IsProofOfStake()) {
+        pindex->SetProofOfStake();
+        pindex->prevoutStake = block.vtx[1].vin[0].prevout;
+        pindex->nStakeTime = block.nTime;
+        setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+    }
+    if (pindex->pprev)
+        SetBlockIndexStakeData(pindex);
+    setDirtyBlockIndex.insert(pindex);
+}
+
 CBlockIndex* AddToBlockIndex(const CBlock& block)
 {
     // Check for duplicate
@@ -4032,29 +4226,10 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
 
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
-        // ppcoin: compute stake entropy bit for stake modifier
-        if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
-            LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
-
-        // ppcoin: record proof-of-stake hash value
-        if (pindexNew->IsProofOfStake()) {
-            if (!mapProofOfStake.count(hash))
-                LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
-            pindexNew->hashProofOfStake = mapProofOfStake[hash];
-        }
-
-        // ppcoin: compute stake modifier
-        uint64_t nStakeModifier = 0;
-        bool fGeneratedStakeModifier = false;
-        if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
-            LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
-        pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
-        pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
-        if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
-            LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, boost::lexical_cast<std::string>(nStakeModifier));
+        // A bare header (headers-first sync) does not tell whether the block is
+        // proof-of-stake; its stake data is filled in once the block arrives.
+        if (!block.vtx.empty())
+            SetBlockIndexStakeData(pindexNew);
     }
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
@@ -4405,6 +4580,33 @@ bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
     return true;
 }
 
+bool CheckHeaderWork(const CBlockHeader& header, CBlockIndex* const pindexPrev)
+{
+    if (pindexPrev == NULL)
+        return error("%s : null pindexPrev for header %s", __func__, header.GetHash().ToString().c_str());
+
+    // A header does not carry the coinstake, so whether a block is proof-of-stake can only be
+    // told from its height. The stake kernel itself is checked once the full block arrives.
+    int nHeight = pindexPrev->nHeight + 1;
+    bool fProofOfWork = nHeight <= Params().LAST_POW_BLOCK();
+    unsigned int nBitsRequired = GetNextWorkRequired(pindexPrev, &header);
+
+    if (fProofOfWork && nHeight <= 1001) {
+        double n1 = ConvertBitsToDouble(header.nBits);
+        double n2 = ConvertBitsToDouble(nBitsRequired);
+
+        if (abs(n1 - n2) > n1 * 0.5)
+            return error("%s : incorrect proof of work (DGW pre-fork) - %f %f %f at %d", __func__, abs(n1 - n2), n1, n2, nHeight);
+    } else if (header.nBits != nBitsRequired) {
+        return error("%s : incorrect proof of work at %d", __func__, nHeight);
+    }
+
+    if (fProofOfWork && !CheckProofOfWork(header.GetHash(), header.nBits))
+        return error("%s : proof of work failed at %d", __func__, nHeight);
+
+    return true;
+}
+
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* const pindexPrev)
 {
     uint256 hash = block.GetHash();
@@ -4591,6 +4793,7 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
     if (block.GetHash() != Params().HashGenesisBlock() && !CheckWork(block, pindexPrev))
         return false;
 
+    bool fKnownHeader = mapBlockIndex.count(block.GetHash()) > 0;
     if (!AcceptBlockHeader(block, state, &pindex))
         return false;
 
@@ -4608,6 +4811,11 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         return false;
     }
 
+    // The index entry may have been created from the header alone during headers-first sync.
+    // Only a block that passed the checks above may record its stake as seen.
+    if (fKnownHeader)
+        UpdateBlockIndexFromBlock(pindex, block);
+
     int nHeight = pindex->nHeight;
 
     // Write block to history file
@@ -5570,6 +5778,21 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/** Make sure the shared tip messages are those for pindex, building them if not. Requires cs_main. */
+static bool BuildMostRecentBlockMessages(const CBlockIndex* pindex)
+{
+    if (hashMostRecentBlock == pindex->GetBlockHash())
+        return true;
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex))
+        return false;
+    msgMostRecentBlock = MakeSerializedNetMsg("block", block);
+    msgMostRecentCompactBlock = MakeSerializedNetMsg("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+    hashMostRecentBlock = pindex->GetBlockHash();
+    return true;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -5588,7 +5811,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end()) {
@@ -5607,31 +5830,46 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 // Don't send not-validated blocks
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
-                    {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter) {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage("merkleblock", merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didnt send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                    // Every peer asks for our new tip at about the same time; serve it
+                    // from the shared messages rather than reading and serializing it again
+                    if ((inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK) && mi->second == chainActive.Tip() &&
+                        BuildMostRecentBlockMessages(mi->second)) {
+                        pfrom->PushSerializedMessage(inv.type == MSG_BLOCK ? msgMostRecentBlock : msgMostRecentCompactBlock);
+                    } else {
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
+                        if (inv.type == MSG_BLOCK)
+                            pfrom->PushMessage("block", block);
+                        else if (inv.type == MSG_CMPCT_BLOCK) {
+                            // Older blocks are unlikely to have their transactions in the
+                            // peer's mempool anymore, so send them in full.
+                            if (chainActive.Height() - mi->second->nHeight <= MAX_CMPCTBLOCK_DEPTH) {
+                                CBlockHeaderAndShortTxIDs cmpctblock(block);
+                                pfrom->PushMessage("cmpctblock", cmpctblock);
+                            } else
+                                pfrom->PushMessage("block", block);
+                        } else // MSG_FILTERED_BLOCK)
+                        {
+                            LOCK(pfrom->cs_filter);
+                            if (pfrom->pfilter) {
+                                CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                                pfrom->PushMessage("merkleblock", merkleBlock);
+                                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                                // This avoids hurting performance by pointlessly requiring a round-trip
+                                // Note that there is currently no way for a node to request any single transactions we didnt send here -
+                                // they must either disconnect and retry or request the full block.
+                                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                                // however we MUST always provide at least what the remote peer needs
+                                typedef std::pair<unsigned int, uint256> PairType;
+                                BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
+                                    if (!pfrom->filterInventoryKnown.contains(CInv(MSG_TX, pair.second).GetKey()))
+                                        pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
+                            // else
+                            // no response
                         }
-                        // else
-                        // no response
                     }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
@@ -5650,9 +5888,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSerializedNetMsgRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSerializedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -5783,7 +6021,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             g_signals.Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -5802,6 +6040,100 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Whether to sync with this peer headers-first. Requires cs_main. */
+bool static UseHeadersFirst(const CNode* pnode)
+{
+    return Params().HeadersFirstSyncingActive() && pnode->nVersion >= HEADERS_FIRST_VERSION;
+}
+
+/**
+ * Ask a peer for the headers following pindexFrom, unless the unvalidated headers it already
+ * gave us leave no room for a full "headers" message. The request is then deferred, and sent
+ * from SendMessages once enough of their blocks have come in. Requires cs_main.
+ */
+bool static RequestHeaders(CNode* pnode, CBlockIndex* pindexFrom, const uint256& hashStop)
+{
+    CNodeState* state = State(pnode->GetId());
+    if (CountUnvalidatedHeaders(state) + MAX_HEADERS_RESULTS > MAX_UNVALIDATED_HEADERS_PER_PEER) {
+        state->pindexHeadersDeferred = pindexFrom;
+        return false;
+    }
+    state->pindexHeadersDeferred = NULL;
+    pnode->PushMessage("getheaders", chainActive.GetLocator(pindexFrom), hashStop);
+    return true;
+}
+
+/**
+ * Set a block aside if we only know the header of its parent, which happens when blocks
+ * are downloaded in parallel during headers-first sync. Returns true if the block was
+ * deferred; it is then processed by ProcessBlocksAwaitingParent. Requires cs_main.
+ */
+bool static DeferBlockAwaitingParent(CNode* pfrom, const CBlock& block)
+{
+    BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+    if (mi == mapBlockIndex.end() || (mi->second->nStatus & (BLOCK_HAVE_DATA | BLOCK_FAILED_MASK)))
+        return false;
+
+    MarkBlockAsReceived(block.GetHash());
+    AddBlockAwaitingParent(pfrom->GetId(), block, mi->second->nHeight + 1);
+    LogPrint("net", "block %s from peer=%d waits for its parent %s\n", block.GetHash().ToString(), pfrom->id, block.hashPrevBlock.ToString());
+    return true;
+}
+
+/** Process, in chain order, the deferred descendants of a block that has just been handed to validation. */
+void static ProcessBlocksAwaitingParent(const uint256& hashParent)
+{
+    std::deque<uint256> vWorkQueue(1, hashParent);
+    while (!vWorkQueue.empty()) {
+        std::vector<CBlockAwaitingParent> vChildren;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(vWorkQueue.front());
+            if (mi != mapBlockIndex.end() && (mi->second->nStatus & (BLOCK_HAVE_DATA | BLOCK_FAILED_MASK)))
+                TakeBlocksAwaitingParent(vWorkQueue.front(), vChildren);
+        }
+        vWorkQueue.pop_front();
+
+        BOOST_FOREACH (const CBlockAwaitingParent& child, vChildren) {
+            CValidationState state;
+            ProcessNewBlock(state, NULL, child.pblock.get());
+            int nDoS;
+            if (state.IsInvalid(nDoS) && nDoS > 0) {
+                LOCK(cs_main);
+                Misbehaving(child.nodeid, nDoS);
+            }
+            vWorkQueue.push_back(child.pblock->GetHash());
+        }
+    }
+}
+
+/** Hand a block rebuilt from a cmpctblock (and possibly a blocktxn) to validation, as if received in a "block" message. */
+void static ProcessReconstructedBlock(CNode* pfrom, CBlock& block)
+{
+    {
+        LOCK(cs_main);
+        if (DeferBlockAwaitingParent(pfrom, block))
+            return;
+    }
+
+    CValidationState state;
+    bool fAccepted = ProcessNewBlock(state, pfrom, &block);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", string("block"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain) Misbehaving(pfrom->GetId(), nDoS);
+        }
+    } else if (fAccepted) {
+        LOCK(cs_main);
+        if (chainActive.Tip()->GetBlockHash() == block.GetHash() && !IsInitialBlockDownload())
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
+    }
+    ProcessBlocksAwaitingParent(block.GetHash());
+}
+
 bool fRequestedSporksIDB = false;
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
@@ -5947,6 +6279,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // Tell the peer we understand compact blocks, but only ask it to push them to us
+            // unsolicited once it has proven to be a fast source of new blocks.
+            pfrom->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+        }
     }
 
 
@@ -5978,7 +6316,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the addrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -6023,6 +6361,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         LOCK(cs_main);
 
         std::vector<CInv> vToFetch;
+        bool fHeadersFirst = UseHeadersFirst(pfrom);
+        bool fNearTip = chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20;
 
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++) {
             const CInv& inv = vInv[nInv];
@@ -6039,7 +6379,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
-                if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
+                if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash) && fHeadersFirst) {
+                    // Learn the headers leading up to the block; they let us download it and its
+                    // ancestors in parallel from every peer that has them.
+                    if (RequestHeaders(pfrom, pindexBestHeader, inv.hash))
+                        LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    if (fNearTip && State(pfrom->GetId())->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                        // A new tip most likely builds on ours: fetch it right away instead of waiting for its header.
+                        vToFetch.push_back(inv);
+                        MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
+                    }
+                } else if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
                     // Add this to the list of blocks to request
                     vToFetch.push_back(inv);
                     LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
@@ -6055,6 +6405,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
+        // A single new block announced outside of initial download is most likely built
+        // from transactions already in our mempool: ask for it as a compact block.
+        if (vToFetch.size() == 1 && State(pfrom->GetId())->fProvidesHeaderAndIDs && !IsInitialBlockDownload())
+            vToFetch[0].type = MSG_CMPCT_BLOCK;
+
         if (!vToFetch.empty())
             pfrom->PushMessage("getdata", vToFetch);
     }
@@ -6079,7 +6434,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+    else if (strCommand == "getblocks" || (strCommand == "getheaders" && !Params().HeadersFirstSyncingActive())) {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -6111,7 +6466,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (strCommand == "getheaders" && Params().HeadersFirstSyncingActive()) {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -6329,7 +6684,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // Nothing interesting. Stop asking this peers for more headers.
             return true;
         }
+
+        // Headers that do not connect may follow blocks we missed: ask for the headers leading up
+        // to them. A peer that keeps sending them is feeding us chains that do not exist.
+        CNodeState* nodestate = State(pfrom->GetId());
+        if (!mapBlockIndex.count(headers[0].hashPrevBlock)) {
+            nodestate->nUnconnectingHeaders++;
+            RequestHeaders(pfrom, pindexBestHeader, uint256(0));
+            LogPrint("net", "received header %s from peer=%d that does not connect (%d in a row)\n", headers[0].GetHash().ToString(), pfrom->id, nodestate->nUnconnectingHeaders);
+            if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+                Misbehaving(pfrom->GetId(), 20);
+            return true;
+        }
+        nodestate->nUnconnectingHeaders = 0;
+
         CBlockIndex* pindexLast = NULL;
+        unsigned int nUnvalidated = CountUnvalidatedHeaders(nodestate);
         BOOST_FOREACH (const CBlockHeader& header, headers) {
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
@@ -6337,6 +6707,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 return error("non-continuous headers sequence");
             }
 
+            // Check the difficulty, and the proof of work in the PoW phase, of headers we don't know yet.
+            // The stake of a PoS header can only be checked with its block, so only so many of them
+            // are taken from one peer ahead of the blocks.
+            BlockMap::iterator miPrev = mapBlockIndex.find(header.hashPrevBlock);
+            bool fNew = !mapBlockIndex.count(header.GetHash());
+            if (miPrev != mapBlockIndex.end() && fNew) {
+                if (nUnvalidated >= MAX_UNVALIDATED_HEADERS_PER_PEER) {
+                    if (pindexLast)
+                        UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+                    Misbehaving(pfrom->GetId(), 20);
+                    return error("peer=%d sent more than %u headers whose blocks we do not have", pfrom->id, MAX_UNVALIDATED_HEADERS_PER_PEER);
+                }
+                if (!CheckHeaderWork(header, miPrev->second)) {
+                    Misbehaving(pfrom->GetId(), 50);
+                    return error("header %s has invalid work", header.GetHash().ToString());
+                }
+            }
+
             /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
              * before headers are reimplemented on mainnet
              */
@@ -6349,6 +6737,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     return error(strError.c_str());
                 }
             }
+            if (fNew && pindexLast && !IsHeaderResolved(pindexLast)) {
+                nodestate->vUnvalidatedHeaders.push_back(pindexLast);
+                nUnvalidated++;
+            }
         }
 
         if (pindexLast)
@@ -6358,8 +6750,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // Headers message had its maximum size; the peer may have more headers.
             // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
             // from there instead.
-            LogPrintf("more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
-            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
+            if (RequestHeaders(pfrom, pindexLast, uint256(0)))
+                LogPrintf("more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
+            else
+                LogPrint("net", "getheaders (%d) to peer=%d waits for blocks to be validated\n", pindexLast->nHeight, pfrom->id);
         }
 
         CheckBlockIndex();
@@ -6375,7 +6769,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
         if (!mapBlockIndex.count(block.hashPrevBlock)) {
-            if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
+            LOCK(cs_main);
+            if (UseHeadersFirst(pfrom)) {
+                // Fetch the headers leading up to it; the download logic takes it from there
+                RequestHeaders(pfrom, pindexBestHeader, hashBlock);
+            } else if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
                 //we already asked for this block, so lets work backwards and ask for the previous block
                 pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
                 pfrom->vBlockRequested.push_back(block.hashPrevBlock);
@@ -6387,9 +6785,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         } else {
             pfrom->AddInventoryKnown(inv);
 
+            // With headers-first sync the block is usually already indexed by its header
+            bool fProcess = false;
+            bool fDeferred = false;
+            {
+                LOCK(cs_main);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+                fProcess = mi == mapBlockIndex.end() || !(mi->second->nStatus & (BLOCK_HAVE_DATA | BLOCK_FAILED_MASK));
+                if (fProcess)
+                    fDeferred = DeferBlockAwaitingParent(pfrom, block);
+            }
+
             CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
+            if (fDeferred) {
+                // Processed once its parent has been
+            } else if (fProcess) {
+                bool fAccepted = ProcessNewBlock(state, pfrom, &block);
                 int nDoS;
                 if(state.IsInvalid(nDoS)) {
                     pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
@@ -6398,7 +6809,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                         TRY_LOCK(cs_main, lockMain);
                         if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
                     }
+                } else if (fAccepted) {
+                    LOCK(cs_main);
+                    if (chainActive.Tip()->GetBlockHash() == hashBlock && !IsInitialBlockDownload())
+                        MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
                 }
+                ProcessBlocksAwaitingParent(hashBlock);
                 //disconnect this node if its old protocol version
                 pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
             } else {
@@ -6408,6 +6824,163 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        LogPrint("net", "received cmpctblock %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hashBlock));
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            if (mi != mapBlockIndex.end() && (mi->second->nStatus & (BLOCK_HAVE_DATA | BLOCK_FAILED_MASK)))
+                return true;
+            if (mapBlocksAwaitingParent.count(hashBlock))
+                return true;
+
+            if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+                // We can't connect this block yet, sync up to it like we do for an unconnectable "block"
+                pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
+                return true;
+            }
+
+            CValidationState state;
+            if (!CheckBlockHeader(cmpctblock.header, state, false)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid cmpctblock header received %s", hashBlock.ToString());
+            }
+
+            // Only rebuild a block once, from the first peer that gives it to us.
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+            if (itInFlight != mapBlocksInFlight.end() && (itInFlight->second.first != pfrom->GetId() || itInFlight->second.second->partialBlock))
+                return true;
+
+            boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;
+            MarkBlockAsInFlight(pfrom->GetId(), hashBlock, NULL, &partialBlock);
+            ReadStatus status = partialBlock->InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(hashBlock);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us an invalid cmpctblock", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Short id collision; the block is in flight from this peer, so just ask for all of it
+                pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hashBlock)));
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (req.indexes.empty()) {
+                if (partialBlock->FillBlock(block, vector<CTransaction>()) == READ_STATUS_OK) {
+                    MarkBlockAsReceived(hashBlock);
+                    fBlockReconstructed = true;
+                } else {
+                    pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hashBlock)));
+                }
+            } else {
+                req.blockhash = hashBlock;
+                pfrom->PushMessage("getblocktxn", req);
+            }
+        }
+
+        if (fBlockReconstructed)
+            ProcessReconstructedBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // Too deep for a partial answer, which peers only ask for near the tip; send the whole block.
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+            if (itInFlight == mapBlocksInFlight.end() || !itInFlight->second.second->partialBlock || itInFlight->second.first != pfrom->GetId()) {
+                LogPrint("net", "peer=%d sent us block transactions for a block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            ReadStatus status = itInFlight->second.second->partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us block transactions not matching its cmpctblock", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Probably a short id collision, fall back to the full block
+                pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+            } else {
+                MarkBlockAsReceived(resp.blockhash);
+                fBlockReconstructed = true;
+            }
+        }
+
+        if (fBlockReconstructed)
+            ProcessReconstructedBlock(pfrom, block);
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages.
@@ -6657,6 +7230,72 @@ int ActiveProtocol()
     return MIN_PEER_PROTO_VERSION_BEFORE_ENFORCEMENT;
 }
 
+// Hand the signatures of the masternode gossip a peer has sent to the recovery threads, so
+// they are recovered while the messages ahead of them are being processed. Only the first
+// SIGRECOVERY_MAX_PEER_AHEAD messages of the peer are looked at, and the recovery queue
+// drops signatures beyond SIGRECOVERY_MAX_QUEUED. The decoded message is kept with the
+// message, so its handler does not decode it again.
+// requires LOCK(pfrom->cs_vRecvMsg)
+static void QueueGossipSignatures(CNode* pfrom)
+{
+    unsigned int nAhead = 0;
+    BOOST_FOREACH (CNetMessage& msg, pfrom->vRecvMsg) {
+        if (!msg.complete() || ++nAhead > SIGRECOVERY_MAX_PEER_AHEAD)
+            break;
+        if (msg.fSignaturesQueued)
+            continue;
+        msg.fSignaturesQueued = true;
+
+        string strCommand = msg.hdr.GetCommand();
+        if (strCommand != "mnb" && strCommand != "mnp" && strCommand != "mnw" &&
+            strCommand != "mvote" && strCommand != "fbvote" && strCommand != "spork" && strCommand != "txlvote")
+            continue;
+
+        try {
+            CDataStream vRecv(msg.vRecv.begin(), msg.vRecv.end(), msg.vRecv.GetType(), msg.vRecv.GetVersion());
+            if (strCommand == "mnb") {
+                CMasternodeBroadcast mnb;
+                vRecv >> mnb;
+                signatureRecoveryQueue.Add(mnb.GetStrMessage(), mnb.sig);
+                signatureRecoveryQueue.Add(mnb.lastPing.GetStrMessage(), mnb.lastPing.vchSig);
+                msg.gossip = mnb;
+            } else if (strCommand == "mnp") {
+                CMasternodePing mnp;
+                vRecv >> mnp;
+                signatureRecoveryQueue.Add(mnp.GetStrMessage(), mnp.vchSig);
+                msg.gossip = mnp;
+            } else if (strCommand == "mnw") {
+                CMasternodePaymentWinner winner;
+                vRecv >> winner;
+                signatureRecoveryQueue.Add(winner.GetStrMessage(), winner.vchSig);
+                msg.gossip = winner;
+            } else if (strCommand == "mvote") {
+                CBudgetVote vote;
+                vRecv >> vote;
+                signatureRecoveryQueue.Add(vote.GetStrMessage(), vote.vchSig);
+                msg.gossip = vote;
+            } else if (strCommand == "fbvote") {
+                CFinalizedBudgetVote vote;
+                vRecv >> vote;
+                signatureRecoveryQueue.Add(vote.GetStrMessage(), vote.vchSig);
+                msg.gossip = vote;
+            } else if (strCommand == "spork") {
+                CSporkMessage spork;
+                vRecv >> spork;
+                signatureRecoveryQueue.Add(spork.GetStrMessage(), spork.vchSig);
+                msg.gossip = spork;
+            } else if (strCommand == "txlvote") {
+                CConsensusVote vote;
+                vRecv >> vote;
+                signatureRecoveryQueue.Add(vote.GetStrMessage(), vote.vchMasterNodeSignature);
+                msg.gossip = vote;
+            }
+        } catch (const std::exception&) {
+            // Malformed, ProcessMessage will reject it when it gets there
+        }
+    }
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -6679,6 +7318,8 @@ bool ProcessMessages(CNode* pfrom)
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
+    QueueGossipSignatures(pfrom);
+
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -6729,7 +7370,8 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
-        // Process message
+        // Process message, with the gossip decoded ahead of it at hand
+        pfrom->gossipDecoded.swap(msg.gossip);
         bool fRet = false;
         try {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -6752,6 +7394,7 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        pfrom->gossipDecoded = boost::any();
 
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
@@ -6812,9 +7455,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60)) {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
+                // Periodically clear addrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                    pnode->addrKnown.reset();
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -6830,8 +7473,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
+                if (!pto->addrKnown.contains(addr.GetKey())) {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000) {
@@ -6873,13 +7516,23 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (UseHeadersFirst(pto)) {
+                    CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    RequestHeaders(pto, pindexStart, uint256(0));
+                } else {
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                }
             }
         }
 
+        // Continue a header download that waited for the blocks of earlier headers
+        if (state.pindexHeadersDeferred != NULL) {
+            CBlockIndex* pindexFrom = state.pindexHeadersDeferred;
+            if (RequestHeaders(pto, pindexFrom, uint256(0)))
+                LogPrint("net", "resumed getheaders (%d) to peer=%d\n", pindexFrom->nHeight, pto->id);
+        }
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -6890,48 +7543,70 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: inventory
         //
+        // Transactions are announced in batches at Poisson distributed times, independently per
+        // peer, so that announcement timing reveals less about where a transaction came from and
+        // busy nodes send fewer, larger inv messages. Everything else goes out right away.
+        int64_t nNow = GetTimeMicros();
+        bool fSendTxInv = pto->fWhitelisted;
+        if (pto->nNextInvSend < nNow) {
+            fSendTxInv = true;
+            pto->nNextInvSend = PoissonNextSend(nNow, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL >> 1);
+        }
         vector<CInv> vInv;
+        vector<CInv> vInvTx;
         vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
+            vInv.reserve(std::min<size_t>(pto->vInventoryToSend.size(), MAX_INV_SEND));
             BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.GetKey()))
                     continue;
 
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle) {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait) {
-                        vInvWait.push_back(inv);
+                // Push our new tip straight to peers that asked for compact blocks, saving them a getdata round trip
+                if (inv.type == MSG_BLOCK && state.fPreferHeaderAndIDs && inv.hash == chainActive.Tip()->GetBlockHash()) {
+                    if (BuildMostRecentBlockMessages(chainActive.Tip())) {
+                        pto->filterInventoryKnown.insert(inv.GetKey());
+                        pto->PushSerializedMessage(msgMostRecentCompactBlock);
                         continue;
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
+                if (inv.type == MSG_TX) {
+                    if (fSendTxInv)
+                        vInvTx.push_back(inv);
+                    else
+                        vInvWait.push_back(inv);
+                    continue;
+                }
+
+                if (!pto->filterInventoryKnown.contains(inv.GetKey())) {
+                    pto->filterInventoryKnown.insert(inv.GetKey());
                     vInv.push_back(inv);
-                    if (vInv.size() >= 1000) {
+                    if (vInv.size() >= MAX_INV_SEND) {
                         pto->PushMessage("inv", vInv);
                         vInv.clear();
                     }
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.swap(vInvWait);
+
+            // Shuffle the batch so its order doesn't reveal the order we learned of the transactions in
+            std::random_shuffle(vInvTx.begin(), vInvTx.end(), GetRandInt);
+            BOOST_FOREACH (const CInv& inv, vInvTx) {
+                if (pto->filterInventoryKnown.contains(inv.GetKey()))
+                    continue;
+                pto->filterInventoryKnown.insert(inv.GetKey());
+                vInv.push_back(inv);
+                if (vInv.size() >= MAX_INV_SEND) {
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
+                }
+            }
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
 
         // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -98,15 +98,34 @@ static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached their tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of "headers" messages in a row that do not connect before the sending peer is penalized. */
+static const int MAX_UNCONNECTING_HEADERS = 10;
+/** Maximum number of entries a single peer may add to the block index from headers whose block we do
+ *  not have yet. Proof-of-stake headers cannot be verified without their block, so this bounds what a
+ *  peer can make us index for free. Must leave room for a full "headers" message ahead of the download. */
+static const unsigned int MAX_UNVALIDATED_HEADERS_PER_PEER = 2 * MAX_HEADERS_RESULTS;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum total serialized size of blocks kept in memory while they wait for their parent to be processed. */
+static const unsigned int MAX_BLOCKS_AWAITING_PARENT_SIZE = 64 * 1000 * 1000;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
+/** Average delay between batched transaction inv announcements to a peer, in seconds. Outbound
+ *  peers get half this delay; blocks, SwiftTX and masternode messages are announced right away. */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of entries in a single inv message. */
+static const unsigned int MAX_INV_SEND = 1000;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
+/** Maximum depth below the tip at which a getdata for MSG_CMPCT_BLOCK is answered with a cmpctblock. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth below the tip at which getblocktxn requests are answered with a blocktxn. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of peers asked to push new blocks to us as cmpctblock, without an inv round trip. */
+static const unsigned int MAX_CMPCTBLOCK_HB_PEERS = 3;
 
 /** Enable bloom filter */
  static const bool DEFAULT_PEERBLOOMFILTERS = true;
@@ -217,7 +236,8 @@ bool ProcessMessages(CNode* pfrom);
  * Send queued protocol messages to be sent to a give node.
  *
  * @param[in]   pto             The node which we are sending messages to.
- * @param[in]   fSendTrickle    When true send the trickled data, otherwise trickle the data until true.
+ * @param[in]   fSendTrickle    When true send the trickled addr data, otherwise trickle the data until true.
+ *                              Transaction invs are batched per peer on their own schedule.
  */
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
@@ -472,6 +492,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckSig = true);
 bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev);
+/** Check the difficulty of a bare header, and its proof of work when it is below the last PoW height */
+bool CheckHeaderWork(const CBlockHeader& header, CBlockIndex* const pindexPrev);
 
 /** Context-dependent validity checks */
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* pindexPrev);
@@ -96,28 +96,26 @@ bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, s
     }
 }
 
-void CBudgetManager::CheckOrphanVotes()
+void CBudgetManager::CheckOrphanVotes(const uint256& nHash)
 {
     LOCK(cs);
 
-
     std::string strError = "";
-    std::map<uint256, CBudgetVote>::iterator it1 = mapOrphanMasternodeBudgetVotes.begin();
-    while (it1 != mapOrphanMasternodeBudgetVotes.end()) {
-        if (budget.UpdateProposal(((*it1).second), NULL, strError)) {
+    std::vector<uint256> vOrphans;
+    mapOrphanMasternodeBudgetVotes.find_by_parent(nHash, vOrphans);
+    BOOST_FOREACH (const uint256& hash, vOrphans) {
+        if (UpdateProposal(mapOrphanMasternodeBudgetVotes[hash], NULL, strError)) {
             LogPrint("masternode","CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
-            mapOrphanMasternodeBudgetVotes.erase(it1++);
-        } else {
-            ++it1;
+            mapOrphanMasternodeBudgetVotes.erase(hash);
         }
     }
-    std::map<uint256, CFinalizedBudgetVote>::iterator it2 = mapOrphanFinalizedBudgetVotes.begin();
-    while (it2 != mapOrphanFinalizedBudgetVotes.end()) {
-        if (budget.UpdateFinalizedBudget(((*it2).second), NULL, strError)) {
+
+    vOrphans.clear();
+    mapOrphanFinalizedBudgetVotes.find_by_parent(nHash, vOrphans);
+    BOOST_FOREACH (const uint256& hash, vOrphans) {
+        if (UpdateFinalizedBudget(mapOrphanFinalizedBudgetVotes[hash], NULL, strError)) {
             LogPrint("masternode","CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
-            mapOrphanFinalizedBudgetVotes.erase(it2++);
-        } else {
-            ++it2;
+            mapOrphanFinalizedBudgetVotes.erase(hash);
         }
     }
     LogPrint("masternode","CBudgetManager::CheckOrphanVotes - Done\n");
@@ -249,7 +247,8 @@ void CBudgetManager::SubmitFinalBudget()
 CBudgetDB::CBudgetDB()
 {
     pathDB = GetDataDir() / "budget.dat";
-    strMagicMessage = "MasternodeBudget";
+    strMagicMessage = "MasternodeBudgetSnapshot";
+    strLegacyMagicMessage = "MasternodeBudget";
 }
 
 bool CBudgetDB::Write(const CBudgetManager& objToSave)
@@ -258,23 +257,20 @@ bool CBudgetDB::Write(const CBudgetManager& objToSave)
 
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
     // open output file, and associate with CAutoFile
     FILE* file = fopen(pathDB.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
         return error("%s : Failed to open file %s", __func__, pathDB.string());
 
-    // Write and commit header, data
+    // stream the data to the file, checksumming it on the way, then append the checksum
     try {
-        fileout << ssObj;
+        CSnapshotWriter ssObj(&fileout);
+        ssObj << strMagicMessage;                   // masternode cache file specific magic message
+        ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
+        ssObj << MASTERNODE_SNAPSHOT_VERSION;
+        objToSave.WriteSnapshot(ssObj);
+        fileout << ssObj.GetHash();
     } catch (std::exception& e) {
         return error("%s : Serialize or I/O error - %s", __func__, e.what());
     }
@@ -298,44 +294,25 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
         return FileError;
     }
 
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
+    CSnapshotReader ssObj(&filein);
+    unsigned char pchMsgTmp[4];
+    std::string strMagicMessageTmp;
+    int nSnapshotVersion;
+    bool fLegacy = false;
 
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
+    // the whole file is checked against its checksum before anything is read into objToLoad
+    if (!VerifySnapshotChecksum(filein)) {
         error("%s : Checksum mismatch, data corrupted", __func__);
         return IncorrectHash;
     }
 
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
     try {
         // de-serialize file header (masternode cache file specific magic message) and ..
         ssObj >> strMagicMessageTmp;
 
         // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
+        fLegacy = strMagicMessageTmp == strLegacyMagicMessage;
+        if (!fLegacy && strMagicMessage != strMagicMessageTmp) {
             error("%s : Invalid masternode cache magic message", __func__);
             return IncorrectMagicMessage;
         }
@@ -350,14 +327,27 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
             return IncorrectMagicNumber;
         }
 
-        // de-serialize data into CBudgetManager object
-        ssObj >> objToLoad;
+        if (fLegacy) {
+            // a file in the format before the snapshot one is read once and written back in the new format
+            objToLoad.ReadLegacy(ssObj, !fDryRun);
+        } else {
+            ssObj >> nSnapshotVersion;
+            if (nSnapshotVersion != MASTERNODE_SNAPSHOT_VERSION) {
+                error("%s : Unsupported budget cache version %d", __func__, nSnapshotVersion);
+                return IncorrectFormat;
+            }
+
+            // de-serialize data into CBudgetManager object; a dry run only checks the seen messages
+            objToLoad.ReadSnapshot(ssObj, !fDryRun);
+        }
     } catch (std::exception& e) {
         objToLoad.Clear();
         error("%s : Deserialize or I/O error - %s", __func__, e.what());
         return IncorrectFormat;
     }
 
+    filein.fclose();
+
     LogPrint("masternode","Loaded info from budget.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", objToLoad.ToString());
     if (!fDryRun) {
@@ -366,6 +356,10 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
         LogPrint("masternode","Budget manager - result:\n");
         LogPrint("masternode","  %s\n", objToLoad.ToString());
     }
+    if (fLegacy && !fDryRun) {
+        LogPrintf("budget.dat was in the old format, writing it in the new one\n");
+        Write(objToLoad);
+    }
 
     return Ok;
 }
@@ -397,6 +391,189 @@ void DumpBudgets()
     LogPrint("masternode","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
+// Whether a seen vote is still the vote its proposal or budget counts
+template <typename Vote, typename Parent>
+static bool IsCountedVote(const uint256& hash, const Vote& vote, const std::map<uint256, Parent>& mapParents, uint256 Vote::*pParentHash)
+{
+    typename std::map<uint256, Parent>::const_iterator pi = mapParents.find(vote.*pParentHash);
+    if (pi == mapParents.end())
+        return false;
+    typename std::map<uint256, Vote>::const_iterator vi = pi->second.mapVotes.find(vote.vin.prevout.GetHash());
+    return vi != pi->second.mapVotes.end() && vi->second.vchSig == vote.vchSig && vi->second.GetHash() == hash;
+}
+
+// Seen proposals and budgets are kept from expiring while they are known
+template <typename Parent>
+struct KeepKnownParent {
+    const std::map<uint256, Parent>& mapParents;
+    KeepKnownParent(const std::map<uint256, Parent>& mapParentsIn) : mapParents(mapParentsIn) {}
+    template <typename Item>
+    bool operator()(const std::pair<const uint256, Item>& item) const { return mapParents.count(item.first) > 0; }
+};
+
+// Seen votes are kept from expiring while they are counted, peers syncing with us still ask for them
+template <typename Vote, typename Parent>
+struct KeepCountedVote {
+    const std::map<uint256, Parent>& mapParents;
+    uint256 Vote::*pParentHash;
+    KeepCountedVote(const std::map<uint256, Parent>& mapParentsIn, uint256 Vote::*pParentHashIn) : mapParents(mapParentsIn), pParentHash(pParentHashIn) {}
+    bool operator()(const std::pair<const uint256, Vote>& item) const { return IsCountedVote(item.first, item.second, mapParents, pParentHash); }
+};
+
+// The seen maps hold on to what is still known or counted, both on expiry and when they are full
+CBudgetManager::CBudgetManager() : mapSeenMasternodeBudgetProposals(BUDGET_SEEN_MAX_ITEMS, BUDGET_SEEN_EXPIRY_SECONDS, KeepKnownParent<CBudgetProposal>(mapProposals)),
+                                   mapSeenMasternodeBudgetVotes(BUDGET_SEEN_MAX_VOTES, BUDGET_SEEN_EXPIRY_SECONDS, KeepCountedVote<CBudgetVote, CBudgetProposal>(mapProposals, &CBudgetVote::nProposalHash)),
+                                   mapSeenFinalizedBudgets(BUDGET_SEEN_MAX_ITEMS, BUDGET_SEEN_EXPIRY_SECONDS, KeepKnownParent<CFinalizedBudget>(mapFinalizedBudgets)),
+                                   mapSeenFinalizedBudgetVotes(BUDGET_SEEN_MAX_VOTES, BUDGET_SEEN_EXPIRY_SECONDS, KeepCountedVote<CFinalizedBudgetVote, CFinalizedBudget>(mapFinalizedBudgets, &CFinalizedBudgetVote::nBudgetHash)),
+                                   mapOrphanMasternodeBudgetVotes(BUDGET_ORPHAN_MAX_VOTES, BUDGET_ORPHAN_VOTE_EXPIRY_SECONDS),
+                                   mapOrphanFinalizedBudgetVotes(BUDGET_ORPHAN_MAX_VOTES, BUDGET_ORPHAN_VOTE_EXPIRY_SECONDS)
+{
+    mapProposals.clear();
+    mapFinalizedBudgets.clear();
+}
+
+void CBudgetManager::ExpireSeen()
+{
+    LOCK(cs);
+
+    int nExpired = mapSeenMasternodeBudgetProposals.expire();
+    nExpired += mapSeenFinalizedBudgets.expire();
+    nExpired += mapSeenMasternodeBudgetVotes.expire();
+    nExpired += mapSeenFinalizedBudgetVotes.expire();
+    nExpired += mapOrphanMasternodeBudgetVotes.expire();
+    nExpired += mapOrphanFinalizedBudgetVotes.expire();
+
+    LogPrint("mnbudget", "CBudgetManager::ExpireSeen - %d expired\n", nExpired);
+}
+
+// Seen votes that are still the vote their proposal or budget counts are written as their hash only
+template <typename Vote, typename Parent>
+static void WriteSeenVotes(CSnapshotWriter& s, const expiringmap<uint256, Vote>& mapSeen, const std::map<uint256, Parent>& mapParents, uint256 Vote::*pParentHash)
+{
+    std::vector<typename expiringmap<uint256, Vote>::const_iterator> vUncounted;
+    CSnapshotChunkWriter counted(s);
+    for (typename expiringmap<uint256, Vote>::const_iterator it = mapSeen.begin(); it != mapSeen.end(); ++it) {
+        if (IsCountedVote(it->first, it->second, mapParents, pParentHash))
+            counted.Add(it->first);
+        else
+            vUncounted.push_back(it);
+    }
+    counted.Finish();
+
+    CSnapshotChunkWriter uncounted(s);
+    for (unsigned int i = 0; i < vUncounted.size(); i++)
+        uncounted.Add(vUncounted[i]->first, vUncounted[i]->second);
+    uncounted.Finish();
+}
+
+template <typename Vote, typename Parent>
+static void ReadSeenVotes(CSnapshotReader& s, expiringmap<uint256, Vote>& mapSeen, const std::map<uint256, Parent>& mapParents)
+{
+    std::map<uint256, const Vote*> mapCounted;
+    for (typename std::map<uint256, Parent>::const_iterator pi = mapParents.begin(); pi != mapParents.end(); ++pi) {
+        for (typename std::map<uint256, Vote>::const_iterator vi = pi->second.mapVotes.begin(); vi != pi->second.mapVotes.end(); ++vi)
+            mapCounted[vi->second.GetHash()] = &vi->second;
+    }
+
+    CSnapshotChunkReader counted(s);
+    uint256 hash;
+    while (counted.Next(hash)) {
+        typename std::map<uint256, const Vote*>::const_iterator it = mapCounted.find(hash);
+        if (it != mapCounted.end())
+            mapSeen.insert(std::make_pair(hash, *it->second));
+    }
+    ReadSnapshotMap(s, mapSeen);
+}
+
+// Orphan votes are filed under the proposal or budget they wait for again
+template <typename Vote>
+static void InsertOrphanVotes(const std::map<uint256, Vote>& mapRead, expiringmap<uint256, Vote>& mapOrphans, uint256 Vote::*pParentHash)
+{
+    for (typename std::map<uint256, Vote>::const_iterator it = mapRead.begin(); it != mapRead.end(); ++it)
+        mapOrphans.insert(std::make_pair(it->second.GetHash(), it->second), it->second.*pParentHash);
+}
+
+template <typename Item>
+static void InsertSeen(const std::map<uint256, Item>& mapRead, expiringmap<uint256, Item>& mapSeen)
+{
+    for (typename std::map<uint256, Item>::const_iterator it = mapRead.begin(); it != mapRead.end(); ++it)
+        mapSeen.insert(*it);
+}
+
+template <typename Vote>
+static void ReadOrphanVotes(CSnapshotReader& s, expiringmap<uint256, Vote>& mapOrphans, uint256 Vote::*pParentHash)
+{
+    std::map<uint256, Vote> mapRead;
+    ReadSnapshotMap(s, mapRead);
+    InsertOrphanVotes(mapRead, mapOrphans, pParentHash);
+}
+
+void CBudgetManager::WriteSnapshot(CSnapshotWriter& s) const
+{
+    LOCK(cs);
+
+    WriteSnapshotMap(s, mapProposals);
+    WriteSnapshotMap(s, mapFinalizedBudgets);
+    WriteSnapshotMap(s, mapOrphanMasternodeBudgetVotes);
+    WriteSnapshotMap(s, mapOrphanFinalizedBudgetVotes);
+
+    // the seen messages go last, so a reader that does not need them can step over the rest
+    WriteSnapshotMap(s, mapSeenMasternodeBudgetProposals);
+    WriteSnapshotMap(s, mapSeenFinalizedBudgets);
+    WriteSeenVotes(s, mapSeenMasternodeBudgetVotes, mapProposals, &CBudgetVote::nProposalHash);
+    WriteSeenVotes(s, mapSeenFinalizedBudgetVotes, mapFinalizedBudgets, &CFinalizedBudgetVote::nBudgetHash);
+}
+
+void CBudgetManager::ReadSnapshot(CSnapshotReader& s, bool fLoadSeen)
+{
+    LOCK(cs);
+    Clear();
+
+    ReadSnapshotMap(s, mapProposals);
+    ReadSnapshotMap(s, mapFinalizedBudgets);
+    ReadOrphanVotes(s, mapOrphanMasternodeBudgetVotes, &CBudgetVote::nProposalHash);
+    ReadOrphanVotes(s, mapOrphanFinalizedBudgetVotes, &CFinalizedBudgetVote::nBudgetHash);
+
+    if (!fLoadSeen) {
+        // seen proposals and budgets, then the counted and uncounted seen votes of each kind
+        for (int i = 0; i < 6; i++)
+            CSnapshotChunkReader(s).Skip();
+        return;
+    }
+
+    ReadSnapshotMap(s, mapSeenMasternodeBudgetProposals);
+    ReadSnapshotMap(s, mapSeenFinalizedBudgets);
+    ReadSeenVotes(s, mapSeenMasternodeBudgetVotes, mapProposals);
+    ReadSeenVotes(s, mapSeenFinalizedBudgetVotes, mapFinalizedBudgets);
+}
+
+void CBudgetManager::ReadLegacy(CSnapshotReader& s, bool fLoadSeen)
+{
+    LOCK(cs);
+    Clear();
+
+    // the seen messages came first and were written as plain maps, so they are read even when they are not kept
+    std::map<uint256, CBudgetProposalBroadcast> mapProposalBroadcasts;
+    std::map<uint256, CBudgetVote> mapProposalVotes;
+    std::map<uint256, CFinalizedBudgetBroadcast> mapBudgetBroadcasts;
+    std::map<uint256, CFinalizedBudgetVote> mapBudgetVotes;
+    std::map<uint256, CBudgetVote> mapProposalOrphans;
+    std::map<uint256, CFinalizedBudgetVote> mapBudgetOrphans;
+    s >> mapProposalBroadcasts >> mapProposalVotes >> mapBudgetBroadcasts >> mapBudgetVotes;
+    s >> mapProposalOrphans >> mapBudgetOrphans;
+    s >> mapProposals >> mapFinalizedBudgets;
+
+    InsertOrphanVotes(mapProposalOrphans, mapOrphanMasternodeBudgetVotes, &CBudgetVote::nProposalHash);
+    InsertOrphanVotes(mapBudgetOrphans, mapOrphanFinalizedBudgetVotes, &CFinalizedBudgetVote::nBudgetHash);
+    if (!fLoadSeen)
+        return;
+
+    InsertSeen(mapProposalBroadcasts, mapSeenMasternodeBudgetProposals);
+    InsertSeen(mapProposalVotes, mapSeenMasternodeBudgetVotes);
+    InsertSeen(mapBudgetBroadcasts, mapSeenFinalizedBudgets);
+    InsertSeen(mapBudgetVotes, mapSeenFinalizedBudgetVotes);
+}
+
 bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
 {
     std::string strError = "";
@@ -907,6 +1084,7 @@ void CBudgetManager::NewBlock()
 
 
     CheckAndRemove();
+    ExpireSeen();
 
     //remove invalid votes once in a while (we have to check the signatures and validity of every vote, somewhat CPU intensive)
 
@@ -1047,12 +1225,13 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         LogPrint("masternode","mprop - new budget - %s\n", budgetProposalBroadcast.GetHash().ToString());
 
         //We might have active votes for this proposal that are valid now
-        CheckOrphanVotes();
+        CheckOrphanVotes(budgetProposalBroadcast.GetHash());
     }
 
     if (strCommand == "mvote") { //Masternode Vote
         CBudgetVote vote;
-        vRecv >> vote;
+        if (!pfrom->TakeDecoded(vote))
+            vRecv >> vote;
         vote.fValid = true;
 
         if (mapSeenMasternodeBudgetVotes.count(vote.GetHash())) {
@@ -1067,8 +1246,6 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             return;
         }
 
-
-        mapSeenMasternodeBudgetVotes.insert(make_pair(vote.GetHash(), vote));
         if (!vote.SignatureValid(true)) {
             LogPrint("masternode","mvote - signature invalid\n");
             if (masternodeSync.IsSynced()) Misbehaving(pfrom->GetId(), 20);
@@ -1076,6 +1253,8 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             mnodeman.AskForMN(pfrom, vote.vin);
             return;
         }
+        // only signed votes are remembered, so forged ones cannot push counted votes out of the bounded map
+        mapSeenMasternodeBudgetVotes.insert(make_pair(vote.GetHash(), vote));
 
         std::string strError = "";
         if (UpdateProposal(vote, pfrom, strError)) {
@@ -1120,12 +1299,13 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         masternodeSync.AddedBudgetItem(finalizedBudgetBroadcast.GetHash());
 
         //we might have active votes for this budget that are now valid
-        CheckOrphanVotes();
+        CheckOrphanVotes(finalizedBudgetBroadcast.GetHash());
     }
 
     if (strCommand == "fbvote") { //Finalized Budget Vote
         CFinalizedBudgetVote vote;
-        vRecv >> vote;
+        if (!pfrom->TakeDecoded(vote))
+            vRecv >> vote;
         vote.fValid = true;
 
         if (mapSeenFinalizedBudgetVotes.count(vote.GetHash())) {
@@ -1140,7 +1320,6 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             return;
         }
 
-        mapSeenFinalizedBudgetVotes.insert(make_pair(vote.GetHash(), vote));
         if (!vote.SignatureValid(true)) {
             LogPrint("masternode","fbvote - signature invalid\n");
             if (masternodeSync.IsSynced()) Misbehaving(pfrom->GetId(), 20);
@@ -1148,6 +1327,8 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             mnodeman.AskForMN(pfrom, vote.vin);
             return;
         }
+        // only signed votes are remembered, so forged ones cannot push counted votes out of the bounded map
+        mapSeenFinalizedBudgetVotes.insert(make_pair(vote.GetHash(), vote));
 
         std::string strError = "";
         if (UpdateFinalizedBudget(vote, pfrom, strError)) {
@@ -1323,7 +1504,7 @@ bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string
             if (!masternodeSync.IsSynced()) return false;
 
             LogPrint("masternode","CBudgetManager::UpdateProposal - Unknown proposal %d, asking for source proposal\n", vote.nProposalHash.ToString());
-            mapOrphanMasternodeBudgetVotes[vote.nProposalHash] = vote;
+            mapOrphanMasternodeBudgetVotes.insert(make_pair(vote.GetHash(), vote), vote.nProposalHash);
 
             if (!askedForSourceProposalOrBudget.count(vote.nProposalHash)) {
                 pfrom->PushMessage("mnvs", vote.nProposalHash);
@@ -1350,7 +1531,7 @@ bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pf
             if (!masternodeSync.IsSynced()) return false;
 
             LogPrint("masternode","CBudgetManager::UpdateFinalizedBudget - Unknown Finalized Proposal %s, asking for source budget\n", vote.nBudgetHash.ToString());
-            mapOrphanFinalizedBudgetVotes[vote.nBudgetHash] = vote;
+            mapOrphanFinalizedBudgetVotes.insert(make_pair(vote.GetHash(), vote), vote.nBudgetHash);
 
             if (!askedForSourceProposalOrBudget.count(vote.nBudgetHash)) {
                 pfrom->PushMessage("mnvs", vote.nBudgetHash);
@@ -1373,6 +1554,7 @@ CBudgetProposal::CBudgetProposal()
     nAmount = 0;
     nTime = 0;
     fValid = true;
+    RecountVotes();
 }
 
 CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strURLIn, int nBlockStartIn, int nBlockEndIn, CScript addressIn, CAmount nAmountIn, uint256 nFeeTXHashIn)
@@ -1385,6 +1567,7 @@ CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strU
     nAmount = nAmountIn;
     nFeeTXHash = nFeeTXHashIn;
     fValid = true;
+    RecountVotes();
 }
 
 CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
@@ -1399,6 +1582,7 @@ CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
     nFeeTXHash = other.nFeeTXHash;
     mapVotes = other.mapVotes;
     fValid = true;
+    RecountVotes();
 }
 
 bool CBudgetProposal::IsValid(std::string& strError, bool fCheckCollateral)
@@ -1505,78 +1689,69 @@ bool CBudgetProposal::AddOrUpdateVote(CBudgetVote& vote, std::string& strError)
         return false;
     }
 
-    mapVotes[hash] = vote;
+    std::map<uint256, CBudgetVote>::iterator it = mapVotes.find(hash);
+    if (it != mapVotes.end()) {
+        CountVote(it->second, -1);
+        it->second = vote;
+    } else
+        it = mapVotes.insert(std::make_pair(hash, vote)).first;
+    CountVote(it->second, 1);
     LogPrint("mnbudget", "CBudgetProposal::AddOrUpdateVote - %s %s\n", strAction.c_str(), vote.GetHash().ToString().c_str());
 
     return true;
 }
 
-// If masternode voted for a proposal, but is now invalid -- remove the vote
-void CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
+void CBudgetProposal::CountVote(const CBudgetVote& vote, int nSign)
 {
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-
-    while (it != mapVotes.end()) {
-        (*it).second.fValid = (*it).second.SignatureValid(fSignatureCheck);
-        ++it;
-    }
+    if (vote.nVote == VOTE_YES) {
+        nYeasTotal += nSign;
+        if (vote.fValid) nYeas += nSign;
+    } else if (vote.nVote == VOTE_NO) {
+        nNaysTotal += nSign;
+        if (vote.fValid) nNays += nSign;
+    } else if (vote.nVote == VOTE_ABSTAIN && vote.fValid)
+        nAbstains += nSign;
 }
 
-double CBudgetProposal::GetRatio()
+void CBudgetProposal::RecountVotes()
 {
-    int yeas = 0;
-    int nays = 0;
+    nYeas = nNays = nAbstains = 0;
+    nYeasTotal = nNaysTotal = 0;
+    nListVersionChecked = -1;
 
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-
     while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES) yeas++;
-        if ((*it).second.nVote == VOTE_NO) nays++;
+        CountVote((*it).second, 1);
         ++it;
     }
-
-    if (yeas + nays == 0) return 0.0f;
-
-    return ((double)(yeas) / (double)(yeas + nays));
 }
 
-int CBudgetProposal::GetYeas()
+// If masternode voted for a proposal, but is now invalid -- remove the vote
+void CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
 {
-    int ret = 0;
+    // Without the signature check a vote only goes invalid when its masternode leaves the list
+    int64_t nListVersion = mnodeman.GetListVersion();
+    if (!fSignatureCheck && nListVersion == nListVersionChecked) return;
 
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
-}
 
-int CBudgetProposal::GetNays()
-{
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
     while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_NO && (*it).second.fValid) ret++;
+        bool fValid = (*it).second.SignatureValid(fSignatureCheck);
+        if (fValid != (*it).second.fValid) {
+            CountVote((*it).second, -1);
+            (*it).second.fValid = fValid;
+            CountVote((*it).second, 1);
+        }
         ++it;
     }
-
-    return ret;
+    nListVersionChecked = nListVersion;
 }
 
-int CBudgetProposal::GetAbstains()
+double CBudgetProposal::GetRatio()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_ABSTAIN && (*it).second.fValid) ret++;
-        ++it;
-    }
+    if (nYeasTotal + nNaysTotal == 0) return 0.0f;
 
-    return ret;
+    return ((double)(nYeasTotal) / (double)(nYeasTotal + nNaysTotal));
 }
 
 int CBudgetProposal::GetBlockStartCycle()
@@ -1683,7 +1858,7 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CBudgetVote::Sign - Error upon calling SignMessage");
@@ -1698,10 +1873,14 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     return true;
 }
 
+std::string CBudgetVote::GetStrMessage() const
+{
+    return vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+}
+
 bool CBudgetVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
 
     CMasternode* pmn = mnodeman.Find(vin);
 
@@ -1714,6 +1893,7 @@ bool CBudgetVote::SignatureValid(bool fSignatureCheck)
 
     if (!fSignatureCheck) return true;
 
+    std::string strMessage = GetStrMessage();
     if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
         LogPrint("masternode","CBudgetVote::SignatureValid() - Verify message failed\n");
         return false;
@@ -1732,6 +1912,7 @@ CFinalizedBudget::CFinalizedBudget()
     nTime = 0;
     fValid = true;
     fAutoChecked = false;
+    nListVersionChecked = -1;
 }
 
 CFinalizedBudget::CFinalizedBudget(const CFinalizedBudget& other)
@@ -1744,6 +1925,7 @@ CFinalizedBudget::CFinalizedBudget(const CFinalizedBudget& other)
     nTime = other.nTime;
     fValid = true;
     fAutoChecked = false;
+    nListVersionChecked = -1;
 }
 
 bool CFinalizedBudget::AddOrUpdateVote(CFinalizedBudgetVote& vote, std::string& strError)
@@ -1859,12 +2041,16 @@ void CFinalizedBudget::AutoCheck()
 // If masternode voted for a proposal, but is now invalid -- remove the vote
 void CFinalizedBudget::CleanAndRemove(bool fSignatureCheck)
 {
+    int64_t nListVersion = mnodeman.GetListVersion();
+    if (!fSignatureCheck && nListVersion == nListVersionChecked) return;
+
     std::map<uint256, CFinalizedBudgetVote>::iterator it = mapVotes.begin();
 
     while (it != mapVotes.end()) {
         (*it).second.fValid = (*it).second.SignatureValid(fSignatureCheck);
         ++it;
     }
+    nListVersionChecked = nListVersion;
 }
 
 
@@ -2127,7 +2313,7 @@ bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CFinalizedBudgetVote::Sign - Error upon calling SignMessage");
@@ -2142,11 +2328,16 @@ bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     return true;
 }
 
+std::string CFinalizedBudgetVote::GetStrMessage() const
+{
+    return vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+}
+
 bool CFinalizedBudgetVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
 
-    std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetStrMessage();
 
     CMasternode* pmn = mnodeman.Find(vin);
 
@@ -8,11 +8,13 @@
 #define MASTERNODE_BUDGET_H
 
 #include "base58.h"
+#include "expiringmap.h"
 #include "init.h"
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
 #include "net.h"
+#include "snapshot.h"
 #include "sync.h"
 #include "util.h"
 #include <boost/lexical_cast.hpp>
@@ -36,6 +38,14 @@ static const CAmount PROPOSAL_FEE_TX = (50 * COIN);
 static const CAmount BUDGET_FEE_TX = (50 * COIN);
 static const int64_t BUDGET_VOTE_UPDATE_MIN = 60 * 60;
 
+// Seen messages no longer backed by a proposal, a finalized budget or a counted vote are forgotten after
+static const int64_t BUDGET_SEEN_EXPIRY_SECONDS = 2 * 60 * 60;
+static const unsigned int BUDGET_SEEN_MAX_ITEMS = 5000;
+static const unsigned int BUDGET_SEEN_MAX_VOTES = 200000;
+// Orphan votes wait this long for their proposal or budget, as long as we don't ask for it again
+static const int64_t BUDGET_ORPHAN_VOTE_EXPIRY_SECONDS = 60 * 60 * 24;
+static const unsigned int BUDGET_ORPHAN_MAX_VOTES = 10000;
+
 extern std::vector<CBudgetProposalBroadcast> vecImmatureBudgetProposals;
 extern std::vector<CFinalizedBudgetBroadcast> vecImmatureFinalizedBudgets;
 
@@ -69,6 +79,8 @@ public:
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool SignatureValid(bool fSignatureCheck);
     void Relay();
+    /// The message the masternode key signs
+    std::string GetStrMessage() const;
 
     std::string GetVoteString()
     {
@@ -78,7 +90,7 @@ public:
         return ret;
     }
 
-    uint256 GetHash()
+    uint256 GetHash() const
     {
         CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
         ss << vin;
@@ -121,8 +133,10 @@ public:
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool SignatureValid(bool fSignatureCheck);
     void Relay();
+    /// The message the masternode key signs
+    std::string GetStrMessage() const;
 
-    uint256 GetHash()
+    uint256 GetHash() const
     {
         CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
         ss << vin;
@@ -150,6 +164,7 @@ class CBudgetDB
 private:
     boost::filesystem::path pathDB;
     std::string strMagicMessage;
+    std::string strLegacyMagicMessage; // before the snapshot format, converted when read
 
 public:
     enum ReadResult {
@@ -186,18 +201,15 @@ public:
     map<uint256, CBudgetProposal> mapProposals;
     map<uint256, CFinalizedBudget> mapFinalizedBudgets;
 
-    std::map<uint256, CBudgetProposalBroadcast> mapSeenMasternodeBudgetProposals;
-    std::map<uint256, CBudgetVote> mapSeenMasternodeBudgetVotes;
-    std::map<uint256, CBudgetVote> mapOrphanMasternodeBudgetVotes;
-    std::map<uint256, CFinalizedBudgetBroadcast> mapSeenFinalizedBudgets;
-    std::map<uint256, CFinalizedBudgetVote> mapSeenFinalizedBudgetVotes;
-    std::map<uint256, CFinalizedBudgetVote> mapOrphanFinalizedBudgetVotes;
+    expiringmap<uint256, CBudgetProposalBroadcast> mapSeenMasternodeBudgetProposals;
+    expiringmap<uint256, CBudgetVote> mapSeenMasternodeBudgetVotes;
+    expiringmap<uint256, CFinalizedBudgetBroadcast> mapSeenFinalizedBudgets;
+    expiringmap<uint256, CFinalizedBudgetVote> mapSeenFinalizedBudgetVotes;
+    // orphan votes by their hash, inserted under the proposal or budget they are for
+    expiringmap<uint256, CBudgetVote> mapOrphanMasternodeBudgetVotes;
+    expiringmap<uint256, CFinalizedBudgetVote> mapOrphanFinalizedBudgetVotes;
 
-    CBudgetManager()
-    {
-        mapProposals.clear();
-        mapFinalizedBudgets.clear();
-    }
+    CBudgetManager();
 
     void ClearSeen()
     {
@@ -238,7 +250,10 @@ public:
     std::string GetRequiredPaymentsString(int nBlockHeight);
     void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake);
 
-    void CheckOrphanVotes();
+    /// Apply the orphan votes waiting for this proposal or finalized budget
+    void CheckOrphanVotes(const uint256& nHash);
+    /// Forget seen and orphan messages that expired
+    void ExpireSeen();
     void Clear()
     {
         LOCK(cs);
@@ -257,21 +272,12 @@ public:
     std::string ToString() const;
 
 
-    ADD_SERIALIZE_METHODS;
-
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
-    {
-        READWRITE(mapSeenMasternodeBudgetProposals);
-        READWRITE(mapSeenMasternodeBudgetVotes);
-        READWRITE(mapSeenFinalizedBudgets);
-        READWRITE(mapSeenFinalizedBudgetVotes);
-        READWRITE(mapOrphanMasternodeBudgetVotes);
-        READWRITE(mapOrphanFinalizedBudgetVotes);
-
-        READWRITE(mapProposals);
-        READWRITE(mapFinalizedBudgets);
-    }
+    /// Write the proposals, finalized budgets, orphan votes and seen messages to budget.dat
+    void WriteSnapshot(CSnapshotWriter& s) const;
+    /// Read them back; the seen messages are only stepped over unless fLoadSeen
+    void ReadSnapshot(CSnapshotReader& s, bool fLoadSeen);
+    /// Read the whole object serialized as before the snapshot format; the seen messages are only kept if fLoadSeen
+    void ReadLegacy(CSnapshotReader& s, bool fLoadSeen);
 };
 
 
@@ -311,6 +317,7 @@ private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
     bool fAutoChecked; //If it matches what we see, we'll auto vote for it (masternode only)
+    int64_t nListVersionChecked; //masternode list version the votes were last checked against, -1 if never
 
 public:
     bool fValid;
@@ -456,6 +463,15 @@ private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
     CAmount nAlloted;
+    int64_t nListVersionChecked; //masternode list version the votes were last checked against, -1 if never
+
+    void CountVote(const CBudgetVote& vote, int nSign);
+    void RecountVotes();
+
+protected:
+    // running tallies of mapVotes, kept by AddOrUpdateVote and CleanAndRemove
+    int nYeas, nNays, nAbstains; //valid votes only
+    int nYeasTotal, nNaysTotal;  //every vote, for GetRatio
 
 public:
     bool fValid;
@@ -507,9 +523,9 @@ public:
     int GetBlockCurrentCycle();
     int GetBlockEndCycle();
     double GetRatio();
-    int GetYeas();
-    int GetNays();
-    int GetAbstains();
+    int GetYeas() { return nYeas; }
+    int GetNays() { return nNays; }
+    int GetAbstains() { return nAbstains; }
     CAmount GetAmount() { return nAmount; }
     void SetAllotted(CAmount nAllotedIn) { nAlloted = nAllotedIn; }
     CAmount GetAllotted() { return nAlloted; }
@@ -548,6 +564,8 @@ public:
 
         //for saving to the serialized db
         READWRITE(mapVotes);
+        if (ser_action.ForRead())
+            RecountVotes();
     }
 };
 
@@ -576,6 +594,11 @@ public:
         swap(first.nTime, second.nTime);
         swap(first.nFeeTXHash, second.nFeeTXHash);
         first.mapVotes.swap(second.mapVotes);
+        swap(first.nYeas, second.nYeas);
+        swap(first.nNays, second.nNays);
+        swap(first.nAbstains, second.nAbstains);
+        swap(first.nYeasTotal, second.nYeasTotal);
+        swap(first.nNaysTotal, second.nNaysTotal);
     }
 
     CBudgetProposalBroadcast& operator=(CBudgetProposalBroadcast from)
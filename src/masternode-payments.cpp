@@ -31,30 +31,28 @@ CCriticalSection cs_mapMasternodePayeeVotes;
 CMasternodePaymentDB::CMasternodePaymentDB()
 {
     pathDB = GetDataDir() / "mnpayments.dat";
-    strMagicMessage = "MasternodePayments";
+    strMagicMessage = "MasternodePaymentsSnapshot";
+    strLegacyMagicMessage = "MasternodePayments";
 }
 
 bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
 {
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
     // open output file, and associate with CAutoFile
     FILE* file = fopen(pathDB.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
         return error("%s : Failed to open file %s", __func__, pathDB.string());
 
-    // Write and commit header, data
+    // stream the data to the file, checksumming it on the way, then append the checksum
     try {
-        fileout << ssObj;
+        CSnapshotWriter ssObj(&fileout);
+        ssObj << strMagicMessage;                   // masternode cache file specific magic message
+        ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
+        ssObj << MASTERNODE_SNAPSHOT_VERSION;
+        objToSave.WriteSnapshot(ssObj);
+        fileout << ssObj.GetHash();
     } catch (std::exception& e) {
         return error("%s : Serialize or I/O error - %s", __func__, e.what());
     }
@@ -76,43 +74,25 @@ CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments&
         return FileError;
     }
 
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
+    CSnapshotReader ssObj(&filein);
+    unsigned char pchMsgTmp[4];
+    std::string strMagicMessageTmp;
+    int nSnapshotVersion;
+    bool fLegacy = false;
 
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
+    // the whole file is checked against its checksum before anything is read into objToLoad
+    if (!VerifySnapshotChecksum(filein)) {
         error("%s : Checksum mismatch, data corrupted", __func__);
         return IncorrectHash;
     }
 
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
     try {
         // de-serialize file header (masternode cache file specific magic message) and ..
         ssObj >> strMagicMessageTmp;
 
         // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
+        fLegacy = strMagicMessageTmp == strLegacyMagicMessage;
+        if (!fLegacy && strMagicMessage != strMagicMessageTmp) {
             error("%s : Invalid masternode payement cache magic message", __func__);
             return IncorrectMagicMessage;
         }
@@ -127,14 +107,28 @@ CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments&
             return IncorrectMagicNumber;
         }
 
-        // de-serialize data into CMasternodePayments object
-        ssObj >> objToLoad;
+        if (fLegacy) {
+            // a file in the format before the snapshot one is read once and written back in the new format
+            objToLoad.ReadLegacy(ssObj, !fDryRun);
+        } else {
+            ssObj >> nSnapshotVersion;
+            if (nSnapshotVersion != MASTERNODE_SNAPSHOT_VERSION) {
+                error("%s : Unsupported masternode payment cache version %d", __func__, nSnapshotVersion);
+                return IncorrectFormat;
+            }
+
+            // de-serialize data into CMasternodePayments object; a dry run only checks the votes
+            objToLoad.ReadSnapshot(ssObj, !fDryRun);
+        }
+        objToLoad.RebuildLastPaidIndex();
     } catch (std::exception& e) {
         objToLoad.Clear();
         error("%s : Deserialize or I/O error - %s", __func__, e.what());
         return IncorrectFormat;
     }
 
+    filein.fclose();
+
     LogPrint("masternode","Loaded info from mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", objToLoad.ToString());
     if (!fDryRun) {
@@ -143,6 +137,10 @@ CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments&
         LogPrint("masternode","Masternode payments manager - result:\n");
         LogPrint("masternode","  %s\n", objToLoad.ToString());
     }
+    if (fLegacy && !fDryRun) {
+        LogPrintf("mnpayments.dat was in the old format, writing it in the new one\n");
+        Write(objToLoad);
+    }
 
     return Ok;
 }
@@ -368,7 +366,8 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
     } else if (strCommand == "mnw") { //Masternode Payments Declare Winner
         //this is required in litemodef
         CMasternodePaymentWinner winner;
-        vRecv >> winner;
+        if (!pfrom->TakeDecoded(winner))
+            vRecv >> winner;
 
         if (pfrom->nVersion < ActiveProtocol()) return;
 
@@ -428,9 +427,7 @@ bool CMasternodePaymentWinner::Sign(CKey& keyMasternode, CPubKey& pubKeyMasterno
     std::string errorMessage;
     std::string strMasterNodeSignMessage;
 
-    std::string strMessage = vinMasternode.prevout.ToStringShort() +
-                             boost::lexical_cast<std::string>(nBlockHeight) +
-                             payee.ToString();
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CMasternodePing::Sign() - Error: %s\n", errorMessage.c_str());
@@ -499,7 +496,7 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
             return false;
         }
 
-        mapMasternodePayeeVotes[winnerIn.GetHash()] = winnerIn;
+        mapMasternodePayeeVotes.insert(std::make_pair(winnerIn.GetHash(), winnerIn), winnerIn.nBlockHeight);
 
         if (!mapMasternodeBlocks.count(winnerIn.nBlockHeight)) {
             CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
@@ -507,11 +504,204 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
         }
     }
 
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+    {
+        LOCK(cs_mapMasternodeBlocks);
+        if (mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1) == MNPAYMENTS_LASTPAID_VOTES_REQUIRED)
+            mapPayeeLastPaid[winnerIn.payee].insert(winnerIn.nBlockHeight);
+    }
 
     return true;
 }
 
+/** A block's payees in mnpayments.dat, each an index into the payee table and its votes */
+class CBlockPayeesRecord
+{
+public:
+    int nBlockHeight;
+    std::vector<std::pair<uint32_t, int> > vPayees;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nBlockHeight);
+        READWRITE(vPayees);
+    }
+};
+
+/** A payment vote in mnpayments.dat, its payee an index into the payee table */
+class CPaymentVoteRecord
+{
+public:
+    CTxIn vinMasternode;
+    int nBlockHeight;
+    uint32_t nPayee;
+    std::vector<unsigned char> vchSig;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(vinMasternode);
+        READWRITE(nBlockHeight);
+        READWRITE(VARINT(nPayee));
+        READWRITE(vchSig);
+    }
+};
+
+void CMasternodePayments::WriteSnapshot(CSnapshotWriter& s) const
+{
+    LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
+    LOCK(cs_vecPayments);
+
+    // The same few payees recur in every block and in every vote for it, so each
+    // payee script is written once and referred to by its index
+    std::map<CScript, uint32_t> mapPayeeIndex;
+    std::vector<const CScript*> vPayees;
+    for (std::map<int, CMasternodeBlockPayees>::const_iterator it = mapMasternodeBlocks.begin(); it != mapMasternodeBlocks.end(); ++it) {
+        BOOST_FOREACH (const CMasternodePayee& payee, it->second.vecPayments) {
+            if (mapPayeeIndex.insert(std::make_pair(payee.scriptPubKey, vPayees.size())).second)
+                vPayees.push_back(&payee.scriptPubKey);
+        }
+    }
+    for (expiringmap<uint256, CMasternodePaymentWinner, int>::const_iterator it = mapMasternodePayeeVotes.begin(); it != mapMasternodePayeeVotes.end(); ++it) {
+        if (mapPayeeIndex.insert(std::make_pair(it->second.payee, vPayees.size())).second)
+            vPayees.push_back(&it->second.payee);
+    }
+
+    CSnapshotChunkWriter payees(s);
+    BOOST_FOREACH (const CScript* pPayee, vPayees)
+        payees.Add(*pPayee);
+    payees.Finish();
+
+    CSnapshotChunkWriter blocks(s);
+    for (std::map<int, CMasternodeBlockPayees>::const_iterator it = mapMasternodeBlocks.begin(); it != mapMasternodeBlocks.end(); ++it) {
+        CBlockPayeesRecord record;
+        record.nBlockHeight = it->second.nBlockHeight;
+        BOOST_FOREACH (const CMasternodePayee& payee, it->second.vecPayments)
+            record.vPayees.push_back(std::make_pair(mapPayeeIndex[payee.scriptPubKey], payee.nVotes));
+        blocks.Add(it->first, record);
+    }
+    blocks.Finish();
+
+    CSnapshotChunkWriter votes(s);
+    for (expiringmap<uint256, CMasternodePaymentWinner, int>::const_iterator it = mapMasternodePayeeVotes.begin(); it != mapMasternodePayeeVotes.end(); ++it) {
+        CPaymentVoteRecord record;
+        record.vinMasternode = it->second.vinMasternode;
+        record.nBlockHeight = it->second.nBlockHeight;
+        record.nPayee = mapPayeeIndex[it->second.payee];
+        record.vchSig = it->second.vchSig;
+        votes.Add(record);
+    }
+    votes.Finish();
+}
+
+void CMasternodePayments::ReadSnapshot(CSnapshotReader& s, bool fLoadVotes)
+{
+    Clear();
+
+    LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
+
+    std::vector<CScript> vPayees;
+    CSnapshotChunkReader payees(s);
+    CScript payee;
+    while (payees.Next(payee))
+        vPayees.push_back(payee);
+
+    CSnapshotChunkReader blocks(s);
+    int nHeight;
+    CBlockPayeesRecord blockRecord;
+    while (blocks.Next(nHeight, blockRecord)) {
+        CMasternodeBlockPayees blockPayees(blockRecord.nBlockHeight);
+        for (unsigned int i = 0; i < blockRecord.vPayees.size(); i++) {
+            if (blockRecord.vPayees[i].first >= vPayees.size())
+                throw std::ios_base::failure("payee index out of range");
+            blockPayees.vecPayments.push_back(CMasternodePayee(vPayees[blockRecord.vPayees[i].first], blockRecord.vPayees[i].second));
+        }
+        mapMasternodeBlocks[nHeight] = blockPayees;
+    }
+
+    CSnapshotChunkReader votes(s);
+    if (!fLoadVotes) {
+        votes.Skip();
+        return;
+    }
+
+    CPaymentVoteRecord voteRecord;
+    while (votes.Next(voteRecord)) {
+        if (voteRecord.nPayee >= vPayees.size())
+            throw std::ios_base::failure("payee index out of range");
+        CMasternodePaymentWinner winner(voteRecord.vinMasternode);
+        winner.nBlockHeight = voteRecord.nBlockHeight;
+        winner.payee = vPayees[voteRecord.nPayee];
+        winner.vchSig = voteRecord.vchSig;
+        mapMasternodePayeeVotes.insert(std::make_pair(winner.GetHash(), winner), winner.nBlockHeight);
+    }
+}
+
+void CMasternodePayments::ReadLegacy(CSnapshotReader& s, bool fLoadVotes)
+{
+    Clear();
+
+    LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
+
+    // the votes came first and were written as a plain map, so they are read even when they are not kept
+    std::map<uint256, CMasternodePaymentWinner> mapVotes;
+    s >> mapVotes;
+    s >> mapMasternodeBlocks;
+    if (!fLoadVotes)
+        return;
+
+    for (std::map<uint256, CMasternodePaymentWinner>::const_iterator it = mapVotes.begin(); it != mapVotes.end(); ++it)
+        mapMasternodePayeeVotes.insert(*it, it->second.nBlockHeight);
+}
+
+void CMasternodePayments::RebuildLastPaidIndex()
+{
+    LOCK2(cs_mapMasternodeBlocks, cs_vecPayments);
+
+    mapPayeeLastPaid.clear();
+    for (std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin(); it != mapMasternodeBlocks.end(); ++it) {
+        BOOST_FOREACH (CMasternodePayee& payee, it->second.vecPayments) {
+            if (payee.nVotes >= MNPAYMENTS_LASTPAID_VOTES_REQUIRED)
+                mapPayeeLastPaid[payee.scriptPubKey].insert(it->first);
+        }
+    }
+}
+
+// requires LOCK(cs_mapMasternodeBlocks)
+void CMasternodePayments::RemoveFromLastPaidIndex(int nBlockHeight)
+{
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(nBlockHeight);
+    if (it == mapMasternodeBlocks.end()) return;
+
+    LOCK(cs_vecPayments);
+    BOOST_FOREACH (CMasternodePayee& payee, it->second.vecPayments) {
+        std::map<CScript, std::set<int> >::iterator itPaid = mapPayeeLastPaid.find(payee.scriptPubKey);
+        if (itPaid == mapPayeeLastPaid.end()) continue;
+        itPaid->second.erase(nBlockHeight);
+        if (itPaid->second.empty())
+            mapPayeeLastPaid.erase(itPaid);
+    }
+}
+
+int CMasternodePayments::GetLastPaidHeight(const CScript& payee, int nMinHeight, int nMaxHeight)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    std::map<CScript, std::set<int> >::iterator it = mapPayeeLastPaid.find(payee);
+    if (it == mapPayeeLastPaid.end()) return -1;
+
+    // Heights above nMaxHeight are votes for blocks that do not exist yet
+    std::set<int>::iterator itHeight = it->second.upper_bound(nMaxHeight);
+    if (itHeight == it->second.begin()) return -1;
+    --itHeight;
+
+    return *itHeight >= nMinHeight ? *itHeight : -1;
+}
+
 bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
 {
     LOCK(cs_vecPayments);
@@ -631,18 +821,18 @@ void CMasternodePayments::CleanPaymentList()
     //keep up to five cycles for historical sake
     int nLimit = std::max(int(mnodeman.size() * 1.25), 1000);
 
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
-
-        if (nHeight - winner.nBlockHeight > nLimit) {
-            LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
-            masternodeSync.mapSeenSyncMNW.erase((*it).first);
-            mapMasternodePayeeVotes.erase(it++);
-            mapMasternodeBlocks.erase(winner.nBlockHeight);
-        } else {
-            ++it;
+    // every vote has its height in mapMasternodeBlocks, so only the expired heights are visited
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin();
+    while (it != mapMasternodeBlocks.end() && nHeight - it->first > nLimit) {
+        LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", it->first);
+        std::vector<uint256> vVotes;
+        mapMasternodePayeeVotes.find_by_parent(it->first, vVotes);
+        BOOST_FOREACH (const uint256& hash, vVotes) {
+            masternodeSync.mapSeenSyncMNW.erase(hash);
+            mapMasternodePayeeVotes.erase(hash);
         }
+        RemoveFromLastPaidIndex(it->first);
+        mapMasternodeBlocks.erase(it++);
     }
 }
 
@@ -757,14 +947,19 @@ void CMasternodePaymentWinner::Relay()
     RelayInv(inv);
 }
 
+std::string CMasternodePaymentWinner::GetStrMessage() const
+{
+    return vinMasternode.prevout.ToStringShort() +
+           boost::lexical_cast<std::string>(nBlockHeight) +
+           payee.ToString();
+}
+
 bool CMasternodePaymentWinner::SignatureValid()
 {
     CMasternode* pmn = mnodeman.Find(vinMasternode);
 
     if (pmn != NULL) {
-        std::string strMessage = vinMasternode.prevout.ToStringShort() +
-                                 boost::lexical_cast<std::string>(nBlockHeight) +
-                                 payee.ToString();
+        std::string strMessage = GetStrMessage();
 
         std::string errorMessage = "";
         if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
@@ -792,14 +987,12 @@ void CMasternodePayments::Sync(CNode* node, int nCountNeeded)
     if (nCountNeeded > nCount) nCountNeeded = nCount;
 
     int nInvCount = 0;
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
-        if (winner.nBlockHeight >= nHeight - nCountNeeded && winner.nBlockHeight <= nHeight + 20) {
-            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, winner.GetHash()));
-            nInvCount++;
-        }
-        ++it;
+    std::vector<uint256> vVotes;
+    for (int nBlockHeight = nHeight - nCountNeeded; nBlockHeight <= nHeight + 20; nBlockHeight++)
+        mapMasternodePayeeVotes.find_by_parent(nBlockHeight, vVotes);
+    BOOST_FOREACH (const uint256& hash, vVotes) {
+        node->PushInventory(CInv(MSG_MASTERNODE_WINNER, hash));
+        nInvCount++;
     }
     node->PushMessage("ssc", MASTERNODE_SYNC_MNW, nInvCount);
 }
@@ -7,9 +7,11 @@
 #ifndef MASTERNODE_PAYMENTS_H
 #define MASTERNODE_PAYMENTS_H
 
+#include "expiringmap.h"
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+#include "snapshot.h"
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -26,6 +28,10 @@ extern CMasternodePayments masternodePayments;
 
 #define MNPAYMENTS_SIGNATURES_REQUIRED 6
 #define MNPAYMENTS_SIGNATURES_TOTAL 10
+// Votes a payee needs at a height for that block to count as its last payment
+#define MNPAYMENTS_LASTPAID_VOTES_REQUIRED 2
+// Payment votes kept at most; they are otherwise cleaned by height in CleanPaymentList
+#define MNPAYMENTS_MAX_VOTES 100000
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight);
@@ -42,6 +48,7 @@ class CMasternodePaymentDB
 private:
     boost::filesystem::path pathDB;
     std::string strMagicMessage;
+    std::string strLegacyMagicMessage; // before the snapshot format, converted when read
 
 public:
     enum ReadResult {
@@ -105,19 +112,21 @@ public:
         vecPayments.clear();
     }
 
-    void AddPayee(CScript payeeIn, int nIncrement)
+    // Returns the payee's vote count after adding nIncrement
+    int AddPayee(CScript payeeIn, int nIncrement)
     {
         LOCK(cs_vecPayments);
 
         BOOST_FOREACH (CMasternodePayee& payee, vecPayments) {
             if (payee.scriptPubKey == payeeIn) {
                 payee.nVotes += nIncrement;
-                return;
+                return payee.nVotes;
             }
         }
 
         CMasternodePayee c(payeeIn, nIncrement);
         vecPayments.push_back(c);
+        return nIncrement;
     }
 
     bool GetPayee(CScript& payee)
@@ -197,6 +206,8 @@ public:
     bool IsValid(CNode* pnode, std::string& strError);
     bool SignatureValid();
     void Relay();
+    /// The message the masternode key signs
+    std::string GetStrMessage() const;
 
     void AddPayee(CScript payeeIn)
     {
@@ -237,12 +248,19 @@ private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
 
+    // Last-paid index: for every payee, the heights in mapMasternodeBlocks where it has
+    // at least MNPAYMENTS_LASTPAID_VOTES_REQUIRED votes. Protected by cs_mapMasternodeBlocks.
+    std::map<CScript, std::set<int> > mapPayeeLastPaid;
+
+    void RemoveFromLastPaidIndex(int nBlockHeight);
+
 public:
-    std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
+    // payment votes by their hash, inserted under the height they vote for
+    expiringmap<uint256, CMasternodePaymentWinner, int> mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
     std::map<uint256, int> mapMasternodesLastVote; //prevout.hash + prevout.n, nBlockHeight
 
-    CMasternodePayments()
+    CMasternodePayments() : mapMasternodePayeeVotes(MNPAYMENTS_MAX_VOTES)
     {
         nSyncedFromPeer = 0;
         nLastBlockHeight = 0;
@@ -253,6 +271,7 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeeLastPaid.clear();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
@@ -262,6 +281,11 @@ public:
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
 
+    /** Rebuild the last-paid index from mapMasternodeBlocks, e.g. after loading mnpayments.dat */
+    void RebuildLastPaidIndex();
+    /** Highest height in [nMinHeight, nMaxHeight] at which payee was paid, or -1 if none */
+    int GetLastPaidHeight(const CScript& payee, int nMinHeight, int nMaxHeight);
+
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
     bool IsScheduled(CMasternode& mn, int nNotBlockHeight);
@@ -289,14 +313,12 @@ public:
     int GetOldestBlock();
     int GetNewestBlock();
 
-    ADD_SERIALIZE_METHODS;
-
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
-    {
-        READWRITE(mapMasternodePayeeVotes);
-        READWRITE(mapMasternodeBlocks);
-    }
+    /// Write the block payees and the votes to mnpayments.dat
+    void WriteSnapshot(CSnapshotWriter& s) const;
+    /// Read them back; the votes are only stepped over unless fLoadVotes
+    void ReadSnapshot(CSnapshotReader& s, bool fLoadVotes);
+    /// Read the whole object serialized as before the snapshot format; the votes are only kept if fLoadVotes
+    void ReadLegacy(CSnapshotReader& s, bool fLoadVotes);
 };
 
 
@@ -20,7 +20,9 @@
 class CMasternodeSync;
 CMasternodeSync masternodeSync;
 
-CMasternodeSync::CMasternodeSync()
+CMasternodeSync::CMasternodeSync() : mapSeenSyncMNB(MASTERNODE_SYNC_SEEN_MAX, MASTERNODE_SYNC_SEEN_EXPIRY_SECONDS),
+                                     mapSeenSyncMNW(MASTERNODE_SYNC_SEEN_MAX, MASTERNODE_SYNC_SEEN_EXPIRY_SECONDS),
+                                     mapSeenSyncBudget(MASTERNODE_SYNC_SEEN_MAX, MASTERNODE_SYNC_SEEN_EXPIRY_SECONDS)
 {
     Reset();
 }
@@ -237,6 +239,11 @@ void CMasternodeSync::Process()
 
     if (tick++ % MASTERNODE_SYNC_TIMEOUT != 0) return;
 
+    // AlreadyHave keeps counting items after the sync, forget those long gone
+    mapSeenSyncMNB.expire();
+    mapSeenSyncMNW.expire();
+    mapSeenSyncBudget.expire();
+
     if (IsSynced()) {
         /* 
             Resync if we lose all masternodes from sleep/wake or failure to sync originally
@@ -7,6 +7,9 @@
 #ifndef MASTERNODE_SYNC_H
 #define MASTERNODE_SYNC_H
 
+#include "expiringmap.h"
+#include "uint256.h"
+
 #define MASTERNODE_SYNC_INITIAL 0
 #define MASTERNODE_SYNC_SPORKS 1
 #define MASTERNODE_SYNC_LIST 2
@@ -19,6 +22,8 @@
 
 #define MASTERNODE_SYNC_TIMEOUT 5
 #define MASTERNODE_SYNC_THRESHOLD 2
+#define MASTERNODE_SYNC_SEEN_MAX 100000                   // items counted per asset before the oldest are dropped
+#define MASTERNODE_SYNC_SEEN_EXPIRY_SECONDS (2 * 60 * 60) // how long an item's count is kept
 
 class CMasternodeSync;
 extern CMasternodeSync masternodeSync;
@@ -30,9 +35,9 @@ extern CMasternodeSync masternodeSync;
 class CMasternodeSync
 {
 public:
-    std::map<uint256, int> mapSeenSyncMNB;
-    std::map<uint256, int> mapSeenSyncMNW;
-    std::map<uint256, int> mapSeenSyncBudget;
+    expiringmap<uint256, int> mapSeenSyncMNB;
+    expiringmap<uint256, int> mapSeenSyncMNW;
+    expiringmap<uint256, int> mapSeenSyncBudget;
 
     int64_t lastMasternodeList;
     int64_t lastMasternodeWinner;
@@ -27,19 +27,13 @@ struct CompareLastPaid {
     }
 };
 
-struct CompareScoreTxIn {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-        const pair<int64_t, CTxIn>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
 struct CompareScoreMN {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-        const pair<int64_t, CMasternode>& t2) const
+    bool operator()(const pair<int64_t, CMasternode*>& t1,
+        const pair<int64_t, CMasternode*>& t2) const
     {
-        return t1.first < t2.first;
+        // highest score first; ties are broken by collateral so every node ranks them alike
+        if (t1.first != t2.first) return t1.first > t2.first;
+        return t1.second->vin.prevout < t2.second->vin.prevout;
     }
 };
 
@@ -50,30 +44,28 @@ struct CompareScoreMN {
 CMasternodeDB::CMasternodeDB()
 {
     pathMN = GetDataDir() / "mncache.dat";
-    strMagicMessage = "MasternodeCache";
+    strMagicMessage = "MasternodeCacheSnapshot";
+    strLegacyMagicMessage = "MasternodeCache";
 }
 
 bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
 {
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
-
     // open output file, and associate with CAutoFile
     FILE* file = fopen(pathMN.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
         return error("%s : Failed to open file %s", __func__, pathMN.string());
 
-    // Write and commit header, data
+    // stream the data to the file, checksumming it on the way, then append the checksum
     try {
-        fileout << ssMasternodes;
+        CSnapshotWriter ssMasternodes(&fileout);
+        ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
+        ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
+        ssMasternodes << MASTERNODE_SNAPSHOT_VERSION;
+        mnodemanToSave.WriteSnapshot(ssMasternodes);
+        fileout << ssMasternodes.GetHash();
     } catch (std::exception& e) {
         return error("%s : Serialize or I/O error - %s", __func__, e.what());
     }
@@ -97,44 +89,25 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
         return FileError;
     }
 
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathMN);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssMasternodes(vchData, SER_DISK, CLIENT_VERSION);
+    CSnapshotReader ssMasternodes(&filein);
+    unsigned char pchMsgTmp[4];
+    std::string strMagicMessageTmp;
+    int nSnapshotVersion;
+    bool fLegacy = false;
 
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    if (hashIn != hashTmp) {
+    // the whole file is checked against its checksum before anything is read into mnodemanToLoad
+    if (!VerifySnapshotChecksum(filein)) {
         error("%s : Checksum mismatch, data corrupted", __func__);
         return IncorrectHash;
     }
 
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
     try {
         // de-serialize file header (masternode cache file specific magic message) and ..
-
         ssMasternodes >> strMagicMessageTmp;
 
         // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
+        fLegacy = strMagicMessageTmp == strLegacyMagicMessage;
+        if (!fLegacy && strMagicMessage != strMagicMessageTmp) {
             error("%s : Invalid masternode cache magic message", __func__);
             return IncorrectMagicMessage;
         }
@@ -147,14 +120,28 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
             error("%s : Invalid network magic number", __func__);
             return IncorrectMagicNumber;
         }
-        // de-serialize data into CMasternodeMan object
-        ssMasternodes >> mnodemanToLoad;
+
+        if (fLegacy) {
+            // a file in the format before the snapshot one is read once and written back in the new format
+            mnodemanToLoad.ReadLegacy(ssMasternodes, !fDryRun);
+        } else {
+            ssMasternodes >> nSnapshotVersion;
+            if (nSnapshotVersion != MASTERNODE_SNAPSHOT_VERSION) {
+                error("%s : Unsupported masternode cache version %d", __func__, nSnapshotVersion);
+                return IncorrectFormat;
+            }
+
+            // de-serialize data into CMasternodeMan object; a dry run only checks the seen messages
+            mnodemanToLoad.ReadSnapshot(ssMasternodes, !fDryRun);
+        }
     } catch (std::exception& e) {
         mnodemanToLoad.Clear();
         error("%s : Deserialize or I/O error - %s", __func__, e.what());
         return IncorrectFormat;
     }
 
+    filein.fclose();
+
     LogPrint("masternode","Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
     if (!fDryRun) {
@@ -163,6 +150,10 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
         LogPrint("masternode","Masternode manager - result:\n");
         LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
     }
+    if (fLegacy && !fDryRun) {
+        LogPrintf("mncache.dat was in the old format, writing it in the new one\n");
+        Write(mnodemanToLoad);
+    }
 
     return Ok;
 }
@@ -194,9 +185,36 @@ void DumpMasternodes()
     LogPrint("masternode","Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
-CMasternodeMan::CMasternodeMan()
+// Seen broadcasts whose last ping is recent are kept from expiring or being pushed out
+static bool IsPingedBroadcast(const std::pair<const uint256, CMasternodeBroadcast>& item)
+{
+    return item.second.lastPing.sigTime >= GetTime() - MASTERNODES_SEEN_EXPIRY_SECONDS;
+}
+
+// On expiry the hashes of the broadcasts that are not kept are collected
+struct KeepPingedBroadcast {
+    std::vector<uint256>& vExpired;
+    KeepPingedBroadcast(std::vector<uint256>& vExpiredIn) : vExpired(vExpiredIn) {}
+    bool operator()(const std::pair<const uint256, CMasternodeBroadcast>& item)
+    {
+        if (IsPingedBroadcast(item))
+            return true;
+        vExpired.push_back(item.first);
+        return false;
+    }
+};
+
+// Seen pings are kept while their sigTime is recent, as they were before they expired by age
+static bool IsRecentPing(const std::pair<const uint256, CMasternodePing>& item)
+{
+    return item.second.sigTime >= GetTime() - MASTERNODES_SEEN_EXPIRY_SECONDS;
+}
+
+CMasternodeMan::CMasternodeMan() : mapSeenMasternodeBroadcast(MASTERNODES_SEEN_MAX_BROADCASTS, MASTERNODES_SEEN_EXPIRY_SECONDS, IsPingedBroadcast),
+                                   mapSeenMasternodePing(MASTERNODES_SEEN_MAX_PINGS, MASTERNODES_SEEN_EXPIRY_SECONDS, IsRecentPing)
 {
     nDsqCount = 0;
+    nListVersion = 0;
 }
 
 bool CMasternodeMan::Add(CMasternode& mn)
@@ -209,7 +227,10 @@ bool CMasternodeMan::Add(CMasternode& mn)
     CMasternode* pmn = Find(mn.vin);
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
+        lMasternodes.push_back(mn);
+        mapMasternodesByCollateral[mn.vin.prevout] = &lMasternodes.back();
+        UpdateIndexes(lMasternodes.back());
+        ClearMasternodeScores();
         return true;
     }
 
@@ -236,11 +257,12 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, lMasternodes) {
         mn.Check();
     }
 }
 
+
 void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
 {
     Check();
@@ -248,8 +270,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = lMasternodes.begin();
+    while (it != lMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
             (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
             (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
@@ -259,14 +281,11 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             //erase all of the broadcasts we've seen from this vin
             // -- if we missed a few pings and the node was removed, this will allow is to get it back without them
             //    sending a brand new mnb
-            map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
-            while (it3 != mapSeenMasternodeBroadcast.end()) {
-                if ((*it3).second.vin == (*it).vin) {
-                    masternodeSync.mapSeenSyncMNB.erase((*it3).first);
-                    mapSeenMasternodeBroadcast.erase(it3++);
-                } else {
-                    ++it3;
-                }
+            std::vector<uint256> vBroadcasts;
+            mapSeenMasternodeBroadcast.find_by_parent((*it).vin.prevout, vBroadcasts);
+            BOOST_FOREACH (const uint256& hash, vBroadcasts) {
+                masternodeSync.mapSeenSyncMNB.erase(hash);
+                mapSeenMasternodeBroadcast.erase(hash);
             }
 
             // allow us to ask for this masternode again if we see another ping
@@ -279,12 +298,18 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
                 }
             }
 
-            it = vMasternodes.erase(it);
+            mapMasternodesByCollateral.erase((*it).vin.prevout);
+            ClearMasternodeScores();
+            it = lMasternodes.erase(it);
         } else {
             ++it;
         }
     }
 
+    // don't let entries left behind by removals and key changes pile up
+    if (mapMasternodesByPubKey.size() > 2 * lMasternodes.size() || mapMasternodesByPayee.size() > 2 * lMasternodes.size())
+        RebuildIndexes();
+
     // check who's asked for the Masternode list
     map<CNetAddr, int64_t>::iterator it1 = mAskedUsForMasternodeList.begin();
     while (it1 != mAskedUsForMasternodeList.end()) {
@@ -315,32 +340,24 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
         }
     }
 
-    // remove expired mapSeenMasternodeBroadcast
-    map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
-    while (it3 != mapSeenMasternodeBroadcast.end()) {
-        if ((*it3).second.lastPing.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
-            mapSeenMasternodeBroadcast.erase(it3++);
-            masternodeSync.mapSeenSyncMNB.erase((*it3).second.GetHash());
-        } else {
-            ++it3;
-        }
-    }
+    // remove expired mapSeenMasternodeBroadcast, keeping the broadcasts that are still being pinged
+    std::vector<uint256> vExpired;
+    mapSeenMasternodeBroadcast.expire(KeepPingedBroadcast(vExpired));
+    BOOST_FOREACH (const uint256& hash, vExpired)
+        masternodeSync.mapSeenSyncMNB.erase(hash);
 
     // remove expired mapSeenMasternodePing
-    map<uint256, CMasternodePing>::iterator it4 = mapSeenMasternodePing.begin();
-    while (it4 != mapSeenMasternodePing.end()) {
-        if ((*it4).second.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
-            mapSeenMasternodePing.erase(it4++);
-        } else {
-            ++it4;
-        }
-    }
+    mapSeenMasternodePing.expire();
 }
 
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    lMasternodes.clear();
+    ClearMasternodeScores();
+    mapMasternodesByCollateral.clear();
+    mapMasternodesByPubKey.clear();
+    mapMasternodesByPayee.clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -349,6 +366,36 @@ void CMasternodeMan::Clear()
     nDsqCount = 0;
 }
 
+void CMasternodeMan::CheckCollaterals()
+{
+    LOCK2(cs_main, cs);
+    LOCK(mempool.cs);
+
+    BOOST_FOREACH (CMasternode& mn, lMasternodes) {
+        if (mn.activeState == CMasternode::MASTERNODE_VIN_SPENT) continue;
+
+        const CCoins* coins = pcoinsTip->AccessCoins(mn.vin.prevout.hash);
+        if (!coins || !coins->IsAvailable(mn.vin.prevout.n) || mempool.mapNextTx.count(mn.vin.prevout)) {
+            LogPrint("masternode", "CMasternodeMan::CheckCollaterals - collateral %s is spent\n", mn.vin.prevout.ToStringShort());
+            mn.activeState = CMasternode::MASTERNODE_VIN_SPENT;
+        }
+    }
+}
+
+void CMasternodeMan::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    if (tx.IsCoinBase() || tx.IsZerocoinSpend()) return;
+
+    LOCK(cs);
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        CMasternode* pmn = Find(txin);
+        if (pmn && pmn->activeState != CMasternode::MASTERNODE_VIN_SPENT) {
+            LogPrint("masternode", "CMasternodeMan::SyncTransaction - collateral %s spent by %s\n", txin.prevout.ToStringShort(), tx.GetHash().ToString());
+            pmn->activeState = CMasternode::MASTERNODE_VIN_SPENT;
+        }
+    }
+}
+
 int CMasternodeMan::stable_size ()
 {
     int nStable_size = 0;
@@ -356,7 +403,7 @@ int CMasternodeMan::stable_size ()
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, lMasternodes) {
         if (mn.protocolVersion < nMinProtocol) {
             continue; // Skip obsolete versions
         }
@@ -381,7 +428,7 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, lMasternodes) {
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -394,7 +441,7 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
 {
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, lMasternodes) {
         mn.Check();
         std::string strHost;
         int port;
@@ -439,25 +486,32 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
+    typedef boost::unordered_multimap<CScript, COutPoint, CMasternodeIndexHasher>::iterator index_iterator;
+    std::pair<index_iterator, index_iterator> range = mapMasternodesByPayee.equal_range(payee);
+    CMasternode* pmnRet = NULL;
+    for (index_iterator it = range.first; it != range.second;) {
+        boost::unordered_map<COutPoint, CMasternode*, CMasternodeIndexHasher>::iterator mi = mapMasternodesByCollateral.find(it->second);
+        if (mi == mapMasternodesByCollateral.end() || GetScriptForDestination(mi->second->pubKeyCollateralAddress.GetID()) != payee) {
+            it = mapMasternodesByPayee.erase(it);
+            continue;
+        }
+        // several Masternodes can share a payee; the one with the lowest collateral wins, whatever the index order
+        if (pmnRet == NULL || mi->second->vin.prevout < pmnRet->vin.prevout)
+            pmnRet = mi->second;
+        ++it;
     }
-    return NULL;
+    return pmnRet;
 }
 
 CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_map<COutPoint, CMasternode*, CMasternodeIndexHasher>::iterator mi = mapMasternodesByCollateral.find(vin.prevout);
+    if (mi == mapMasternodesByCollateral.end())
+        return NULL;
+    return mi->second;
 }
 
 
@@ -465,11 +519,208 @@ CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
+    typedef boost::unordered_multimap<CPubKey, COutPoint, CMasternodeIndexHasher>::iterator index_iterator;
+    std::pair<index_iterator, index_iterator> range = mapMasternodesByPubKey.equal_range(pubKeyMasternode);
+    CMasternode* pmnRet = NULL;
+    for (index_iterator it = range.first; it != range.second;) {
+        boost::unordered_map<COutPoint, CMasternode*, CMasternodeIndexHasher>::iterator mi = mapMasternodesByCollateral.find(it->second);
+        if (mi == mapMasternodesByCollateral.end() || mi->second->pubKeyMasternode != pubKeyMasternode) {
+            it = mapMasternodesByPubKey.erase(it);
+            continue;
+        }
+        if (pmnRet == NULL || mi->second->vin.prevout < pmnRet->vin.prevout)
+            pmnRet = mi->second;
+        ++it;
     }
-    return NULL;
+    return pmnRet;
+}
+
+void CMasternodeMan::UpdateIndexes(const CMasternode& mn)
+{
+    LOCK(cs);
+
+    // only entries of our own list are indexed
+    CMasternode* pmn = Find(mn.vin);
+    if (pmn != &mn) return;
+
+    typedef boost::unordered_multimap<CPubKey, COutPoint, CMasternodeIndexHasher>::iterator pubkey_iterator;
+    std::pair<pubkey_iterator, pubkey_iterator> rangePubKey = mapMasternodesByPubKey.equal_range(pmn->pubKeyMasternode);
+    bool fIndexed = false;
+    for (pubkey_iterator it = rangePubKey.first; it != rangePubKey.second && !fIndexed; ++it)
+        fIndexed = it->second == pmn->vin.prevout;
+    if (!fIndexed)
+        mapMasternodesByPubKey.insert(std::make_pair(pmn->pubKeyMasternode, pmn->vin.prevout));
+
+    CScript payee = GetScriptForDestination(pmn->pubKeyCollateralAddress.GetID());
+    typedef boost::unordered_multimap<CScript, COutPoint, CMasternodeIndexHasher>::iterator payee_iterator;
+    std::pair<payee_iterator, payee_iterator> rangePayee = mapMasternodesByPayee.equal_range(payee);
+    fIndexed = false;
+    for (payee_iterator it = rangePayee.first; it != rangePayee.second && !fIndexed; ++it)
+        fIndexed = it->second == pmn->vin.prevout;
+    if (!fIndexed)
+        mapMasternodesByPayee.insert(std::make_pair(payee, pmn->vin.prevout));
+}
+
+void CMasternodeMan::RebuildIndexes()
+{
+    LOCK(cs);
+
+    ClearMasternodeScores();
+    mapMasternodesByCollateral.clear();
+    mapMasternodesByPubKey.clear();
+    mapMasternodesByPayee.clear();
+    BOOST_FOREACH (CMasternode& mn, lMasternodes) {
+        mapMasternodesByCollateral[mn.vin.prevout] = &mn;
+        mapMasternodesByPubKey.insert(std::make_pair(mn.pubKeyMasternode, mn.vin.prevout));
+        mapMasternodesByPayee.insert(std::make_pair(GetScriptForDestination(mn.pubKeyCollateralAddress.GetID()), mn.vin.prevout));
+    }
+}
+
+void CMasternodeMan::WriteSnapshot(CSnapshotWriter& s) const
+{
+    LOCK(cs);
+
+    // Seen broadcasts and pings a listed entry still carries are written as their hash only
+    std::map<uint256, const CMasternode*> mapListedBroadcasts;
+    std::map<uint256, const CMasternode*> mapListedPings;
+
+    CSnapshotChunkWriter masternodes(s);
+    BOOST_FOREACH (const CMasternode& mn, lMasternodes) {
+        masternodes.Add(mn);
+        mapListedBroadcasts[CMasternodeBroadcast(mn).GetHash()] = &mn;
+        mapListedPings[mn.lastPing.GetHash()] = &mn;
+    }
+    masternodes.Finish();
+
+    s << mAskedUsForMasternodeList;
+    s << mWeAskedForMasternodeList;
+    s << mWeAskedForMasternodeListEntry;
+    s << nDsqCount;
+
+    std::vector<expiringmap<uint256, CMasternodeBroadcast, COutPoint>::const_iterator> vBroadcasts;
+    CSnapshotChunkWriter listedBroadcasts(s);
+    for (expiringmap<uint256, CMasternodeBroadcast, COutPoint>::const_iterator it = mapSeenMasternodeBroadcast.begin(); it != mapSeenMasternodeBroadcast.end(); ++it) {
+        std::map<uint256, const CMasternode*>::const_iterator mi = mapListedBroadcasts.find(it->first);
+        if (mi != mapListedBroadcasts.end() && mi->second->sig == it->second.sig)
+            listedBroadcasts.Add(it->first);
+        else
+            vBroadcasts.push_back(it);
+    }
+    listedBroadcasts.Finish();
+
+    CSnapshotChunkWriter seenBroadcasts(s);
+    for (unsigned int i = 0; i < vBroadcasts.size(); i++)
+        seenBroadcasts.Add(vBroadcasts[i]->first, vBroadcasts[i]->second);
+    seenBroadcasts.Finish();
+
+    std::vector<expiringmap<uint256, CMasternodePing>::const_iterator> vPings;
+    CSnapshotChunkWriter listedPings(s);
+    for (expiringmap<uint256, CMasternodePing>::const_iterator it = mapSeenMasternodePing.begin(); it != mapSeenMasternodePing.end(); ++it) {
+        std::map<uint256, const CMasternode*>::const_iterator mi = mapListedPings.find(it->first);
+        if (mi != mapListedPings.end() && mi->second->lastPing.vchSig == it->second.vchSig && mi->second->lastPing.blockHash == it->second.blockHash)
+            listedPings.Add(it->first);
+        else
+            vPings.push_back(it);
+    }
+    listedPings.Finish();
+
+    CSnapshotChunkWriter seenPings(s);
+    for (unsigned int i = 0; i < vPings.size(); i++)
+        seenPings.Add(vPings[i]->first, vPings[i]->second);
+    seenPings.Finish();
+}
+
+void CMasternodeMan::ReadSnapshot(CSnapshotReader& s, bool fLoadSeen)
+{
+    LOCK(cs);
+    Clear();
+
+    CSnapshotChunkReader masternodes(s);
+    while (true) {
+        CMasternode mn;
+        if (!masternodes.Next(mn))
+            break;
+        lMasternodes.push_back(mn);
+    }
+    RebuildIndexes();
+
+    s >> mAskedUsForMasternodeList;
+    s >> mWeAskedForMasternodeList;
+    s >> mWeAskedForMasternodeListEntry;
+    s >> nDsqCount;
+
+    CSnapshotChunkReader listedBroadcasts(s);
+    if (!fLoadSeen) {
+        listedBroadcasts.Skip();
+        CSnapshotChunkReader(s).Skip();
+        CSnapshotChunkReader(s).Skip();
+        CSnapshotChunkReader(s).Skip();
+        return;
+    }
+
+    std::map<uint256, const CMasternode*> mapListedBroadcasts;
+    std::map<uint256, const CMasternode*> mapListedPings;
+    BOOST_FOREACH (const CMasternode& mn, lMasternodes) {
+        mapListedBroadcasts[CMasternodeBroadcast(mn).GetHash()] = &mn;
+        mapListedPings[mn.lastPing.GetHash()] = &mn;
+    }
+
+    uint256 hash;
+    while (listedBroadcasts.Next(hash)) {
+        std::map<uint256, const CMasternode*>::const_iterator mi = mapListedBroadcasts.find(hash);
+        if (mi != mapListedBroadcasts.end())
+            mapSeenMasternodeBroadcast.insert(std::make_pair(hash, CMasternodeBroadcast(*mi->second)), mi->second->vin.prevout);
+    }
+    CSnapshotChunkReader seenBroadcasts(s);
+    while (true) {
+        CMasternodeBroadcast mnb;
+        if (!seenBroadcasts.Next(hash, mnb))
+            break;
+        mapSeenMasternodeBroadcast.insert(std::make_pair(hash, mnb), mnb.vin.prevout);
+    }
+
+    CSnapshotChunkReader listedPings(s);
+    while (listedPings.Next(hash)) {
+        std::map<uint256, const CMasternode*>::const_iterator mi = mapListedPings.find(hash);
+        if (mi != mapListedPings.end())
+            mapSeenMasternodePing.insert(std::make_pair(hash, mi->second->lastPing));
+    }
+    CSnapshotChunkReader seenPings(s);
+    while (true) {
+        CMasternodePing mnp;
+        if (!seenPings.Next(hash, mnp))
+            break;
+        mapSeenMasternodePing.insert(std::make_pair(hash, mnp));
+    }
+}
+
+void CMasternodeMan::ReadLegacy(CSnapshotReader& s, bool fLoadSeen)
+{
+    LOCK(cs);
+    Clear();
+
+    std::vector<CMasternode> vMasternodes;
+    s >> vMasternodes;
+    lMasternodes.assign(vMasternodes.begin(), vMasternodes.end());
+    RebuildIndexes();
+
+    s >> mAskedUsForMasternodeList;
+    s >> mWeAskedForMasternodeList;
+    s >> mWeAskedForMasternodeListEntry;
+    s >> nDsqCount;
+
+    // the seen messages were written as plain maps, so they are read even when they are not kept
+    std::map<uint256, CMasternodeBroadcast> mapBroadcasts;
+    std::map<uint256, CMasternodePing> mapPings;
+    s >> mapBroadcasts;
+    s >> mapPings;
+    if (!fLoadSeen)
+        return;
+
+    for (std::map<uint256, CMasternodeBroadcast>::const_iterator it = mapBroadcasts.begin(); it != mapBroadcasts.end(); ++it)
+        mapSeenMasternodeBroadcast.insert(*it, it->second.vin.prevout);
+    for (std::map<uint256, CMasternodePing>::const_iterator it = mapPings.begin(); it != mapPings.end(); ++it)
+        mapSeenMasternodePing.insert(*it);
 }
 
 //
@@ -487,7 +738,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     */
 
     int nMnCount = CountEnabled();
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, lMasternodes) {
         mn.Check();
         if (!mn.IsEnabled()) continue;
 
@@ -503,7 +754,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nMnCount), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -518,7 +769,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     //  -- This doesn't look at who is being paid in the +8-10 blocks, allowing for double payments very rarely
     //  -- 1/100 payments should be a double payment on mainnet - (1/(3000/10))*2
     //  -- (chance per block * chances before IsScheduled will fire)
-    int nTenthNetwork = CountEnabled() / 10;
+    int nTenthNetwork = nMnCount / 10;
     int nCountTenth = 0;
     uint256 nHigh = 0;
     BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeLastPaid) {
@@ -550,7 +801,7 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     LogPrint("masternode", "CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, lMasternodes) {
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH (CTxIn& usedVin, vecToExclude) {
@@ -568,70 +819,89 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     return NULL;
 }
 
-CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
+// requires LOCK(cs)
+void CMasternodeMan::ClearMasternodeScores()
 {
-    int64_t score = 0;
-    CMasternode* winner = NULL;
+    mapMasternodeScores.clear();
+    vecMasternodeScoresOrder.clear();
+    nListVersion++;
+}
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        mn.Check();
-        if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
+// requires LOCK(cs)
+const std::vector<pair<int64_t, CMasternode*> >* CMasternodeMan::GetMasternodeScores(int64_t nBlockHeight)
+{
+    //make sure we know about this block
+    uint256 hash = 0;
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
 
-        // calculate the score for each Masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+    std::map<uint256, std::vector<pair<int64_t, CMasternode*> > >::iterator it = mapMasternodeScores.find(hash);
+    if (it != mapMasternodeScores.end())
+        return &it->second;
 
-        // determine the winner
-        if (n2 > score) {
-            score = n2;
-            winner = &mn;
-        }
+    std::vector<pair<int64_t, CMasternode*> > vecScores;
+    vecScores.reserve(lMasternodes.size());
+    BOOST_FOREACH (CMasternode& mn, lMasternodes) {
+        uint256 n = mn.CalculateScore(1, nBlockHeight);
+        vecScores.push_back(make_pair((int64_t)n.GetCompact(false), &mn));
     }
+    sort(vecScores.begin(), vecScores.end(), CompareScoreMN());
 
-    return winner;
+    if (vecMasternodeScoresOrder.size() >= MASTERNODES_SCORE_CACHE_SIZE) {
+        mapMasternodeScores.erase(vecMasternodeScoresOrder.front());
+        vecMasternodeScoresOrder.pop_front();
+    }
+    vecMasternodeScoresOrder.push_back(hash);
+    it = mapMasternodeScores.insert(make_pair(hash, std::vector<pair<int64_t, CMasternode*> >())).first;
+    it->second.swap(vecScores);
+    return &it->second;
+}
+
+CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
+{
+    LOCK(cs);
+
+    const std::vector<pair<int64_t, CMasternode*> >* pvecScores = GetMasternodeScores(nBlockHeight);
+    if (pvecScores == NULL) return NULL;
+
+    // the winner is the best scoring enabled Masternode
+    for (std::vector<pair<int64_t, CMasternode*> >::const_iterator it = pvecScores->begin(); it != pvecScores->end(); ++it) {
+        CMasternode* pmn = it->second;
+        pmn->Check();
+        if (pmn->protocolVersion < minProtocol || !pmn->IsEnabled()) continue;
+        if (it->first <= 0) break;
+        return pmn;
+    }
+
+    return NULL;
 }
 
 int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
+
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
+    bool fFilterAge = IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT);
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    const std::vector<pair<int64_t, CMasternode*> >* pvecScores = GetMasternodeScores(nBlockHeight);
+    if (pvecScores == NULL) return -1;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) {
-            LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
-            continue;                                                       // Skip obsolete versions
-        }
+    int rank = 0;
+    for (std::vector<pair<int64_t, CMasternode*> >::const_iterator it = pvecScores->begin(); it != pvecScores->end(); ++it) {
+        CMasternode& mn = *it->second;
+        if (mn.protocolVersion < minProtocol) continue; // Skip obsolete versions
 
-        if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
+        if (fFilterAge) {
             nMasternode_Age = GetAdjustedTime() - mn.sigTime;
-            if ((nMasternode_Age) < nMasternode_Min_Age) {
-                if (fDebug) LogPrint("masternode","Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
-                continue;                                                   // Skip masternodes younger than (default) 1 hour
-            }
+            if ((nMasternode_Age) < nMasternode_Min_Age) continue; // Skip masternodes younger than (default) 1 hour
         }
         if (fOnlyActive) {
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
-        if (s.second.prevout == vin.prevout) {
+        if (mn.vin.prevout == vin.prevout) {
             return rank;
         }
     }
@@ -641,66 +911,53 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
+    LOCK(cs);
+
     std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    const std::vector<pair<int64_t, CMasternode*> >* pvecScores = GetMasternodeScores(nBlockHeight);
+    if (pvecScores == NULL) return vecMasternodeRanks;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // enabled Masternodes by score, then the ones that are not enabled
+    std::vector<CMasternode*> vecNotEnabled;
+    for (std::vector<pair<int64_t, CMasternode*> >::const_iterator it = pvecScores->begin(); it != pvecScores->end(); ++it) {
+        CMasternode& mn = *it->second;
         mn.Check();
 
         if (mn.protocolVersion < minProtocol) continue;
 
         if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(make_pair(9999, mn));
+            vecNotEnabled.push_back(&mn);
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
-        rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        vecMasternodeRanks.push_back(make_pair((int)vecMasternodeRanks.size() + 1, mn));
     }
+    BOOST_FOREACH (CMasternode* pmn, vecNotEnabled)
+        vecMasternodeRanks.push_back(make_pair((int)vecMasternodeRanks.size() + 1, *pmn));
 
     return vecMasternodeRanks;
 }
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) continue;
+    const std::vector<pair<int64_t, CMasternode*> >* pvecScores = GetMasternodeScores(nBlockHeight);
+    if (pvecScores == NULL) return NULL;
+
+    int rank = 0;
+    for (std::vector<pair<int64_t, CMasternode*> >::const_iterator it = pvecScores->begin(); it != pvecScores->end(); ++it) {
+        CMasternode* pmn = it->second;
+        if (pmn->protocolVersion < minProtocol) continue;
         if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
+            pmn->Check();
+            if (!pmn->IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
         if (rank == nRank) {
-            return Find(s.second);
+            return pmn;
         }
     }
 
@@ -732,13 +989,13 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
     if (strCommand == "mnb") { //Masternode Broadcast
         CMasternodeBroadcast mnb;
-        vRecv >> mnb;
+        if (!pfrom->TakeDecoded(mnb))
+            vRecv >> mnb;
 
         if (mapSeenMasternodeBroadcast.count(mnb.GetHash())) { //seen
             masternodeSync.AddedMasternodeList(mnb.GetHash());
             return;
         }
-        mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
 
         int nDoS = 0;
         if (!mnb.CheckAndUpdate(nDoS)) {
@@ -757,6 +1014,9 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             return;
         }
 
+        // only checked broadcasts are remembered, so forged ones cannot push live broadcasts out of the bounded map
+        mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb), mnb.vin.prevout);
+
         // make sure it's still unspent
         //  - this is checked later by .check() in many places and by ThreadCheckObfuScationPool()
         if (mnb.CheckInputsAndAdd(nDoS)) {
@@ -773,7 +1033,8 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
     else if (strCommand == "mnp") { //Masternode Ping
         CMasternodePing mnp;
-        vRecv >> mnp;
+        if (!pfrom->TakeDecoded(mnp))
+            vRecv >> mnp;
 
         LogPrint("masternode", "mnp - Masternode ping, vin: %s\n", mnp.vin.prevout.hash.ToString());
 
@@ -824,7 +1085,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         int nInvCount = 0;
 
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH (CMasternode& mn, lMasternodes) {
             if (mn.addr.IsRFC1918()) continue; //local network
 
             if (mn.IsEnabled()) {
@@ -835,7 +1096,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                     pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
                     nInvCount++;
 
-                    if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+                    if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb), mnb.vin.prevout);
 
                     if (vin == mn.vin) {
                         LogPrint("masternode", "dseg - Sent 1 Masternode entry to peer %i\n", pfrom->GetId());
@@ -943,6 +1204,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                     LogPrint("masternode", "dsee - Got updated entry for %s\n", vin.prevout.hash.ToString());
                     if (pmn->protocolVersion < GETHEADERS_VERSION) {
                         pmn->pubKeyMasternode = pubkey2;
+                        UpdateIndexes(*pmn);
                         pmn->sigTime = sigTime;
                         pmn->sig = vchSig;
                         pmn->protocolVersion = protocolVersion;
@@ -1136,11 +1398,13 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = lMasternodes.begin();
+    while (it != lMasternodes.end()) {
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-            vMasternodes.erase(it);
+            mapMasternodesByCollateral.erase((*it).vin.prevout);
+            ClearMasternodeScores();
+            lMasternodes.erase(it);
             break;
         }
         ++it;
@@ -1151,7 +1415,7 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
 {
     LOCK(cs);
     mapSeenMasternodePing.insert(std::make_pair(mnb.lastPing.GetHash(), mnb.lastPing));
-    mapSeenMasternodeBroadcast.insert(std::make_pair(mnb.GetHash(), mnb));
+    mapSeenMasternodeBroadcast.insert(std::make_pair(mnb.GetHash(), mnb), mnb.vin.prevout);
 
     LogPrint("masternode","CMasternodeMan::UpdateMasternodeList -- masternode=%s\n", mnb.vin.prevout.ToStringShort());
 
@@ -1170,7 +1434,7 @@ std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
+    info << "Masternodes: " << (int)lMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
 
     return info.str();
 }
@@ -8,21 +8,42 @@
 #define MASTERNODEMAN_H
 
 #include "base58.h"
+#include "expiringmap.h"
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
 #include "net.h"
+#include "snapshot.h"
 #include "sync.h"
 #include "util.h"
+#include "validationinterface.h"
+
+#include <list>
+
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
 
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODES_SCORE_CACHE_SIZE 64
+// Seen broadcasts and pings are forgotten this long after they were last pinged
+#define MASTERNODES_SEEN_EXPIRY_SECONDS (MASTERNODE_REMOVAL_SECONDS * 2)
+#define MASTERNODES_SEEN_MAX_BROADCASTS 20000
+#define MASTERNODES_SEEN_MAX_PINGS 200000
 
 using namespace std;
 
 class CMasternodeMan;
 
 extern CMasternodeMan mnodeman;
+
+/** Hashes the keys the Masternode list is indexed by */
+struct CMasternodeIndexHasher {
+    size_t operator()(const COutPoint& outpoint) const { return outpoint.hash.GetLow64() ^ outpoint.n; }
+    size_t operator()(const CScript& script) const { return boost::hash_range(script.begin(), script.end()); }
+    size_t operator()(const CPubKey& pubkey) const { return boost::hash_range(pubkey.begin(), pubkey.end()); }
+};
+
 void DumpMasternodes();
 
 /** Access to the MN database (mncache.dat)
@@ -32,6 +53,7 @@ class CMasternodeDB
 private:
     boost::filesystem::path pathMN;
     std::string strMagicMessage;
+    std::string strLegacyMagicMessage; // before the snapshot format, converted when read
 
 public:
     enum ReadResult {
@@ -49,7 +71,7 @@ public:
     ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
 };
 
-class CMasternodeMan
+class CMasternodeMan : public CValidationInterface
 {
 private:
     // critical section to protect the inner data structures
@@ -58,8 +80,23 @@ private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    // list to hold all MNs; entries never move, so a pointer from Find stays valid until the entry is removed
+    std::list<CMasternode> lMasternodes;
+    // indexes into lMasternodes. The pubkey and payee indexes point at the collateral and are checked
+    // against the entry on lookup, so entries left behind by a key change or a removal are dropped lazily.
+    boost::unordered_map<COutPoint, CMasternode*, CMasternodeIndexHasher> mapMasternodesByCollateral;
+    boost::unordered_multimap<CPubKey, COutPoint, CMasternodeIndexHasher> mapMasternodesByPubKey;
+    boost::unordered_multimap<CScript, COutPoint, CMasternodeIndexHasher> mapMasternodesByPayee;
+
+    // scores of every listed MN by the block hash they were computed from, highest first. Ranks for a
+    // height are read off these by filtering; they are dropped whenever an entry is added or removed.
+    std::map<uint256, std::vector<pair<int64_t, CMasternode*> > > mapMasternodeScores;
+    std::deque<uint256> vecMasternodeScoresOrder;
+    // bumped along with dropping the scores, so others can tell whether the set of entries changed
+    int64_t nListVersion;
+
+    const std::vector<pair<int64_t, CMasternode*> >* GetMasternodeScores(int64_t nBlockHeight);
+    void ClearMasternodeScores();
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
@@ -68,32 +105,22 @@ private:
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
 public:
-    // Keep track of all broadcasts I've seen
-    map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
+    // Keep track of all broadcasts I've seen, inserted under their collateral
+    expiringmap<uint256, CMasternodeBroadcast, COutPoint> mapSeenMasternodeBroadcast;
     // Keep track of all pings I've seen
-    map<uint256, CMasternodePing> mapSeenMasternodePing;
+    expiringmap<uint256, CMasternodePing> mapSeenMasternodePing;
 
     // keep track of dsq count to prevent masternodes from gaming obfuscation queue
     int64_t nDsqCount;
 
-    ADD_SERIALIZE_METHODS;
-
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
-    {
-        LOCK(cs);
-        READWRITE(vMasternodes);
-        READWRITE(mAskedUsForMasternodeList);
-        READWRITE(mWeAskedForMasternodeList);
-        READWRITE(mWeAskedForMasternodeListEntry);
-        READWRITE(nDsqCount);
-
-        READWRITE(mapSeenMasternodeBroadcast);
-        READWRITE(mapSeenMasternodePing);
-    }
+    /// Write the list, the request times and the seen messages to mncache.dat
+    void WriteSnapshot(CSnapshotWriter& s) const;
+    /// Read them back; the seen broadcasts and pings are only stepped over unless fLoadSeen
+    void ReadSnapshot(CSnapshotReader& s, bool fLoadSeen);
+    /// Read the whole object serialized as before the snapshot format; the seen broadcasts and pings are only kept if fLoadSeen
+    void ReadLegacy(CSnapshotReader& s, bool fLoadSeen);
 
     CMasternodeMan();
-    CMasternodeMan(CMasternodeMan& other);
 
     /// Add an entry
     bool Add(CMasternode& mn);
@@ -107,20 +134,35 @@ public:
     /// Check all Masternodes and remove inactive
     void CheckAndRemove(bool forceExpiredRemoval = false);
 
+    /// Mark Masternodes whose collateral is no longer in the UTXO set (or is spent in the mempool) as spent
+    void CheckCollaterals();
+
     /// Clear Masternode vector
     void Clear();
 
     int CountEnabled(int protocolVersion = -1);
 
+    /// Changes whenever an entry is added or removed
+    int64_t GetListVersion()
+    {
+        LOCK(cs);
+        return nListVersion;
+    }
+
     void CountNetworks(int protocolVersion, int& ipv4, int& ipv6, int& onion);
 
     void DsegUpdate(CNode* pnode);
 
-    /// Find an entry
+    /// Find an entry; of several entries sharing a payee or pubkey, the one with the lowest collateral outpoint
     CMasternode* Find(const CScript& payee);
     CMasternode* Find(const CTxIn& vin);
     CMasternode* Find(const CPubKey& pubKeyMasternode);
 
+    /// Index an entry under its current keys; needed after changing the pubkeys of a listed Masternode
+    void UpdateIndexes(const CMasternode& mn);
+    /// Drop and rebuild all indexes from the list
+    void RebuildIndexes();
+
     /// Find an entry in the masternode list that is next to be paid
     CMasternode* GetNextMasternodeInQueueForPayment(int nBlockHeight, bool fFilterSigTime, int& nCount);
 
@@ -133,7 +175,7 @@ public:
     std::vector<CMasternode> GetFullMasternodeVector()
     {
         Check();
-        return vMasternodes;
+        return std::vector<CMasternode>(lMasternodes.begin(), lMasternodes.end());
     }
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
@@ -145,7 +187,7 @@ public:
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return lMasternodes.size(); }
 
     /// Return the number of Masternodes older than (default) 8000 seconds
     int stable_size ();
@@ -156,6 +198,10 @@ public:
 
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
+
+protected:
+    /// Collateral tracking: any transaction entering the mempool or a block that spends a collateral disables its Masternode
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
 };
 
 #endif
@@ -12,7 +12,6 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -28,8 +27,10 @@
 #include <arpa/inet.h>
 #endif
 
+#include <boost/any.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -37,6 +38,9 @@ class CBlockIndex;
 class CScheduler;
 class CNode;
 
+/** A complete serialized network message, shared read-only between the send queues of any number of peers */
+typedef boost::shared_ptr<const CSerializeData> CSerializedNetMsgRef;
+
 namespace boost
 {
 class thread_group;
@@ -133,7 +137,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSerializedNetMsgRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -189,6 +193,9 @@ public:
 
     int64_t nTime; // time (in microseconds) of message receipt.
 
+    bool fSignaturesQueued; // signatures handed to the recovery threads ahead of processing
+    boost::any gossip;      // the gossip message as decoded for that, handed on to its handler
+
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
     {
         hdrbuf.resize(24);
@@ -196,6 +203,7 @@ public:
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        fSignaturesQueued = false;
     }
 
     bool complete() const
@@ -277,6 +285,29 @@ public:
 
 typedef std::map<CSubNet, CBanEntry> banmap_t;
 
+/** Fill in the payload size and checksum of the message in ss, which starts with its CMessageHeader */
+void FinalizeMessageHeader(CDataStream& ss);
+
+/**
+ * Serialize a complete message (header and payload) into a buffer of its own.
+ * The result is immutable, so relayed blocks and transactions are serialized
+ * once and the same buffer is queued to every peer that asks for them.
+ */
+template <typename T>
+CSerializedNetMsgRef MakeSerializedNetMsg(const char* pszCommand, const T& payload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ::GetSerializeSize(payload, SER_NETWORK, PROTOCOL_VERSION));
+    ss << CMessageHeader(pszCommand, 0) << payload;
+    FinalizeMessageHeader(ss);
+    boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+    ss.GetAndClear(*pmsg);
+    return pmsg;
+}
+
+/** As above, for a payload that is already serialized */
+CSerializedNetMsgRef MakeSerializedNetMsg(const char* pszCommand, const CDataStream& payload);
+
 
 /** Information about a peer */
 class CNode
@@ -289,12 +320,14 @@ public:
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedNetMsgRef> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // the gossip message being processed, if it was decoded ahead of its handler
+    boost::any gossipDecoded;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -358,14 +391,16 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
+    //! Time (in usec) at which the next batch of transaction invs is sent to this peer
+    int64_t nNextInvSend;
     std::multimap<int64_t, CInv> mapAskFor;
     std::vector<uint256> vBlockRequested;
 
@@ -438,7 +473,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -446,7 +481,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -456,11 +491,23 @@ public:
     }
 
 
+    /** Take the message being processed as it was decoded ahead of the handler, if it was decoded into a T */
+    template <typename T>
+    bool TakeDecoded(T& obj)
+    {
+        T* pobj = boost::any_cast<T>(&gossipDecoded);
+        if (pobj == NULL)
+            return false;
+        obj = *pobj;
+        gossipDecoded = boost::any();
+        return true;
+    }
+
     void AddInventoryKnown(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.GetKey());
         }
     }
 
@@ -468,7 +515,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.GetKey()))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -486,6 +533,9 @@ public:
 
     void PushVersion();
 
+    /** Queue a message built by MakeSerializedNetMsg; the buffer is shared, not copied */
+    void PushSerializedMessage(const CSerializedNetMsgRef& pmsg);
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -742,6 +792,9 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
 
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
 {
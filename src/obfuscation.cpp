@@ -29,6 +29,8 @@ using namespace boost;
 CObfuscationPool obfuScationPool;
 // A helper object for signing messages from Masternodes
 CObfuScationSigner obfuScationSigner;
+// Recovers the signers of masternode gossip ahead of the message handler
+CSignatureRecoveryQueue signatureRecoveryQueue;
 // The current Obfuscations in progress on the network
 std::vector<CObfuscationQueue> vecObfuscationQueue;
 // Keep track of the used Masternodes
@@ -2168,17 +2170,129 @@ bool CObfuScationSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vc
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    uint256 hashMessage = ss.GetHash();
 
-    CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
+    CKeyID keyID;
+    if (!signatureRecoveryQueue.Get(hashMessage, vchSig, keyID)) {
+        CPubKey pubkey2;
+        if (pubkey2.RecoverCompact(hashMessage, vchSig))
+            keyID = pubkey2.GetID();
+    }
+
+    if (keyID.IsNull()) {
         errorMessage = _("Error recovering public key.");
         return false;
     }
 
-    if (fDebug && pubkey2.GetID() != pubkey.GetID())
-        LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
+    if (fDebug && keyID != pubkey.GetID())
+        LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", keyID.ToString(), pubkey.GetID().ToString());
+
+    return (keyID == pubkey.GetID());
+}
+
+uint256 CSignatureRecoveryQueue::GetKey(const uint256& hashMessage, const std::vector<unsigned char>& vchSig)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << hashMessage;
+    ss << vchSig;
+    return ss.GetHash();
+}
+
+void CSignatureRecoveryQueue::Thread()
+{
+    std::vector<std::pair<uint256, std::pair<uint256, std::vector<unsigned char> > > > vBatch;
+    std::vector<CKeyID> vResults;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nWorkers++;
+    try {
+        while (true) {
+            // Publish the previous batch
+            for (unsigned int i = 0; i < vResults.size(); i++) {
+                mapPending.erase(vBatch[i].first);
+                setInProgress.erase(vBatch[i].first);
+                if (mapRecovered.insert(std::make_pair(vBatch[i].first, vResults[i])).second)
+                    dequeRecovered.push_back(vBatch[i].first);
+            }
+            while (dequeRecovered.size() > SIGRECOVERY_MAX_RESULTS) {
+                mapRecovered.erase(dequeRecovered.front());
+                dequeRecovered.pop_front();
+            }
+            if (!vResults.empty())
+                condResult.notify_all();
+            vBatch.clear();
+            vResults.clear();
+
+            while (queue.empty())
+                condWorker.wait(lock);
+
+            while (!queue.empty() && vBatch.size() < SIGRECOVERY_BATCH_SIZE) {
+                // Skip signatures Get() has taken back in the meantime
+                std::map<uint256, std::pair<uint256, std::vector<unsigned char> > >::const_iterator it = mapPending.find(queue.front());
+                if (it != mapPending.end()) {
+                    vBatch.push_back(*it);
+                    setInProgress.insert(it->first);
+                }
+                queue.pop_front();
+            }
+            if (vBatch.empty())
+                continue;
+
+            // The secp256k1 context is shared and read-only once started, so recover without the lock
+            lock.unlock();
+            for (unsigned int i = 0; i < vBatch.size(); i++) {
+                CPubKey pubkey;
+                vResults.push_back(pubkey.RecoverCompact(vBatch[i].second.first, vBatch[i].second.second) ? pubkey.GetID() : CKeyID());
+            }
+            lock.lock();
+        }
+    } catch (boost::thread_interrupted&) {
+        // Interrupted while waiting for work: nothing of ours is in progress
+        nWorkers--;
+        condResult.notify_all();
+        throw;
+    }
+}
+
+void CSignatureRecoveryQueue::Add(const std::string& strMessage, const std::vector<unsigned char>& vchSig)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << strMessageMagic;
+    ss << strMessage;
+    uint256 hashMessage = ss.GetHash();
+    uint256 key = GetKey(hashMessage, vchSig);
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (nWorkers == 0 || mapPending.count(key) || mapRecovered.count(key))
+        return;
+    if (mapPending.size() >= SIGRECOVERY_MAX_QUEUED) {
+        // The handler recovers it itself when it gets there
+        LogPrint("masternode", "CSignatureRecoveryQueue::Add -- queue full, dropping signature\n");
+        return;
+    }
+    mapPending[key] = std::make_pair(hashMessage, vchSig);
+    queue.push_back(key);
+    condWorker.notify_one();
+}
+
+bool CSignatureRecoveryQueue::Get(const uint256& hashMessage, const std::vector<unsigned char>& vchSig, CKeyID& keyIDRet)
+{
+    uint256 key = GetKey(hashMessage, vchSig);
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (mapPending.count(key) && !setInProgress.count(key)) {
+        // Recovering it here is no slower than waiting for the signatures queued ahead of it
+        mapPending.erase(key);
+        return false;
+    }
+    while (nWorkers > 0 && setInProgress.count(key))
+        condResult.wait(lock);
 
-    return (pubkey2.GetID() == pubkey.GetID());
+    std::map<uint256, CKeyID>::const_iterator it = mapRecovered.find(key);
+    if (it == mapRecovered.end())
+        return false;
+    keyIDRet = it->second;
+    return true;
 }
 
 bool CObfuscationQueue::Sign()
@@ -2282,6 +2396,12 @@ void CObfuscationPool::RelayCompletedTransaction(const int sessionID, const bool
 }
 
 //TODO: Rename/move to core
+void ThreadSignatureRecovery()
+{
+    RenameThread("wagerr-sigrecov");
+    signatureRecoveryQueue.Thread();
+}
+
 void ThreadCheckObfuScationPool()
 {
     if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
@@ -22,6 +22,7 @@ class CBitcoinAddress;
 class CObfuscationQueue;
 class CObfuscationBroadcastTx;
 class CActiveMasternode;
+class CSignatureRecoveryQueue;
 
 // pool states for mixing
 #define POOL_STATUS_UNKNOWN 0              // waiting for update
@@ -39,6 +40,12 @@ class CActiveMasternode;
 #define MASTERNODE_REJECTED 0
 #define MASTERNODE_RESET -1
 
+// signature recovery for masternode gossip
+#define SIGRECOVERY_BATCH_SIZE 16     // signatures a recovery thread takes from the queue at once
+#define SIGRECOVERY_MAX_RESULTS 20000 // recovered signers kept for the message handler
+#define SIGRECOVERY_MAX_QUEUED 4000    // signatures waiting for or in recovery, beyond which new ones are dropped
+#define SIGRECOVERY_MAX_PEER_AHEAD 200 // messages of one peer looked at ahead of the message handler
+
 #define OBFUSCATION_QUEUE_TIMEOUT 30
 #define OBFUSCATION_SIGNING_TIMEOUT 15
 
@@ -52,6 +59,7 @@ static const CAmount OBFUSCATION_POOL_MAX = (99999.99 * COIN);
 
 extern CObfuscationPool obfuScationPool;
 extern CObfuScationSigner obfuScationSigner;
+extern CSignatureRecoveryQueue signatureRecoveryQueue;
 extern std::vector<CObfuscationQueue> vecObfuscationQueue;
 extern std::string strMasterNodePrivKey;
 extern map<uint256, CObfuscationBroadcastTx> mapObfuscationBroadcastTxes;
@@ -260,6 +268,43 @@ public:
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
 };
 
+/** Recovers the signers of masternode gossip (mnb, mnp, mnw, mvote, fbvote, spork) ahead of
+ *  the message handler. Messages are queued as soon as a peer's message is complete, worker
+ *  threads recover the public keys in batches, and VerifyMessage picks the result up when the
+ *  handler gets to the message. Messages are still handled one by one in arrival order.
+ */
+class CSignatureRecoveryQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker; // signatures were queued
+    boost::condition_variable condResult; // signers were recovered
+    int nWorkers;
+
+    /// Signatures waiting for a worker
+    std::deque<uint256> queue;
+    /// Message hash and signature of queued and in-progress signatures
+    std::map<uint256, std::pair<uint256, std::vector<unsigned char> > > mapPending;
+    /// Signatures a worker is recovering right now
+    std::set<uint256> setInProgress;
+    /// Recovered signers, a null key id if recovery failed, oldest first in dequeRecovered
+    std::map<uint256, CKeyID> mapRecovered;
+    std::deque<uint256> dequeRecovered;
+
+    static uint256 GetKey(const uint256& hashMessage, const std::vector<unsigned char>& vchSig);
+
+public:
+    CSignatureRecoveryQueue() : nWorkers(0) {}
+
+    /// Worker thread
+    void Thread();
+    /// Queue a signed message for recovery, if any worker is running and the queue is not full
+    void Add(const std::string& strMessage, const std::vector<unsigned char>& vchSig);
+    /// Get the recovered signer of a queued message, waiting only if a worker is recovering it.
+    /// A signature still waiting in the queue is taken back, for the caller to recover.
+    bool Get(const uint256& hashMessage, const std::vector<unsigned char>& vchSig, CKeyID& keyIDRet);
+};
+
 /** Used to keep track of current status of Obfuscation pool
  */
 class CObfuscationPool
@@ -513,5 +558,6 @@ public:
 };
 
 void ThreadCheckObfuScationPool();
+void ThreadSignatureRecovery();
 
 #endif
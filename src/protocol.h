@@ -145,6 +145,8 @@ public:
     bool IsMasterNodeType() const;
     const char* GetCommand() const;
     std::string ToString() const;
+    //! Hash and type, so that e.g. a tx and its lock request are told apart in inventory filters
+    std::vector<unsigned char> GetKey() const;
 
     // TODO: make private (improves encapsulation)
 public:
@@ -170,7 +172,9 @@ enum {
     MSG_MASTERNODE_QUORUM,
     MSG_MASTERNODE_ANNOUNCE,
     MSG_MASTERNODE_PING,
-    MSG_DSTX
+    MSG_DSTX,
+    // MSG_CMPCT_BLOCK is only used in getdata, to ask for a block as a cmpctblock message.
+    MSG_CMPCT_BLOCK
 };
 
 #endif // BITCOIN_PROTOCOL_H
@@ -1583,9 +1583,11 @@ UniValue keypoolrefill(const UniValue& params, bool fHelp)
         kpSize = (unsigned int)params[0].get_int();
     }
 
+    // Thread safe: TopUpKeyPool only takes the wallet lock to add each batch of keys
     EnsureWalletIsUnlocked();
     pwalletMain->TopUpKeyPool(kpSize);
 
+    LOCK(pwalletMain->cs_wallet);
     if (pwalletMain->GetKeyPoolSize() < kpSize)
         throw JSONRPCError(RPC_WALLET_ERROR, "Error refreshing keypool.");
 
@@ -1765,6 +1767,11 @@ UniValue encryptwallet(const UniValue& params, bool fHelp)
             "encryptwallet <passphrase>\n"
             "Encrypts the wallet with <passphrase>.");
 
+    boost::filesystem::path pathPreLog;
+    if (CWalletDB::GetPreLogFile(pwalletMain->strWalletFile, pathPreLog))
+        throw JSONRPCError(RPC_WALLET_ENCRYPTION_FAILED, strprintf("Error: %s still holds the unencrypted keys of this wallet from before it was migrated to the wallet log. "
+                                                                   "Delete it or move it off this machine, then encrypt the wallet.", pathPreLog.string()));
+
     if (!pwalletMain->EncryptWallet(strWalletPass))
         throw JSONRPCError(RPC_WALLET_ENCRYPTION_FAILED, "Error: Failed to encrypt the wallet.");
 
@@ -2338,8 +2345,7 @@ UniValue listmintedzerocoins(const UniValue& params, bool fHelp)
     if (pwalletMain->IsLocked())
         throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Error: Please enter the wallet passphrase with walletpassphrase first.");
 
-    CWalletDB walletdb(pwalletMain->strWalletFile);
-    list<CZerocoinMint> listPubCoin = walletdb.ListMintedCoins(true, false, true);
+    list<CZerocoinMint> listPubCoin = pwalletMain->zerocoinTracker.ListMints(true, false, true);
 
     UniValue jsonList(UniValue::VARR);
     for (const CZerocoinMint& pubCoinItem : listPubCoin) {
@@ -2360,14 +2366,7 @@ UniValue listzerocoinamounts(const UniValue& params, bool fHelp)
     if (pwalletMain->IsLocked())
         throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Error: Please enter the wallet passphrase with walletpassphrase first.");
 
-    CWalletDB walletdb(pwalletMain->strWalletFile);
-    list<CZerocoinMint> listPubCoin = walletdb.ListMintedCoins(true, true, true);
-
-    std::map<libzerocoin::CoinDenomination, CAmount> spread;
-    for (const auto& denom : libzerocoin::zerocoinDenomList)
-        spread.insert(std::pair<libzerocoin::CoinDenomination, CAmount>(denom, 0));
-    for (auto& mint : listPubCoin) spread.at(mint.GetDenomination())++;
-
+    std::map<libzerocoin::CoinDenomination, int> spread = pwalletMain->zerocoinTracker.GetDenominationCounts(true);
 
     UniValue jsonList(UniValue::VARR);
     UniValue val(UniValue::VOBJ);
@@ -2552,8 +2551,7 @@ UniValue resetmintzerocoin(const UniValue& params, bool fHelp)
     if (params.size() == 1)
         fExtendedSearch = params[0].get_bool();
 
-    CWalletDB walletdb(pwalletMain->strWalletFile);
-    list<CZerocoinMint> listMints = walletdb.ListMintedCoins(false, false, true);
+    list<CZerocoinMint> listMints = pwalletMain->zerocoinTracker.ListMints(false, false, true);
     vector<CZerocoinMint> vMintsToFind{ std::make_move_iterator(std::begin(listMints)), std::make_move_iterator(std::end(listMints)) };
     vector<CZerocoinMint> vMintsMissing;
     vector<CZerocoinMint> vMintsToUpdate;
@@ -2564,7 +2562,7 @@ UniValue resetmintzerocoin(const UniValue& params, bool fHelp)
     // update the meta data of mints that were marked for updating
     UniValue arrUpdated(UniValue::VARR);
     for (CZerocoinMint mint : vMintsToUpdate) {
-        walletdb.WriteZerocoinMint(mint);
+        pwalletMain->zerocoinTracker.Write(mint);
         arrUpdated.push_back(mint.GetValue().GetHex());
     }
 
@@ -2572,7 +2570,7 @@ UniValue resetmintzerocoin(const UniValue& params, bool fHelp)
     UniValue arrDeleted(UniValue::VARR);
     for (CZerocoinMint mint : vMintsMissing) {
         arrDeleted.push_back(mint.GetValue().GetHex());
-        walletdb.ArchiveMintOrphan(mint);
+        pwalletMain->zerocoinTracker.Archive(mint);
     }
 
     UniValue obj(UniValue::VOBJ);
@@ -2590,7 +2588,7 @@ UniValue resetspentzerocoin(const UniValue& params, bool fHelp)
             + HelpRequiringPassphrase());
 
     CWalletDB walletdb(pwalletMain->strWalletFile);
-    list<CZerocoinMint> listMints = walletdb.ListMintedCoins(false, false, false);
+    list<CZerocoinMint> listMints = pwalletMain->zerocoinTracker.ListMints(false, false, false);
     list<CZerocoinSpend> listSpends = walletdb.ListSpentCoins();
     list<CZerocoinSpend> listUnconfirmedSpends;
 
@@ -2613,8 +2611,8 @@ UniValue resetspentzerocoin(const UniValue& params, bool fHelp)
         for (CZerocoinMint mint : listMints) {
             if (mint.GetSerialNumber() == spend.GetSerial()) {
                 mint.SetUsed(false);
-                walletdb.WriteZerocoinMint(mint);
-                walletdb.EraseZerocoinSpendSerialEntry(spend.GetSerial());
+                pwalletMain->zerocoinTracker.Write(mint);
+                pwalletMain->zerocoinTracker.EraseSpentSerial(spend.GetSerial());
                 RemoveSerialFromDB(spend.GetSerial());
                 UniValue obj(UniValue::VOBJ);
                 obj.push_back(Pair("serial", spend.GetSerial().GetHex()));
@@ -2685,13 +2683,11 @@ UniValue exportzerocoins(const UniValue& params, bool fHelp)
     if (pwalletMain->IsLocked())
         throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Error: Please enter the wallet passphrase with walletpassphrase first.");
 
-    CWalletDB walletdb(pwalletMain->strWalletFile);
-
     bool fIncludeSpent = params[0].get_bool();
     libzerocoin::CoinDenomination denomination = libzerocoin::ZQ_ERROR;
     if (params.size() == 2)
         denomination = libzerocoin::IntToZerocoinDenomination(params[1].get_int());
-    list<CZerocoinMint> listMints = walletdb.ListMintedCoins(!fIncludeSpent, false, false);
+    list<CZerocoinMint> listMints = pwalletMain->zerocoinTracker.ListMints(!fIncludeSpent, false, false);
 
     UniValue jsonList(UniValue::VARR);
     for (const CZerocoinMint mint : listMints) {
@@ -2738,7 +2734,6 @@ UniValue importzerocoins(const UniValue& params, bool fHelp)
 
     RPCTypeCheck(params, list_of(UniValue::VARR)(UniValue::VOBJ));
     UniValue arrMints = params[0].get_array();
-    CWalletDB walletdb(pwalletMain->strWalletFile);
 
     int count = 0;
     CAmount nValue = 0;
@@ -2767,7 +2762,7 @@ UniValue importzerocoins(const UniValue& params, bool fHelp)
         CZerocoinMint mint(denom, bnValue, bnRandom, bnSerial, fUsed);
         mint.SetTxHash(txid);
         mint.SetHeight(nHeight);
-        walletdb.WriteZerocoinMint(mint);
+        pwalletMain->zerocoinTracker.Write(mint);
         count++;
         nValue += libzerocoin::ZerocoinDenominationToAmount(denom);
     }
@@ -0,0 +1,203 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SNAPSHOT_H
+#define BITCOIN_SNAPSHOT_H
+
+#include "hash.h"
+#include "serialize.h"
+#include "streams.h"
+
+#include <algorithm>
+#include <ios>
+#include <map>
+#include <stdio.h>
+#include <vector>
+
+/**
+ * The masternode snapshot files (mncache.dat, mnpayments.dat and budget.dat) are
+ * streamed to and from disk through a hashing stream, so neither side holds a copy
+ * of the file in memory; the checksum follows the data as before. The magic message
+ * and network magic are followed by the format version and the sections of the file.
+ *
+ * Large containers are written as a series of chunks: a record count, the byte size
+ * of those records and the records, with an empty chunk ending the section. A writer
+ * does not need to know how many records a section will get, and a reader can step
+ * over a section without deserializing it.
+ */
+
+/** Version of the masternode snapshot files */
+static const int MASTERNODE_SNAPSHOT_VERSION = 1;
+
+/** Records buffered per chunk */
+static const unsigned int SNAPSHOT_CHUNK_RECORDS = 1000;
+
+typedef CHashedWriter<CAutoFile> CSnapshotWriter;
+typedef CHashVerifier<CAutoFile> CSnapshotReader;
+
+/** Writes one chunked section of a snapshot */
+class CSnapshotChunkWriter
+{
+private:
+    CSnapshotWriter& s;
+    CDataStream ssChunk;
+    unsigned int nRecords;
+
+    void Flush()
+    {
+        if (nRecords == 0)
+            return;
+        WriteCompactSize(s, nRecords);
+        WriteCompactSize(s, ssChunk.size());
+        s.write(&ssChunk[0], ssChunk.size());
+        ssChunk.clear();
+        nRecords = 0;
+    }
+
+public:
+    CSnapshotChunkWriter(CSnapshotWriter& sIn) : s(sIn), ssChunk(sIn.nType, sIn.nVersion), nRecords(0) {}
+
+    template <typename T>
+    void Add(const T& obj)
+    {
+        ssChunk << obj;
+        if (++nRecords == SNAPSHOT_CHUNK_RECORDS)
+            Flush();
+    }
+
+    template <typename K, typename V>
+    void Add(const K& key, const V& value)
+    {
+        ssChunk << key << value;
+        if (++nRecords == SNAPSHOT_CHUNK_RECORDS)
+            Flush();
+    }
+
+    /** Write out the last chunk and end the section */
+    void Finish()
+    {
+        Flush();
+        WriteCompactSize(s, 0);
+    }
+};
+
+/** Reads one chunked section of a snapshot */
+class CSnapshotChunkReader
+{
+private:
+    CSnapshotReader& s;
+    CDataStream ssChunk;
+    uint64_t nRecords;
+    bool fEnd;
+
+    bool NextChunk()
+    {
+        while (nRecords == 0) {
+            if (fEnd)
+                return false;
+            if (!ssChunk.empty())
+                throw std::ios_base::failure("snapshot chunk longer than its records");
+            nRecords = ReadCompactSize(s);
+            if (nRecords == 0) {
+                fEnd = true;
+                return false;
+            }
+            uint64_t nSize = ReadCompactSize(s);
+            if (nSize == 0 || nSize > MAX_SIZE)
+                throw std::ios_base::failure("snapshot chunk size out of range");
+            ssChunk.clear();
+            ssChunk.resize(nSize);
+            s.read(&ssChunk[0], nSize);
+        }
+        return true;
+    }
+
+public:
+    CSnapshotChunkReader(CSnapshotReader& sIn) : s(sIn), ssChunk(sIn.nType, sIn.nVersion), nRecords(0), fEnd(false) {}
+
+    /** Read the next record, false at the end of the section */
+    template <typename T>
+    bool Next(T& obj)
+    {
+        if (!NextChunk())
+            return false;
+        ssChunk >> obj;
+        nRecords--;
+        return true;
+    }
+
+    template <typename K, typename V>
+    bool Next(K& key, V& value)
+    {
+        if (!NextChunk())
+            return false;
+        ssChunk >> key >> value;
+        nRecords--;
+        return true;
+    }
+
+    /** Step over the rest of the section; it is still hashed, but not deserialized */
+    void Skip()
+    {
+        while (NextChunk()) {
+            ssChunk.clear();
+            nRecords = 0;
+        }
+    }
+};
+
+/** Write a map (std::map or a map-like container) as a chunked section of (key, value) records */
+template <typename Map>
+void WriteSnapshotMap(CSnapshotWriter& s, const Map& mapItems)
+{
+    CSnapshotChunkWriter chunks(s);
+    for (typename Map::const_iterator it = mapItems.begin(); it != mapItems.end(); ++it)
+        chunks.Add(it->first, it->second);
+    chunks.Finish();
+}
+
+/** Read a chunked section of (key, value) records into a map */
+template <typename Map>
+void ReadSnapshotMap(CSnapshotReader& s, Map& mapItems)
+{
+    CSnapshotChunkReader chunks(s);
+    while (true) {
+        typename Map::key_type key;
+        typename Map::mapped_type value;
+        if (!chunks.Next(key, value))
+            break;
+        mapItems.insert(std::make_pair(key, value));
+    }
+}
+
+/**
+ * Check the checksum at the end of a snapshot file against the data before it, without
+ * deserializing anything, and rewind the file to its start. Readers only fill in their
+ * object once this has passed.
+ */
+inline bool VerifySnapshotChecksum(CAutoFile& file)
+{
+    FILE* f = file.Get();
+    if (fseek(f, 0, SEEK_END) != 0)
+        return false;
+    long nSize = ftell(f);
+    if (nSize < (long)sizeof(uint256) || fseek(f, 0, SEEK_SET) != 0)
+        return false;
+
+    CHashWriter hasher(file.GetType(), file.GetVersion());
+    std::vector<char> vBuffer(1 << 16);
+    for (long nLeft = nSize - sizeof(uint256); nLeft > 0;) {
+        size_t nRead = std::min((long)vBuffer.size(), nLeft);
+        if (fread(&vBuffer[0], 1, nRead, f) != nRead)
+            return false;
+        hasher.write(&vBuffer[0], nRead);
+        nLeft -= nRead;
+    }
+    uint256 hashIn;
+    if (fread(hashIn.begin(), 1, sizeof(hashIn), f) != sizeof(hashIn))
+        return false;
+    return fseek(f, 0, SEEK_SET) == 0 && hashIn == hasher.GetHash();
+}
+
+#endif // BITCOIN_SNAPSHOT_H
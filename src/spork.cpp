@@ -14,6 +14,7 @@
 #include "sync.h"
 #include "sporkdb.h"
 #include "util.h"
+#include <boost/atomic.hpp>
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -27,6 +28,59 @@ CSporkManager sporkManager;
 std::map<uint256, CSporkMessage> mapSporks;
 std::map<int, CSporkMessage> mapSporksActive;
 
+// the value of a spork nobody has signed yet
+static int64_t GetSporkDefault(int nSporkID)
+{
+    if (nSporkID == SPORK_2_SWIFTTX) return SPORK_2_SWIFTTX_DEFAULT;
+    if (nSporkID == SPORK_3_SWIFTTX_BLOCK_FILTERING) return SPORK_3_SWIFTTX_BLOCK_FILTERING_DEFAULT;
+    if (nSporkID == SPORK_5_MAX_VALUE) return SPORK_5_MAX_VALUE_DEFAULT;
+    if (nSporkID == SPORK_7_MASTERNODE_SCANNING) return SPORK_7_MASTERNODE_SCANNING_DEFAULT;
+    if (nSporkID == SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT) return SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT_DEFAULT;
+    if (nSporkID == SPORK_9_MASTERNODE_BUDGET_ENFORCEMENT) return SPORK_9_MASTERNODE_BUDGET_ENFORCEMENT_DEFAULT;
+    if (nSporkID == SPORK_10_MASTERNODE_PAY_UPDATED_NODES) return SPORK_10_MASTERNODE_PAY_UPDATED_NODES_DEFAULT;
+    if (nSporkID == SPORK_13_ENABLE_SUPERBLOCKS) return SPORK_13_ENABLE_SUPERBLOCKS_DEFAULT;
+    if (nSporkID == SPORK_14_NEW_PROTOCOL_ENFORCEMENT) return SPORK_14_NEW_PROTOCOL_ENFORCEMENT_DEFAULT;
+    if (nSporkID == SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2) return SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2_DEFAULT;
+    if (nSporkID == SPORK_16_ZEROCOIN_MAINTENANCE_MODE) return SPORK_16_ZEROCOIN_MAINTENANCE_MODE_DEFAULT;
+
+    return -1;
+}
+
+/**
+ * The value of every spork, indexed by nSporkID - SPORK_START: the default until a signed
+ * spork message is accepted, then its value. IsSporkActive is called from masternode and
+ * transaction loops, so reading a spork is a bounds check and a load rather than a map
+ * lookup; mapSporksActive keeps the messages themselves for relay.
+ */
+class CSporkValues
+{
+private:
+    boost::atomic<int64_t> vValues[SPORK_END - SPORK_START + 1];
+
+public:
+    CSporkValues()
+    {
+        for (int i = SPORK_START; i <= SPORK_END; ++i)
+            vValues[i - SPORK_START].store(GetSporkDefault(i), boost::memory_order_relaxed);
+    }
+
+    int64_t Get(int nSporkID) const
+    {
+        if (nSporkID < SPORK_START || nSporkID > SPORK_END)
+            return -1;
+        return vValues[nSporkID - SPORK_START].load(boost::memory_order_relaxed);
+    }
+
+    void Set(int nSporkID, int64_t nValue)
+    {
+        if (nSporkID < SPORK_START || nSporkID > SPORK_END)
+            return;
+        vValues[nSporkID - SPORK_START].store(nValue, boost::memory_order_relaxed);
+    }
+};
+
+static CSporkValues sporkValues;
+
 // Wagerr: on startup load spork values from previous session if they exist in the sporkDB
 void LoadSporksFromDB()
 {
@@ -45,6 +99,7 @@ void LoadSporksFromDB()
         // add spork to memory
         mapSporks[spork.GetHash()] = spork;
         mapSporksActive[spork.nSporkID] = spork;
+        sporkValues.Set(spork.nSporkID, spork.nValue);
         std::time_t result = spork.nValue;
         // If SPORK Value is greater than 1,000,000 assume it's actually a Date and then convert to a more readable format
         if (spork.nValue > 1000000) {
@@ -66,7 +121,8 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
         //LogPrintf("ProcessSpork::spork\n");
         CDataStream vMsg(vRecv);
         CSporkMessage spork;
-        vRecv >> spork;
+        if (!pfrom->TakeDecoded(spork))
+            vRecv >> spork;
 
         if (chainActive.Tip() == NULL) return;
 
@@ -94,6 +150,7 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 
         mapSporks[hash] = spork;
         mapSporksActive[spork.nSporkID] = spork;
+        sporkValues.Set(spork.nSporkID, spork.nValue);
         sporkManager.Relay(spork);
 
         // Wagerr: add to spork database.
@@ -113,25 +170,8 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 // grab the value of the spork on the network, or the default
 int64_t GetSporkValue(int nSporkID)
 {
-    int64_t r = -1;
-
-    if (mapSporksActive.count(nSporkID)) {
-        r = mapSporksActive[nSporkID].nValue;
-    } else {
-        if (nSporkID == SPORK_2_SWIFTTX) r = SPORK_2_SWIFTTX_DEFAULT;
-        if (nSporkID == SPORK_3_SWIFTTX_BLOCK_FILTERING) r = SPORK_3_SWIFTTX_BLOCK_FILTERING_DEFAULT;
-        if (nSporkID == SPORK_5_MAX_VALUE) r = SPORK_5_MAX_VALUE_DEFAULT;
-        if (nSporkID == SPORK_7_MASTERNODE_SCANNING) r = SPORK_7_MASTERNODE_SCANNING_DEFAULT;
-        if (nSporkID == SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT) r = SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT_DEFAULT;
-        if (nSporkID == SPORK_9_MASTERNODE_BUDGET_ENFORCEMENT) r = SPORK_9_MASTERNODE_BUDGET_ENFORCEMENT_DEFAULT;
-        if (nSporkID == SPORK_10_MASTERNODE_PAY_UPDATED_NODES) r = SPORK_10_MASTERNODE_PAY_UPDATED_NODES_DEFAULT;
-        if (nSporkID == SPORK_13_ENABLE_SUPERBLOCKS) r = SPORK_13_ENABLE_SUPERBLOCKS_DEFAULT;
-        if (nSporkID == SPORK_14_NEW_PROTOCOL_ENFORCEMENT) r = SPORK_14_NEW_PROTOCOL_ENFORCEMENT_DEFAULT;
-        if (nSporkID == SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2) r = SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2_DEFAULT;
-        if (nSporkID == SPORK_16_ZEROCOIN_MAINTENANCE_MODE) r = SPORK_16_ZEROCOIN_MAINTENANCE_MODE_DEFAULT;
-
-        if (r == -1) LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
-    }
+    int64_t r = sporkValues.Get(nSporkID);
+    if (r == -1) LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
 
     return r;
 }
@@ -176,10 +216,15 @@ void ReprocessBlocks(int nBlocks)
     }
 }
 
+std::string CSporkMessage::GetStrMessage() const
+{
+    return boost::lexical_cast<std::string>(nSporkID) + boost::lexical_cast<std::string>(nValue) + boost::lexical_cast<std::string>(nTimeSigned);
+}
+
 bool CSporkManager::CheckSignature(CSporkMessage& spork)
 {
     //note: need to investigate why this is failing
-    std::string strMessage = boost::lexical_cast<std::string>(spork.nSporkID) + boost::lexical_cast<std::string>(spork.nValue) + boost::lexical_cast<std::string>(spork.nTimeSigned);
+    std::string strMessage = spork.GetStrMessage();
     CPubKey pubkeynew(ParseHex(Params().SporkKey()));
     std::string errorMessage = "";
     if (obfuScationSigner.VerifyMessage(pubkeynew, spork.vchSig, strMessage, errorMessage)) {
@@ -191,7 +236,7 @@ bool CSporkManager::CheckSignature(CSporkMessage& spork)
 
 bool CSporkManager::Sign(CSporkMessage& spork)
 {
-    std::string strMessage = boost::lexical_cast<std::string>(spork.nSporkID) + boost::lexical_cast<std::string>(spork.nValue) + boost::lexical_cast<std::string>(spork.nTimeSigned);
+    std::string strMessage = spork.GetStrMessage();
 
     CKey key2;
     CPubKey pubkey2;
@@ -226,6 +271,7 @@ bool CSporkManager::UpdateSpork(int nSporkID, int64_t nValue)
         Relay(msg);
         mapSporks[msg.GetHash()] = msg;
         mapSporksActive[nSporkID] = msg;
+        sporkValues.Set(nSporkID, nValue);
         return true;
     }
 
@@ -89,6 +89,9 @@ public:
         return n;
     }
 
+    /// The message the spork key signs
+    std::string GetStrMessage() const;
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
@@ -283,7 +283,11 @@ public:
 
     void GetAndClear(CSerializeData& data)
     {
-        data.insert(data.end(), begin(), end());
+        // Hand the buffer over without copying it when the whole of it is unread
+        if (data.empty() && nReadPos == 0)
+            data.swap(vch);
+        else
+            data.insert(data.end(), begin(), end());
         clear();
     }
 };
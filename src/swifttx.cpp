@@ -20,14 +20,31 @@
 using namespace std;
 using namespace boost;
 
-std::map<uint256, CTransaction> mapTxLockReq;
-std::map<uint256, CTransaction> mapTxLockReqRejected;
-std::map<uint256, CConsensusVote> mapTxLockVote;
+// Lock requests whose lock is still around are kept from expiring or being pushed out
+struct KeepLockedRequest {
+    bool operator()(const std::pair<const uint256, CTransaction>& item) const
+    {
+        return mapTxLocks.count(item.first) > 0;
+    }
+};
+
+expiringmap<uint256, CTransaction> mapTxLockReq(SWIFTTX_SEEN_MAX_REQUESTS, SWIFTTX_SEEN_EXPIRY_SECONDS, KeepLockedRequest());
+expiringmap<uint256, CTransaction> mapTxLockReqRejected(SWIFTTX_SEEN_MAX_REQUESTS, SWIFTTX_SEEN_EXPIRY_SECONDS);
+expiringmap<uint256, CConsensusVote> mapTxLockVote(SWIFTTX_SEEN_MAX_VOTES, SWIFTTX_SEEN_EXPIRY_SECONDS);
 std::map<uint256, CTransactionLock> mapTxLocks;
 std::map<COutPoint, uint256> mapLockedInputs;
-std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
+expiringmap<uint256, int64_t> mapUnknownVotes(SWIFTTX_SEEN_MAX_REQUESTS, SWIFTTX_SEEN_EXPIRY_SECONDS); //track votes with no tx for DOS
 int nCompleteTXLocks;
 
+// mapTxLocks by expiration time, so CleanTransactionLocksList only visits the locks that are due. A lock
+// is scheduled again whenever its nExpiration changes; entries that no longer match are skipped.
+static std::multimap<int64_t, uint256> mapTxLockExpirations;
+
+static void ScheduleLockExpiration(const CTransactionLock& lock)
+{
+    mapTxLockExpirations.insert(make_pair((int64_t)lock.nExpiration, lock.txHash));
+}
+
 //txlock - Locks transaction
 //
 //step 1.) Broadcast intention to lock transaction inputs, "txlreg", CTransaction
@@ -49,6 +66,7 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
 
         CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
+        pfrom->AddInventoryKnown(CInv(MSG_TX, tx.GetHash()));
 
         if (mapTxLockReq.count(tx.GetHash()) || mapTxLockReqRejected.count(tx.GetHash())) {
             return;
@@ -125,7 +143,8 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
     } else if (strCommand == "txlvote") // SwiftX Lock Consensus Votes
     {
         CConsensusVote ctx;
-        vRecv >> ctx;
+        if (!pfrom->TakeDecoded(ctx))
+            vRecv >> ctx;
 
         CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
         pfrom->AddInventoryKnown(inv);
@@ -240,6 +259,7 @@ int64_t CreateNewLock(CTransaction tx)
         newLock.nTimeout = GetTime() + (60 * 5);
         newLock.txHash = tx.GetHash();
         mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
+        ScheduleLockExpiration(newLock);
     } else {
         mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
         LogPrint("swiftx", "CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
@@ -327,13 +347,15 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
         newLock.nTimeout = GetTime() + (60 * 5);
         newLock.txHash = ctx.txHash;
         mapTxLocks.insert(make_pair(ctx.txHash, newLock));
+        ScheduleLockExpiration(newLock);
     } else
         LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
 
     //compile consessus vote
     std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
     if (i != mapTxLocks.end()) {
-        (*i).second.AddSignature(ctx);
+        if (!(*i).second.AddSignature(ctx))
+            LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Masternode already voted %s\n", ctx.GetHash().ToString().c_str());
 
 #ifdef ENABLE_WALLET
         if (pwalletMain) {
@@ -348,8 +370,8 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
         if ((*i).second.CountSignatures() >= SWIFTTX_SIGNATURES_REQUIRED) {
             LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", (*i).second.GetHash().ToString().c_str());
 
-            CTransaction& tx = mapTxLockReq[ctx.txHash];
-            if (!CheckForConflictingLocks(tx)) {
+            std::map<uint256, CTransaction>::iterator itReq = mapTxLockReq.find(ctx.txHash);
+            if (itReq == mapTxLockReq.end() || !CheckForConflictingLocks(itReq->second)) {
 #ifdef ENABLE_WALLET
                 if (pwalletMain) {
                     if (pwalletMain->UpdatedTransaction((*i).second.txHash)) {
@@ -358,12 +380,9 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
                 }
 #endif
 
-                if (mapTxLockReq.count(ctx.txHash)) {
-                    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                        if (!mapLockedInputs.count(in.prevout)) {
-                            mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
-                        }
-                    }
+                if (itReq != mapTxLockReq.end()) {
+                    BOOST_FOREACH (const CTxIn& in, itReq->second.vin)
+                        mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
                 }
 
                 // resolve conflicts
@@ -382,6 +401,16 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
     return false;
 }
 
+// Make a lock expire now; CleanTransactionLocksList removes it on its next run
+static void ExpireTransactionLock(const uint256& txHash)
+{
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if (it == mapTxLocks.end())
+        return;
+    it->second.nExpiration = GetTime();
+    ScheduleLockExpiration(it->second);
+}
+
 bool CheckForConflictingLocks(CTransaction& tx)
 {
     /*
@@ -391,14 +420,14 @@ bool CheckForConflictingLocks(CTransaction& tx)
         Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
+    uint256 txHash = tx.GetHash();
     BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if (mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if (mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                return true;
-            }
+        std::map<COutPoint, uint256>::const_iterator itLocked = mapLockedInputs.find(in.prevout);
+        if (itLocked != mapLockedInputs.end() && itLocked->second != txHash) {
+            LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", txHash.ToString().c_str(), itLocked->second.ToString().c_str());
+            ExpireTransactionLock(txHash);
+            ExpireTransactionLock(itLocked->second);
+            return true;
         }
     }
 
@@ -424,30 +453,39 @@ void CleanTransactionLocksList()
 {
     if (chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
+    int64_t nNow = GetTime();
+    std::multimap<int64_t, uint256>::iterator itExpiration = mapTxLockExpirations.begin();
+    while (itExpiration != mapTxLockExpirations.end() && itExpiration->first < nNow) {
+        std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(itExpiration->second);
+        mapTxLockExpirations.erase(itExpiration++);
 
-    while (it != mapTxLocks.end()) {
-        if (GetTime() > it->second.nExpiration) { //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+        // the lock is gone already, or was scheduled again since
+        if (it == mapTxLocks.end() || nNow <= it->second.nExpiration)
+            continue;
 
-            if (mapTxLockReq.count(it->second.txHash)) {
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
+        //keep them for an hour
+        LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
 
-                BOOST_FOREACH (const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
+        std::map<uint256, CTransaction>::iterator itReq = mapTxLockReq.find(it->second.txHash);
+        if (itReq != mapTxLockReq.end()) {
+            BOOST_FOREACH (const CTxIn& in, itReq->second.vin)
+                mapLockedInputs.erase(in.prevout);
 
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
+            mapTxLockReq.erase(itReq);
+            mapTxLockReqRejected.erase(it->second.txHash);
 
-                BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
-            }
-
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+            for (std::map<COutPoint, CConsensusVote>::iterator itVote = it->second.mapConsensusVotes.begin(); itVote != it->second.mapConsensusVotes.end(); ++itVote)
+                mapTxLockVote.erase(itVote->second.GetHash());
         }
+
+        mapTxLocks.erase(it);
     }
+
+    // Requests of live locks are kept, everything else is forgotten SWIFTTX_SEEN_EXPIRY_SECONDS after it arrived
+    mapTxLockReq.expire();
+    mapTxLockReqRejected.expire();
+    mapTxLockVote.expire();
+    mapUnknownVotes.expire();
 }
 
 uint256 CConsensusVote::GetHash() const
@@ -456,10 +494,15 @@ uint256 CConsensusVote::GetHash() const
 }
 
 
+std::string CConsensusVote::GetStrMessage() const
+{
+    return txHash.ToString() + boost::lexical_cast<std::string>(nBlockHeight);
+}
+
 bool CConsensusVote::SignatureValid()
 {
     std::string errorMessage;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetStrMessage();
     //LogPrintf("verify strMessage %s \n", strMessage.c_str());
 
     CMasternode* pmn = mnodeman.Find(vinMasternode);
@@ -483,7 +526,7 @@ bool CConsensusVote::Sign()
 
     CKey key2;
     CPubKey pubkey2;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetStrMessage();
     //LogPrintf("signing strMessage %s \n", strMessage.c_str());
     //LogPrintf("signing privkey %s \n", strMasterNodePrivKey.c_str());
 
@@ -508,7 +551,8 @@ bool CConsensusVote::Sign()
 
 bool CTransactionLock::SignaturesValid()
 {
-    BOOST_FOREACH (CConsensusVote vote, vecConsensusVotes) {
+    for (std::map<COutPoint, CConsensusVote>::iterator it = mapConsensusVotes.begin(); it != mapConsensusVotes.end(); ++it) {
+        CConsensusVote& vote = it->second;
         int n = mnodeman.GetMasternodeRank(vote.vinMasternode, vote.nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
 
         if (n == -1) {
@@ -530,9 +574,18 @@ bool CTransactionLock::SignaturesValid()
     return true;
 }
 
-void CTransactionLock::AddSignature(CConsensusVote& cv)
+bool CTransactionLock::AddSignature(CConsensusVote& cv)
 {
-    vecConsensusVotes.push_back(cv);
+    std::map<COutPoint, CConsensusVote>::iterator it = mapConsensusVotes.find(cv.vinMasternode.prevout);
+    if (it != mapConsensusVotes.end()) {
+        if (it->second.nBlockHeight == cv.nBlockHeight && it->second.vchMasterNodeSignature == cv.vchMasterNodeSignature)
+            return false;
+        mapVotesAtHeight[it->second.nBlockHeight]--;
+        it->second = cv;
+    } else
+        mapConsensusVotes.insert(make_pair(cv.vinMasternode.prevout, cv));
+    mapVotesAtHeight[cv.nBlockHeight]++;
+    return true;
 }
 
 int CTransactionLock::CountSignatures()
@@ -544,11 +597,6 @@ int CTransactionLock::CountSignatures()
 
     if (nBlockHeight == 0) return -1;
 
-    int n = 0;
-    BOOST_FOREACH (CConsensusVote v, vecConsensusVotes) {
-        if (v.nBlockHeight == nBlockHeight) {
-            n++;
-        }
-    }
-    return n;
+    std::map<int, int>::const_iterator it = mapVotesAtHeight.find(nBlockHeight);
+    return it != mapVotesAtHeight.end() ? it->second : 0;
 }
@@ -8,6 +8,7 @@
 #define SWIFTTX_H
 
 #include "base58.h"
+#include "expiringmap.h"
 #include "key.h"
 #include "main.h"
 #include "net.h"
@@ -26,6 +27,9 @@
 */
 #define SWIFTTX_SIGNATURES_REQUIRED 6
 #define SWIFTTX_SIGNATURES_TOTAL 10
+#define SWIFTTX_SEEN_EXPIRY_SECONDS (2 * 60 * 60) // lock requests and votes are forgotten after this, locks last an hour
+#define SWIFTTX_SEEN_MAX_REQUESTS 10000
+#define SWIFTTX_SEEN_MAX_VOTES (SWIFTTX_SEEN_MAX_REQUESTS * SWIFTTX_SIGNATURES_TOTAL)
 
 using namespace std;
 using namespace boost;
@@ -36,9 +40,9 @@ class CTransactionLock;
 
 static const int MIN_SWIFTTX_PROTO_VERSION = 70103;
 
-extern map<uint256, CTransaction> mapTxLockReq;
-extern map<uint256, CTransaction> mapTxLockReqRejected;
-extern map<uint256, CConsensusVote> mapTxLockVote;
+extern expiringmap<uint256, CTransaction> mapTxLockReq;
+extern expiringmap<uint256, CTransaction> mapTxLockReqRejected;
+extern expiringmap<uint256, CConsensusVote> mapTxLockVote;
 extern map<uint256, CTransactionLock> mapTxLocks;
 extern std::map<COutPoint, uint256> mapLockedInputs;
 extern int nCompleteTXLocks;
@@ -76,6 +80,8 @@ public:
 
     bool SignatureValid();
     bool Sign();
+    /// The message the masternode key signs
+    std::string GetStrMessage() const;
 
     ADD_SERIALIZE_METHODS;
 
@@ -91,16 +97,22 @@ public:
 
 class CTransactionLock
 {
+private:
+    // how many of the votes are for each block height, so the votes at nBlockHeight are counted in O(1)
+    std::map<int, int> mapVotesAtHeight;
+
 public:
     int nBlockHeight;
     uint256 txHash;
-    std::vector<CConsensusVote> vecConsensusVotes;
+    // one vote per masternode, by its collateral
+    std::map<COutPoint, CConsensusVote> mapConsensusVotes;
     int nExpiration;
     int nTimeout;
 
     bool SignaturesValid();
     int CountSignatures();
-    void AddSignature(CConsensusVote& cv);
+    /// Add or replace the vote of a masternode; false if it already cast this one
+    bool AddSignature(CConsensusVote& cv);
 
     uint256 GetHash()
     {
@@ -0,0 +1,113 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Micro-benchmark of CWallet::SelectCoinsMinConf over synthetic wallets holding
+// thousands of outputs. The outputs and targets are generated from a fixed seed,
+// so runs are comparable. Run test_wagerr with --run_test=benchmark_coinselection
+// --log_level=message to see the timings.
+
+#include "utiltime.h"
+#include "wallet.h"
+
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(benchmark_coinselection)
+
+static const unsigned int BENCH_SELECTIONS = 50;
+
+static CWallet wallet;
+static std::vector<COutput> vCoins;
+static uint64_t nBenchSeed;
+
+// Deterministic value in [nMin, nMax)
+static CAmount BenchValue(CAmount nMin, CAmount nMax)
+{
+    nBenchSeed = nBenchSeed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return nMin + (CAmount)((nBenchSeed >> 1) % (uint64_t)(nMax - nMin));
+}
+
+static void add_coin(const CAmount& nValue)
+{
+    static int nextLockTime = 0;
+    CMutableTransaction tx;
+    tx.nLockTime = nextLockTime++; // so all transactions get different hashes
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    CWalletTx* wtx = new CWalletTx(&wallet, tx);
+    vCoins.push_back(COutput(wtx, 0, 6 * 24, true));
+}
+
+static void empty_wallet()
+{
+    BOOST_FOREACH (COutput output, vCoins)
+        delete output.tx;
+    vCoins.clear();
+}
+
+static void BenchSelection(const std::string& strName, CAmount nTargetMin, CAmount nTargetMax)
+{
+    std::set<std::pair<const CWalletTx*, unsigned int> > setCoinsRet;
+    CAmount nValueRet;
+    CAmount nCostOfChange = CWallet::minTxFee.GetFee(34 + 148);
+    unsigned int nChangeless = 0;
+    size_t nInputs = 0;
+
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < BENCH_SELECTIONS; i++) {
+        CAmount nTarget = BenchValue(nTargetMin, nTargetMax);
+        BOOST_CHECK(wallet.SelectCoinsMinConf(nTarget, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(nValueRet >= nTarget);
+        if (nValueRet - nTarget <= nCostOfChange)
+            nChangeless++;
+        nInputs += setCoinsRet.size();
+    }
+    int64_t nTime = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strName << " (" << vCoins.size() << " outputs): " << nTime / BENCH_SELECTIONS << "us per selection, "
+                               << nChangeless << "/" << BENCH_SELECTIONS << " without change, "
+                               << (double)nInputs / BENCH_SELECTIONS << " inputs on average");
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_coinselection_staking)
+{
+    LOCK(wallet.cs_wallet);
+    nBenchSeed = 42;
+
+    // a staking wallet: thousands of similar rewards and a few larger receipts
+    empty_wallet();
+    for (int i = 0; i < 5000; i++)
+        add_coin(BenchValue(2 * COIN, 8 * COIN));
+    for (int i = 0; i < 50; i++)
+        add_coin(BenchValue(100 * COIN, 1000 * COIN));
+
+    BenchSelection("staking rewards, small sends", 1 * COIN, 10 * COIN);
+    BenchSelection("staking rewards, large sends", 50 * COIN, 500 * COIN);
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_coinselection_mixed)
+{
+    LOCK(wallet.cs_wallet);
+    nBenchSeed = 4242;
+
+    // masternode payouts, round amounts and sub-coin change
+    empty_wallet();
+    for (int i = 0; i < 2000; i++)
+        add_coin(BenchValue(9 * COIN, 11 * COIN));
+    for (int i = 0; i < 500; i++)
+        add_coin(BenchValue(1, 20) * COIN);
+    for (int i = 0; i < 2000; i++)
+        add_coin(BenchValue(CENT, COIN));
+
+    BenchSelection("mixed outputs, small sends", CENT, 5 * COIN);
+    BenchSelection("mixed outputs, large sends", 100 * COIN, 1000 * COIN);
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,66 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Micro-benchmark of the per-peer known-inventory tracking: the rolling bloom
+// filter CNode uses now against the mruset it replaced. Run test_wagerr with
+// --run_test=benchmark_rollingbloom --log_level=message to see the timings.
+
+#include "bloom.h"
+#include "mruset.h"
+#include "protocol.h"
+#include "random.h"
+#include "utiltime.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(benchmark_rollingbloom)
+
+static const unsigned int BENCH_ELEMENTS = 10000;
+static const unsigned int BENCH_ROUNDS = 100000;
+
+BOOST_AUTO_TEST_CASE(benchmark_inventory_known)
+{
+    std::vector<CInv> vInv;
+    vInv.reserve(BENCH_ROUNDS);
+    for (unsigned int i = 0; i < BENCH_ROUNDS; i++)
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+
+    // The relay pattern: every inv is looked up, then remembered, and a fraction
+    // of lookups are for an inv seen just before.
+    mruset<CInv> setKnown(BENCH_ELEMENTS);
+    unsigned int nHitsSet = 0;
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < BENCH_ROUNDS; i++) {
+        if (setKnown.count(vInv[i]))
+            nHitsSet++;
+        setKnown.insert(vInv[i]);
+        if (setKnown.count(vInv[i / 2]))
+            nHitsSet++;
+    }
+    int64_t nTimeSet = GetTimeMicros() - nStart;
+
+    CRollingBloomFilter filterKnown(BENCH_ELEMENTS, 0.000001);
+    unsigned int nHitsFilter = 0;
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < BENCH_ROUNDS; i++) {
+        if (filterKnown.contains(vInv[i].GetKey()))
+            nHitsFilter++;
+        filterKnown.insert(vInv[i].GetKey());
+        if (filterKnown.contains(vInv[i / 2].GetKey()))
+            nHitsFilter++;
+    }
+    int64_t nTimeFilter = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE("mruset<CInv>(" << BENCH_ELEMENTS << "): " << nTimeSet << "us for " << BENCH_ROUNDS << " rounds, "
+                                       << nHitsSet << " hits, ~" << setKnown.size() * (sizeof(CInv) * 2 + 32) << " bytes");
+    BOOST_TEST_MESSAGE("CRollingBloomFilter(" << BENCH_ELEMENTS << ", 0.000001): " << nTimeFilter << "us for " << BENCH_ROUNDS << " rounds, "
+                                              << nHitsFilter << " hits");
+
+    // The filter remembers at least everything the mruset does (and up to half as much again)
+    BOOST_CHECK(nHitsFilter >= nHitsSet);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
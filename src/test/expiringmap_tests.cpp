@@ -0,0 +1,146 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "expiringmap.h"
+
+#include "random.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#define MAX_SIZE 100
+#define MAX_AGE 60
+
+struct keep_even {
+    bool operator()(const std::pair<const int, int>& item) const { return item.first % 2 == 0; }
+};
+
+BOOST_AUTO_TEST_SUITE(expiringmap_tests)
+
+// Test that an expiringmap behaves like a map, as long as no more than MAX_SIZE elements are in it
+BOOST_AUTO_TEST_CASE(expiringmap_like_map)
+{
+    expiringmap<int, int> map(MAX_SIZE);
+    std::map<int, int> mapRef;
+    for (int nAction = 0; nAction < 10 * MAX_SIZE; nAction++) {
+        int n = GetRandInt(MAX_SIZE);
+        if (GetRandInt(3) == 0) {
+            BOOST_CHECK_EQUAL(map.erase(n), mapRef.erase(n));
+        } else {
+            BOOST_CHECK_EQUAL(map.insert(std::make_pair(n, nAction)).second, mapRef.insert(std::make_pair(n, nAction)).second);
+        }
+        BOOST_CHECK(map.size() == mapRef.size());
+        BOOST_CHECK(std::equal(map.begin(), map.end(), mapRef.begin()));
+    }
+}
+
+// Test that the oldest entries are dropped beyond max_size
+BOOST_AUTO_TEST_CASE(expiringmap_limited_size)
+{
+    expiringmap<int, int> map(MAX_SIZE);
+    for (int n = 0; n < 3 * MAX_SIZE; n++) {
+        map.insert(std::make_pair(n, n));
+        BOOST_CHECK(map.size() <= MAX_SIZE);
+    }
+    BOOST_CHECK_EQUAL(map.size(), MAX_SIZE);
+    BOOST_CHECK(!map.count(2 * MAX_SIZE - 1));
+    BOOST_CHECK(map.count(2 * MAX_SIZE));
+    BOOST_CHECK(map.count(3 * MAX_SIZE - 1));
+}
+
+// Test that the entries held on to by the map's keep function are not dropped beyond max_size
+BOOST_AUTO_TEST_CASE(expiringmap_limited_size_keep)
+{
+    expiringmap<int, int> map(MAX_SIZE, 0, keep_even());
+    for (int n = 0; n < 3 * MAX_SIZE; n++) {
+        map.insert(std::make_pair(2 * n, n));
+        map.insert(std::make_pair(2 * n + 1, n));
+    }
+    // every even key is kept, the odd ones only as long as there is room
+    BOOST_CHECK_EQUAL(map.size(), 3 * MAX_SIZE + 1);
+    for (int n = 0; n < 3 * MAX_SIZE; n++)
+        BOOST_CHECK(map.count(2 * n));
+    BOOST_CHECK(!map.count(6 * MAX_SIZE - 3));
+    BOOST_CHECK(map.count(6 * MAX_SIZE - 1));
+
+    // the keep function applies to expiry as well
+    expiringmap<int, int> mapAged(0, MAX_AGE, keep_even());
+    SetMockTime(1000000);
+    for (int n = 0; n < 10; n++)
+        mapAged.insert(std::make_pair(n, n));
+    SetMockTime(1000000 + MAX_AGE);
+    BOOST_CHECK_EQUAL(mapAged.expire(), 5);
+    BOOST_CHECK(mapAged.count(4) && !mapAged.count(3));
+    SetMockTime(0);
+}
+
+// Test that entries expire max_age seconds after they were inserted, unless kept
+BOOST_AUTO_TEST_CASE(expiringmap_expiry)
+{
+    SetMockTime(1000000);
+    expiringmap<int, int> map(0, MAX_AGE);
+    for (int n = 0; n < 10; n++)
+        map.insert(std::make_pair(n, n));
+    SetMockTime(1000000 + MAX_AGE / 2);
+    for (int n = 10; n < 20; n++)
+        map.insert(std::make_pair(n, n));
+    map.erase(5);
+    map.erase(15);
+
+    BOOST_CHECK_EQUAL(map.expire(), 0);
+    SetMockTime(1000000 + MAX_AGE);
+    BOOST_CHECK_EQUAL(map.expire(keep_even()), 4);
+    BOOST_CHECK_EQUAL(map.size(), 14);
+    BOOST_CHECK(map.count(4) && !map.count(3));
+
+    // the kept entries start over, the second batch is due now
+    SetMockTime(1000000 + MAX_AGE + MAX_AGE / 2);
+    BOOST_CHECK_EQUAL(map.expire(), 9);
+    BOOST_CHECK_EQUAL(map.size(), 5);
+    SetMockTime(1000000 + 2 * MAX_AGE);
+    BOOST_CHECK_EQUAL(map.expire(), 5);
+    BOOST_CHECK(map.empty());
+    SetMockTime(0);
+}
+
+// Test that entries can be found by their parent, and leave the index when erased or expired
+BOOST_AUTO_TEST_CASE(expiringmap_parent)
+{
+    expiringmap<int, int> map(MAX_SIZE);
+    for (int n = 0; n < 2 * MAX_SIZE; n++)
+        map.insert(std::make_pair(n, n), n % 10);
+    map.erase(MAX_SIZE + 7);
+
+    std::vector<int> vKeys;
+    map.find_by_parent(7, vKeys);
+    std::sort(vKeys.begin(), vKeys.end());
+    BOOST_CHECK_EQUAL(vKeys.size(), MAX_SIZE / 10 - 1);
+    for (unsigned int i = 0; i < vKeys.size(); i++) {
+        BOOST_CHECK_EQUAL(vKeys[i] % 10, 7);
+        BOOST_CHECK(map.count(vKeys[i]));
+    }
+
+    vKeys.clear();
+    map.find_by_parent(10, vKeys);
+    BOOST_CHECK(vKeys.empty());
+
+    // a copy has its own parent index
+    expiringmap<int, int> mapCopy(map);
+    map.clear();
+    vKeys.clear();
+    mapCopy.find_by_parent(7, vKeys);
+    BOOST_CHECK_EQUAL(vKeys.size(), MAX_SIZE / 10 - 1);
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+        mapCopy.erase(vKeys[i]);
+    vKeys.clear();
+    mapCopy.find_by_parent(7, vKeys);
+    BOOST_CHECK(vKeys.empty());
+    BOOST_CHECK_EQUAL(mapCopy.size(), MAX_SIZE - MAX_SIZE / 10);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
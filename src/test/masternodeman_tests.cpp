@@ -0,0 +1,69 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "key.h"
+#include "masternodeman.h"
+#include "script/standard.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(masternodeman_tests)
+
+static CMasternode MakeMasternode(const CPubKey& pubKeyCollateral, const CPubKey& pubKeyMasternode, unsigned char chHash, uint32_t n)
+{
+    CMasternode mn;
+    uint256 hash;
+    *hash.begin() = chHash;
+    mn.vin = CTxIn(COutPoint(hash, n));
+    mn.pubKeyCollateralAddress = pubKeyCollateral;
+    mn.pubKeyMasternode = pubKeyMasternode;
+    return mn;
+}
+
+BOOST_AUTO_TEST_CASE(masternodeman_find_shared_payee)
+{
+    CKey keyCollateral, keyMasternode, keyOther;
+    keyCollateral.MakeNewKey(true);
+    keyMasternode.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    CScript payee = GetScriptForDestination(keyCollateral.GetPubKey().GetID());
+
+    // the lowest collateral is added neither first nor last
+    CMasternode mnHigh = MakeMasternode(keyCollateral.GetPubKey(), keyMasternode.GetPubKey(), 3, 0);
+    CMasternode mnLow = MakeMasternode(keyCollateral.GetPubKey(), keyMasternode.GetPubKey(), 1, 1);
+    CMasternode mnMid = MakeMasternode(keyCollateral.GetPubKey(), keyMasternode.GetPubKey(), 2, 0);
+    CMasternode mnOther = MakeMasternode(keyOther.GetPubKey(), keyOther.GetPubKey(), 0, 0);
+
+    CMasternodeMan man;
+    BOOST_CHECK(man.Add(mnHigh));
+    BOOST_CHECK(man.Add(mnLow));
+    BOOST_CHECK(man.Add(mnMid));
+    BOOST_CHECK(man.Add(mnOther));
+
+    CMasternode* pmn = man.Find(payee);
+    BOOST_REQUIRE(pmn != NULL);
+    BOOST_CHECK(pmn->vin == mnLow.vin);
+    pmn = man.Find(keyMasternode.GetPubKey());
+    BOOST_REQUIRE(pmn != NULL);
+    BOOST_CHECK(pmn->vin == mnLow.vin);
+
+    // the choice does not depend on the order the index was filled in
+    man.RebuildIndexes();
+    pmn = man.Find(payee);
+    BOOST_REQUIRE(pmn != NULL);
+    BOOST_CHECK(pmn->vin == mnLow.vin);
+
+    // once the lowest one moves to another payee, the next lowest is found
+    pmn->pubKeyCollateralAddress = keyOther.GetPubKey();
+    man.UpdateIndexes(*pmn);
+    pmn = man.Find(payee);
+    BOOST_REQUIRE(pmn != NULL);
+    BOOST_CHECK(pmn->vin == mnMid.vin);
+
+    pmn = man.Find(GetScriptForDestination(keyOther.GetPubKey().GetID()));
+    BOOST_REQUIRE(pmn != NULL);
+    BOOST_CHECK(pmn->vin == mnOther.vin);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -277,6 +277,40 @@ BOOST_AUTO_TEST_CASE(multisig_Solver1)
     }
 }
 
+#ifdef ENABLE_WALLET
+BOOST_AUTO_TEST_CASE(multisig_IsMine_templates)
+{
+    // IsMine() rules out outputs by their template id, which must still find
+    // every pay to script hash and watch-only output that is ours
+    CBasicKeyStore keystore;
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+        key[i].MakeNewKey(i != 2);
+    keystore.AddKey(key[0]);
+
+    CScript redeem;
+    redeem << OP_1 << ToByteVector(key[0].GetPubKey()) << ToByteVector(key[1].GetPubKey()) << OP_2 << OP_CHECKMULTISIG;
+    CScript p2sh = GetScriptForDestination(CScriptID(redeem));
+    BOOST_CHECK(!IsMine(keystore, p2sh));
+    keystore.AddCScript(redeem);
+    BOOST_CHECK(IsMine(keystore, p2sh) == ISMINE_SPENDABLE);
+
+    CScript watched = GetScriptForDestination(key[1].GetPubKey().GetID());
+    BOOST_CHECK(!IsMine(keystore, watched));
+    keystore.AddWatchOnly(watched);
+    BOOST_CHECK(IsMine(keystore, watched) == ISMINE_WATCH_ONLY);
+    keystore.RemoveWatchOnly(watched);
+    BOOST_CHECK(!IsMine(keystore, watched));
+
+    // uncompressed pay to pubkey
+    CScript p2pk;
+    p2pk << ToByteVector(key[2].GetPubKey()) << OP_CHECKSIG;
+    BOOST_CHECK(!IsMine(keystore, p2pk));
+    keystore.AddKey(key[2]);
+    BOOST_CHECK(IsMine(keystore, p2pk) == ISMINE_SPENDABLE);
+}
+#endif
+
 BOOST_AUTO_TEST_CASE(multisig_Sign)
 {
     // Test SignSignature() (and therefore the version of Solver() that signs transactions)
@@ -0,0 +1,94 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "snapshot.h"
+#include "clientversion.h"
+#include "random.h"
+#include "uint256.h"
+#include "version.h"
+
+#include <cstdio>
+#include <map>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(snapshot_tests)
+
+BOOST_AUTO_TEST_CASE(snapshot_roundtrip)
+{
+    // enough records for several chunks
+    std::map<uint256, std::string> mapItems;
+    for (unsigned int i = 0; i < SNAPSHOT_CHUNK_RECORDS * 2 + 7; i++)
+        mapItems[GetRandHash()] = std::string(i % 50, 'x');
+    std::map<int, int> mapSmall;
+    mapSmall[1] = 2;
+
+    FILE* file = tmpfile();
+    BOOST_REQUIRE(file != NULL);
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    uint256 hashWritten;
+    {
+        CSnapshotWriter s(&fileout);
+        s << MASTERNODE_SNAPSHOT_VERSION;
+        WriteSnapshotMap(s, mapItems);
+        WriteSnapshotMap(s, std::map<int, int>());
+        WriteSnapshotMap(s, mapSmall);
+        hashWritten = s.GetHash();
+    }
+    fileout << hashWritten;
+
+    // read everything back
+    rewind(fileout.Get());
+    {
+        CSnapshotReader s(&fileout);
+        int nVersion;
+        s >> nVersion;
+        BOOST_CHECK_EQUAL(nVersion, MASTERNODE_SNAPSHOT_VERSION);
+        std::map<uint256, std::string> mapItemsRead;
+        ReadSnapshotMap(s, mapItemsRead);
+        BOOST_CHECK(mapItemsRead == mapItems);
+        std::map<int, int> mapEmpty, mapSmallRead;
+        ReadSnapshotMap(s, mapEmpty);
+        BOOST_CHECK(mapEmpty.empty());
+        ReadSnapshotMap(s, mapSmallRead);
+        BOOST_CHECK(mapSmallRead == mapSmall);
+        BOOST_CHECK(s.GetHash() == hashWritten);
+    }
+
+    // stepping over sections still covers them with the checksum
+    rewind(fileout.Get());
+    {
+        CSnapshotReader s(&fileout);
+        int nVersion;
+        s >> nVersion;
+        CSnapshotChunkReader(s).Skip();
+        CSnapshotChunkReader(s).Skip();
+        std::map<int, int> mapSmallRead;
+        ReadSnapshotMap(s, mapSmallRead);
+        BOOST_CHECK(mapSmallRead == mapSmall);
+        BOOST_CHECK(s.GetHash() == hashWritten);
+        uint256 hashIn;
+        fileout >> hashIn;
+        BOOST_CHECK(hashIn == hashWritten);
+    }
+
+    // the whole file is checked up front, and left at its start
+    BOOST_CHECK(VerifySnapshotChecksum(fileout));
+    {
+        CSnapshotReader s(&fileout);
+        int nVersion;
+        s >> nVersion;
+        BOOST_CHECK_EQUAL(nVersion, MASTERNODE_SNAPSHOT_VERSION);
+    }
+
+    // flip a byte of the data
+    BOOST_REQUIRE(fseek(fileout.Get(), 100, SEEK_SET) == 0);
+    int ch = fgetc(fileout.Get());
+    BOOST_REQUIRE(ch != EOF && fseek(fileout.Get(), 100, SEEK_SET) == 0);
+    fputc(ch ^ 1, fileout.Get());
+    BOOST_CHECK(!VerifySnapshotChecksum(fileout));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
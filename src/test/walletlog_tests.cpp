@@ -0,0 +1,159 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletlog.h"
+
+#include "util.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+static std::vector<unsigned char> Bytes(const std::string& str)
+{
+    return std::vector<unsigned char>(str.begin(), str.end());
+}
+
+static std::string ReadString(const CWalletLog& log, const std::string& strKey)
+{
+    std::vector<unsigned char> vchValue;
+    if (!log.Read(Bytes(strKey), vchValue))
+        return "";
+    return std::string(vchValue.begin(), vchValue.end());
+}
+
+static std::vector<CWalletLogRecord> WriteRecord(const std::string& strKey, const std::string& strValue)
+{
+    return std::vector<CWalletLogRecord>(1, CWalletLogRecord(Bytes(strKey), Bytes(strValue)));
+}
+
+BOOST_AUTO_TEST_SUITE(walletlog_tests)
+
+// Test that the records written to a log are read back after reopening it
+BOOST_AUTO_TEST_CASE(walletlog_replay)
+{
+    boost::filesystem::path path = GetDataDir() / "walletlog_replay.log";
+    {
+        CWalletLog log;
+        BOOST_CHECK(!log.Open(path, false));
+        BOOST_CHECK(log.Open(path, true));
+        BOOST_CHECK(log.Write(WriteRecord("a", "1")));
+        BOOST_CHECK(log.Write(WriteRecord("b", "2")));
+        BOOST_CHECK(log.Write(WriteRecord("a", "3")));
+        BOOST_CHECK(log.Write(std::vector<CWalletLogRecord>(1, CWalletLogRecord(Bytes("b")))));
+
+        std::vector<CWalletLogRecord> vBatch = WriteRecord("c", "4");
+        vBatch.push_back(CWalletLogRecord(Bytes("d"), Bytes("5")));
+        BOOST_CHECK(log.Write(vBatch));
+        BOOST_CHECK_EQUAL(ReadString(log, "a"), "3");
+        BOOST_CHECK(!log.Exists(Bytes("b")));
+    }
+
+    CWalletLog log;
+    BOOST_CHECK(log.Open(path, false));
+    BOOST_CHECK_EQUAL(log.GetCount(), 3U);
+    BOOST_CHECK_EQUAL(ReadString(log, "a"), "3");
+    BOOST_CHECK(!log.Exists(Bytes("b")));
+    BOOST_CHECK_EQUAL(ReadString(log, "d"), "5");
+
+    // records come out ordered by key
+    std::vector<unsigned char> vchKey, vchValue;
+    BOOST_CHECK(log.Seek(Bytes("b"), false, vchKey, vchValue));
+    BOOST_CHECK(vchKey == Bytes("c"));
+    BOOST_CHECK(log.Seek(vchKey, true, vchKey, vchValue));
+    BOOST_CHECK(vchKey == Bytes("d"));
+    BOOST_CHECK(!log.Seek(vchKey, true, vchKey, vchValue));
+}
+
+// Test that a batch cut off at the end of the log is dropped as a whole
+BOOST_AUTO_TEST_CASE(walletlog_torn_batch)
+{
+    boost::filesystem::path path = GetDataDir() / "walletlog_torn.log";
+    uintmax_t nSizeBefore;
+    {
+        CWalletLog log;
+        BOOST_CHECK(log.Open(path, true));
+        BOOST_CHECK(log.Write(WriteRecord("a", "1")));
+        log.Flush();
+        nSizeBefore = boost::filesystem::file_size(path);
+
+        std::vector<CWalletLogRecord> vBatch = WriteRecord("a", "2");
+        vBatch.push_back(CWalletLogRecord(Bytes("b"), Bytes("3")));
+        BOOST_CHECK(log.Write(vBatch));
+    }
+    // lose the last byte of the batch, as if the process died while appending it
+    boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 1);
+
+    CWalletLog log;
+    BOOST_CHECK(log.Open(path, false));
+    BOOST_CHECK_EQUAL(ReadString(log, "a"), "1");
+    BOOST_CHECK(!log.Exists(Bytes("b")));
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nSizeBefore);
+
+    // appends continue after the last complete batch
+    BOOST_CHECK(log.Write(WriteRecord("b", "4")));
+    log.Close();
+    BOOST_CHECK(log.Open(path, false));
+    BOOST_CHECK_EQUAL(ReadString(log, "b"), "4");
+}
+
+// Test that a damaged record followed by intact ones is not cut off, and the log is refused
+BOOST_AUTO_TEST_CASE(walletlog_corrupt_record)
+{
+    boost::filesystem::path path = GetDataDir() / "walletlog_corrupt.log";
+    uintmax_t nSizeMiddle;
+    {
+        CWalletLog log;
+        BOOST_CHECK(log.Open(path, true));
+        BOOST_CHECK(log.Write(WriteRecord("a", "1")));
+        log.Flush();
+        nSizeMiddle = boost::filesystem::file_size(path);
+        BOOST_CHECK(log.Write(WriteRecord("b", "2")));
+        BOOST_CHECK(log.Write(WriteRecord("c", "3")));
+    }
+    uintmax_t nSize = boost::filesystem::file_size(path);
+
+    // flip a byte in the value of "b"
+    FILE* file = fopen(path.string().c_str(), "rb+");
+    BOOST_REQUIRE(file);
+    BOOST_CHECK(fseek(file, nSizeMiddle + 4, SEEK_SET) == 0);
+    fputc('x', file);
+    fclose(file);
+
+    CWalletLog log;
+    BOOST_CHECK(!log.Open(path, false));
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nSize);
+}
+
+// Test that compaction keeps the live records, leaves out skipped keys and shrinks the log
+BOOST_AUTO_TEST_CASE(walletlog_compact)
+{
+    boost::filesystem::path path = GetDataDir() / "walletlog_compact.log";
+    CWalletLog log;
+    BOOST_CHECK(log.Open(path, true));
+    std::string strValue(1000, 'x');
+    for (int i = 0; i < 3000; i++)
+        BOOST_CHECK(log.Write(WriteRecord(strprintf("key%d", i % 100), strValue)));
+    BOOST_CHECK(log.Write(WriteRecord("skip1", "1")));
+    BOOST_CHECK(log.NeedsCompaction());
+
+    uintmax_t nSizeBefore = boost::filesystem::file_size(path);
+    BOOST_CHECK(log.Compact("skip"));
+    BOOST_CHECK(boost::filesystem::file_size(path) < nSizeBefore / 10);
+    BOOST_CHECK(!log.NeedsCompaction());
+    BOOST_CHECK_EQUAL(log.GetCount(), 100U);
+    BOOST_CHECK(!log.Exists(Bytes("skip1")));
+
+    BOOST_CHECK(log.Write(WriteRecord("key0", "new")));
+    log.Close();
+    BOOST_CHECK(log.Open(path, false));
+    BOOST_CHECK_EQUAL(log.GetCount(), 100U);
+    BOOST_CHECK_EQUAL(ReadString(log, "key0"), "new");
+    BOOST_CHECK_EQUAL(ReadString(log, "key99"), strValue);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,145 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "main.h"
+#include "primitives/zerocoin.h"
+#include "zerocointracker.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(zerocointracker_tests)
+
+static CZerocoinMint MakeMint(libzerocoin::CoinDenomination denom, int nValue, int nHeight)
+{
+    CZerocoinMint mint(denom, CBigNum(nValue), CBigNum(nValue + 1), CBigNum(nValue + 2), false);
+    mint.SetHeight(nHeight);
+    return mint;
+}
+
+BOOST_AUTO_TEST_CASE(zerocointracker_spend_unspend)
+{
+    CZerocoinTracker tracker; // no wallet file, memory only
+    CZerocoinMint mintOne = MakeMint(libzerocoin::ZQ_ONE, 1000, 1);
+    CZerocoinMint mintFive = MakeMint(libzerocoin::ZQ_FIVE, 2000, 1);
+
+    BOOST_CHECK(tracker.Write(mintOne));
+    BOOST_CHECK(tracker.Write(mintFive));
+    BOOST_CHECK(tracker.HasUnusedSerial(mintOne.GetSerialNumber()));
+    BOOST_CHECK(tracker.HasUnusedSerial(mintFive.GetSerialNumber()));
+
+    std::map<libzerocoin::CoinDenomination, int> mapCounts = tracker.GetDenominationCounts(false);
+    BOOST_CHECK_EQUAL(mapCounts[libzerocoin::ZQ_ONE], 1);
+    BOOST_CHECK_EQUAL(mapCounts[libzerocoin::ZQ_FIVE], 1);
+    BOOST_CHECK_EQUAL(mapCounts[libzerocoin::ZQ_TEN], 0);
+    BOOST_CHECK_EQUAL(tracker.GetBalance(false), 6 * COIN);
+
+    // writing the same mint again does not count it twice
+    BOOST_CHECK(tracker.Write(mintOne));
+    BOOST_CHECK_EQUAL(tracker.GetDenominationCounts(false)[libzerocoin::ZQ_ONE], 1);
+    BOOST_CHECK_EQUAL(tracker.GetBalance(false), 6 * COIN);
+
+    // spending the serial uses the mint
+    CZerocoinSpend spend(mintOne.GetSerialNumber(), 0, mintOne.GetValue(), mintOne.GetDenomination(), 0);
+    BOOST_CHECK(tracker.WriteSpentSerial(spend));
+    BOOST_CHECK(tracker.IsSpentSerial(mintOne.GetSerialNumber()));
+    BOOST_CHECK(!tracker.HasUnusedSerial(mintOne.GetSerialNumber()));
+    BOOST_CHECK_EQUAL(tracker.GetDenominationCounts(false)[libzerocoin::ZQ_ONE], 0);
+    BOOST_CHECK_EQUAL(tracker.GetBalance(false), 5 * COIN);
+    BOOST_CHECK_EQUAL(tracker.ListMints(true, false, false).size(), 1U);
+    BOOST_CHECK_EQUAL(tracker.ListMints(false, false, false).size(), 2U);
+
+    CZerocoinMint mintRet;
+    BOOST_CHECK(tracker.Get(mintOne.GetValue(), mintRet));
+    BOOST_CHECK(mintRet.IsUsed());
+
+    // unspending: the serial is forgotten and the mint is written back unused
+    BOOST_CHECK(tracker.EraseSpentSerial(mintOne.GetSerialNumber()));
+    BOOST_CHECK(!tracker.IsSpentSerial(mintOne.GetSerialNumber()));
+    mintRet.SetUsed(false);
+    BOOST_CHECK(tracker.Write(mintRet));
+    BOOST_CHECK(tracker.HasUnusedSerial(mintOne.GetSerialNumber()));
+    BOOST_CHECK_EQUAL(tracker.GetDenominationCounts(false)[libzerocoin::ZQ_ONE], 1);
+    BOOST_CHECK_EQUAL(tracker.GetBalance(false), 6 * COIN);
+
+    // erasing a mint removes it and its count
+    BOOST_CHECK(tracker.Erase(mintFive));
+    BOOST_CHECK(!tracker.Get(mintFive.GetValue(), mintRet));
+    BOOST_CHECK(!tracker.HasUnusedSerial(mintFive.GetSerialNumber()));
+    BOOST_CHECK_EQUAL(tracker.GetDenominationCounts(false)[libzerocoin::ZQ_FIVE], 0);
+    BOOST_CHECK_EQUAL(tracker.GetBalance(false), 1 * COIN);
+}
+
+BOOST_AUTO_TEST_CASE(zerocointracker_state_on_tip)
+{
+    const int nConfirmations = Params().Zerocoin_MintRequiredConfirmations();
+    const int nLength = 2 * nConfirmations + 100;
+    CBlockIndex* pindexOld;
+    {
+        LOCK(cs_main);
+        pindexOld = chainActive.Tip();
+    }
+
+    std::vector<CBlockIndex> vIndex(nLength);
+    for (int i = 0; i < nLength; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+    }
+
+    // one mint confirmed deep in the chain and accumulated behind, the other one close to the tip
+    const int nHeightOne = 10;
+    const int nHeightFive = nLength / 2;
+    vIndex[nHeightOne + 1].vMintDenominationsInBlock.assign(Params().Zerocoin_RequiredAccumulation(), libzerocoin::ZQ_ONE);
+    vIndex[nHeightFive + 1].vMintDenominationsInBlock.assign(Params().Zerocoin_RequiredAccumulation(), libzerocoin::ZQ_FIVE);
+
+    CZerocoinTracker tracker;
+    BOOST_CHECK(tracker.Write(MakeMint(libzerocoin::ZQ_ONE, 1000, nHeightOne)));
+    BOOST_CHECK(tracker.Write(MakeMint(libzerocoin::ZQ_FIVE, 2000, nHeightFive)));
+
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(&vIndex[nHeightFive + nConfirmations / 2]);
+    }
+    BOOST_CHECK_EQUAL(tracker.GetBalance(true), 1 * COIN);
+    BOOST_CHECK_EQUAL(tracker.GetUnconfirmedBalance(), 5 * COIN);
+    BOOST_CHECK_EQUAL(tracker.GetDenominationCounts(true)[libzerocoin::ZQ_ONE], 1);
+    BOOST_CHECK_EQUAL(tracker.GetDenominationCounts(true)[libzerocoin::ZQ_FIVE], 0);
+    BOOST_CHECK_EQUAL(tracker.ListMints(true, true, false).size(), 1U);
+
+    // the accumulated mint is no longer in the chain, but the tip did not move: nothing is rechecked
+    vIndex[nHeightOne + 1].vMintDenominationsInBlock.clear();
+    BOOST_CHECK_EQUAL(tracker.GetBalance(true), 1 * COIN);
+
+    // extending the chain matures the second mint, the first one stays mature without a recheck
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(&vIndex[nLength - 1]);
+    }
+    BOOST_CHECK_EQUAL(tracker.GetBalance(true), 6 * COIN);
+    BOOST_CHECK_EQUAL(tracker.GetUnconfirmedBalance(), 0);
+
+    // a reorganisation rechecks the mature mints
+    std::vector<CBlockIndex> vFork(2);
+    vFork[0].nHeight = nLength - 2;
+    vFork[0].pprev = &vIndex[nLength - 3];
+    vFork[1].nHeight = nLength - 1;
+    vFork[1].pprev = &vFork[0];
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(&vFork[1]);
+    }
+    BOOST_CHECK_EQUAL(tracker.GetBalance(true), 5 * COIN);
+    BOOST_CHECK_EQUAL(tracker.GetBalance(false), 6 * COIN);
+    BOOST_CHECK_EQUAL(tracker.GetDenominationCounts(true)[libzerocoin::ZQ_ONE], 0);
+    BOOST_CHECK_EQUAL(tracker.GetDenominationCounts(false)[libzerocoin::ZQ_ONE], 1);
+
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(pindexOld);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -12,7 +12,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70914;
+static const int PROTOCOL_VERSION = 70915;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 210;
@@ -37,5 +37,11 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70912;
 
+//! compact block relay ("sendcmpct", "cmpctblock", "getblocktxn", "blocktxn") starts with this version
+static const int SHORT_IDS_BLOCKS_VERSION = 70915;
+
+//! "getheaders" is answered with "headers" and used for headers-first sync starting with this version
+static const int HEADERS_FIRST_VERSION = 70915;
+
 
 #endif // BITCOIN_VERSION_H
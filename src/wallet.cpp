@@ -23,6 +23,7 @@
 #include "timedata.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "zerocoinmintpool.h"
 
 #include "denomination_functions.h"
 #include "libzerocoin/Denominations.h"
@@ -44,6 +45,12 @@ bool bSpendZeroConfChange = true;
 bool bdisableSystemnotifications = false; // Those bubbles can be annoying and slow down the UI when you get lots of trx
 bool fSendFreeTransactions = false;
 bool fPayAtLeastCustomFee = true;
+unsigned int nCoinSelectionTime = DEFAULT_COIN_SELECTION_TIME;
+
+/** Most steps the branch and bound coin selection takes */
+static const unsigned int COIN_SELECTION_BNB_TRIES = 100000;
+/** Bytes a change output adds to a transaction, and its input adds when it is spent */
+static const unsigned int COIN_SELECTION_CHANGE_BYTES = 34 + 148;
 
 /**
  * Fees smaller than this (in uwgr) are considered zero fee (for transaction creation)
@@ -123,6 +130,8 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey& pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
+        if (pwalletdbEncryption)
+            return pwalletdbEncryption->WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
         return CWalletDB(strWalletFile).WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
     }
     return true;
@@ -529,6 +538,11 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
     if (IsCrypted())
         return false;
 
+    // Encryption would only rewrite the log, leaving the keys unencrypted in the old file
+    boost::filesystem::path pathPreLog;
+    if (fFileBacked && CWalletDB::GetPreLogFile(strWalletFile, pathPreLog))
+        return error("%s : %s still holds the unencrypted keys of the wallet", __func__, pathPreLog.string());
+
     CKeyingMaterial vMasterKey;
     RandAddSeedPerfmon();
 
@@ -631,7 +645,35 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH (PAIRTYPE(const uint256, CWalletTx) & item, mapWallet)
             item.second.MarkDirty();
+        MarkBalancesDirty();
+        fAvailableOutputsIndexed = false;
+    }
+}
+
+void CWallet::LoadWalletTxs(const std::vector<uint256>& vHashes)
+{
+    AssertLockHeld(cs_wallet);
+
+    // Same as AddToWallet(wtx, true) for each transaction, but the metadata of
+    // conflicting spends is synced once per outpoint rather than once per spend
+    BOOST_FOREACH (const uint256& hash, vHashes) {
+        CWalletTx& wtx = mapWallet[hash];
+        wtx.BindWallet(this);
+        wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+        if (wtx.IsCoinBase())
+            continue;
+        BOOST_FOREACH (const CTxIn& txin, wtx.vin)
+            mapTxSpends.insert(make_pair(txin.prevout, hash));
+    }
+
+    TxSpends::iterator it = mapTxSpends.begin();
+    while (it != mapTxSpends.end()) {
+        pair<TxSpends::iterator, TxSpends::iterator> range = mapTxSpends.equal_range(it->first);
+        if (std::distance(range.first, range.second) > 1)
+            SyncMetaData(range);
+        it = range.second;
     }
+    MarkBalancesDirty();
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
@@ -644,6 +686,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         wtx.BindWallet(this);
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
         AddToSpends(hash);
+        MarkBalancesDirty();
     } else {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
@@ -686,6 +729,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        MarkBalancesDirty();
+        for (unsigned int i = 0; i < wtx.vout.size(); i++)
+            IndexAvailableOutput(wtx, i);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -726,6 +772,9 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
+    // Every transaction of a connected or disconnected block comes through here, and the
+    // depth of the wallet's transactions changes with the block even when none is involved
+    MarkBalancesDirty();
     if (!AddToWalletIfInvolvingMe(tx, pblock, true))
         return; // Not one of ours
 
@@ -733,8 +782,13 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     // available of the outputs it spends. So force those to be
     // recomputed, also:
     BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-        if (!tx.IsZerocoinSpend() && mapWallet.count(txin.prevout.hash))
-            mapWallet[txin.prevout.hash].MarkDirty();
+        if (!tx.IsZerocoinSpend() && mapWallet.count(txin.prevout.hash)) {
+            CWalletTx& wtxPrev = mapWallet[txin.prevout.hash];
+            wtxPrev.MarkDirty();
+            // the output may be unspent again, if this transaction left the chain
+            if (txin.prevout.n < wtxPrev.vout.size())
+                IndexAvailableOutput(wtxPrev, txin.prevout.n);
+        }
     }
 }
 
@@ -746,6 +800,7 @@ void CWallet::EraseFromWallet(const uint256& hash)
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        MarkBalancesDirty();
     }
     return;
 }
@@ -767,7 +822,7 @@ isminetype CWallet::IsMine(const CTxIn& txin) const
 
 bool CWallet::IsMyZerocoinSpend(const CBigNum& bnSerial) const
 {
-    return CWalletDB(strWalletFile).ReadZerocoinSpendSerialEntry(bnSerial);
+    return zerocoinTracker.IsSpentSerial(bnSerial);
 }
 
 CAmount CWallet::GetDebit(const CTxIn& txin, const isminefilter& filter) const
@@ -1414,6 +1469,93 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+/** Most threads reading and matching blocks for a rescan */
+static const unsigned int MAX_RESCAN_THREADS = 8;
+/** Most blocks read ahead of the one being added to the wallet */
+static const unsigned int RESCAN_READ_AHEAD = 64;
+
+/**
+ * Reads the blocks of a rescan on worker threads, ahead of the scan, and finds the
+ * transactions with an output of the wallet's. The blocks are handed out in chain order;
+ * whether a transaction spends from the wallet depends on the transactions added before
+ * it, so that is left to the scan.
+ */
+class CRescanReader
+{
+private:
+    struct CScanBlock {
+        CBlock block;
+        std::vector<bool> vfMine; // per transaction: has an output that is ours
+    };
+
+    const CWallet& wallet;
+    const std::vector<CBlockIndex*>& vBlocks;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::map<unsigned int, CScanBlock> mapRead;
+    unsigned int nNextRead;
+    unsigned int nNextScan;
+    bool fStop;
+    boost::thread_group threadGroup;
+
+    void ThreadRead()
+    {
+        while (true) {
+            unsigned int nBlock;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && nNextRead < vBlocks.size() && nNextRead >= nNextScan + RESCAN_READ_AHEAD)
+                    cond.wait(lock);
+                if (fStop || nNextRead >= vBlocks.size())
+                    return;
+                nBlock = nNextRead++;
+            }
+
+            CScanBlock scan;
+            ReadBlockFromDisk(scan.block, vBlocks[nBlock]);
+            scan.vfMine.resize(scan.block.vtx.size());
+            for (unsigned int i = 0; i < scan.block.vtx.size(); i++)
+                scan.vfMine[i] = wallet.IsMine(scan.block.vtx[i]);
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            std::swap(mapRead[nBlock], scan);
+            cond.notify_all();
+        }
+    }
+
+public:
+    CRescanReader(const CWallet& walletIn, const std::vector<CBlockIndex*>& vBlocksIn) : wallet(walletIn), vBlocks(vBlocksIn), nNextRead(0), nNextScan(0), fStop(false)
+    {
+        unsigned int nThreads = std::max(1u, std::min(boost::thread::hardware_concurrency(), MAX_RESCAN_THREADS));
+        for (unsigned int i = 0; i < nThreads && i < vBlocks.size(); i++)
+            threadGroup.create_thread(boost::bind(&CRescanReader::ThreadRead, this));
+    }
+
+    ~CRescanReader()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            cond.notify_all();
+        }
+        threadGroup.join_all();
+    }
+
+    /** Wait for the next block of the rescan */
+    void Next(CBlock& block, std::vector<bool>& vfMine)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<unsigned int, CScanBlock>::iterator it;
+        while ((it = mapRead.find(nNextScan)) == mapRead.end())
+            cond.wait(lock);
+        std::swap(block, it->second.block);
+        std::swap(vfMine, it->second.vfMine);
+        mapRead.erase(it);
+        nNextScan++;
+        cond.notify_all();
+    }
+};
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
@@ -1433,20 +1575,32 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
+        std::vector<CBlockIndex*> vBlocks;
+        for (CBlockIndex* pindexBlock = pindex; pindexBlock; pindexBlock = chainActive.Next(pindexBlock))
+            vBlocks.push_back(pindexBlock);
+        CRescanReader reader(*this, vBlocks);
+
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
         double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
         double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex) {
+        CBlock block;
+        std::vector<bool> vfMine;
+        for (unsigned int nBlock = 0; nBlock < vBlocks.size(); nBlock++) {
+            pindex = vBlocks[nBlock];
             if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
                 ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH (CTransaction& tx, block.vtx) {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+            reader.Next(block, vfMine);
+            for (unsigned int i = 0; i < block.vtx.size(); i++) {
+                const CTransaction& tx = block.vtx[i];
+                // without an output of ours, only a transaction already in the wallet or
+                // spending from it is ours, which AddToWalletIfInvolvingMe checks in full
+                bool fCandidate = vfMine[i] || mapWallet.count(tx.GetHash());
+                for (unsigned int j = 0; !fCandidate && j < tx.vin.size(); j++)
+                    fCandidate = mapWallet.count(tx.vin[j].prevout.hash) != 0;
+                if (fCandidate && AddToWalletIfInvolvingMe(tx, &block, fUpdate))
                     ret++;
             }
-            pindex = chainActive.Next(pindex);
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
                 LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
@@ -1557,43 +1711,104 @@ void CWallet::ResendWalletTransactions()
  * @{
  */
 
-CAmount CWallet::GetBalance() const
+CAmount CWallet::GetCachedBalance(WalletBalanceType type) const
 {
-    CAmount nTotal = 0;
+    // read before the cached value is checked, so a change that races with the computation
+    // below leaves a stale counter in the cache and is picked up by the next query
+    unsigned int nMempoolUpdated = mempool.GetTransactionsUpdated();
+    int nTXLocks = nCompleteTXLocks;
+
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+        LOCK(cs_wallet);
+        const CBalanceCache& cache = balanceCache[type];
+        if (cache.fValid && cache.nEpoch == nBalanceEpoch && cache.nMempoolUpdated == nMempoolUpdated && cache.nTXLocks == nTXLocks)
+            return cache.nValue;
+    }
+
+    LOCK2(cs_main, cs_wallet);
+    CBalanceCache& cache = balanceCache[type];
+    cache.nValue = ComputeBalance(type);
+    cache.nEpoch = nBalanceEpoch;
+    cache.nMempoolUpdated = nMempoolUpdated;
+    cache.nTXLocks = nTXLocks;
+    cache.fValid = true;
+    return cache.nValue;
+}
+
+CAmount CWallet::ComputeBalance(WalletBalanceType type) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    CAmount nTotal = 0;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        const CWalletTx* pcoin = &(*it).second;
+        switch (type) {
+        case BALANCE_AVAILABLE:
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
+            break;
+        case BALANCE_UNCONFIRMED:
+            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
+                nTotal += pcoin->GetAvailableCredit();
+            break;
+        case BALANCE_IMMATURE:
+            nTotal += pcoin->GetImmatureCredit();
+            break;
+        case BALANCE_WATCHONLY:
+            if (pcoin->IsTrusted())
+                nTotal += pcoin->GetAvailableWatchOnlyCredit();
+            break;
+        case BALANCE_UNCONFIRMED_WATCHONLY:
+            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
+                nTotal += pcoin->GetAvailableWatchOnlyCredit();
+            break;
+        case BALANCE_IMMATURE_WATCHONLY:
+            nTotal += pcoin->GetImmatureWatchOnlyCredit();
+            break;
+        case BALANCE_LOCKED_WATCHONLY:
+            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() > 0)
+                nTotal += pcoin->GetLockedWatchOnlyCredit();
+            break;
+        case BALANCE_UNLOCKED:
+            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() > 0)
+                nTotal += pcoin->GetUnlockedCredit();
+            break;
+        case BALANCE_LOCKED:
+            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() > 0)
+                nTotal += pcoin->GetLockedCredit();
+            break;
+        case BALANCE_ANONYMIZABLE:
+            if (pcoin->IsTrusted())
+                nTotal += pcoin->GetAnonymizableCredit();
+            break;
+        case BALANCE_ANONYMIZED:
+            if (pcoin->IsTrusted())
+                nTotal += pcoin->GetAnonymizedCredit();
+            break;
+        case BALANCE_DENOMINATED:
+            nTotal += pcoin->GetDenominatedCredit(false);
+            break;
+        case BALANCE_DENOMINATED_UNCONFIRMED:
+            nTotal += pcoin->GetDenominatedCredit(true);
+            break;
+        default:
+            break;
         }
     }
 
     return nTotal;
 }
 
-CAmount CWallet::GetZerocoinBalance(bool fMatureOnly) const
+CAmount CWallet::GetBalance() const
 {
-    CAmount nTotal = 0;
-    //! zerocoin specific fields
-    std::map<libzerocoin::CoinDenomination, unsigned int> myZerocoinSupply;
-    for (auto& denom : libzerocoin::zerocoinDenomList) {
-        myZerocoinSupply.insert(make_pair(denom, 0));
-    }
+    return GetCachedBalance(BALANCE_AVAILABLE);
+}
 
-    {
-        LOCK2(cs_main, cs_wallet);
-        // Get Unused coins
-        list<CZerocoinMint> listPubCoin = CWalletDB(strWalletFile).ListMintedCoins(true, fMatureOnly, true);
-        for (auto& mint : listPubCoin) {
-            libzerocoin::CoinDenomination denom = mint.GetDenomination();
-            nTotal += libzerocoin::ZerocoinDenominationToAmount(denom);
-            myZerocoinSupply.at(denom)++;
-        }
-    }
-    for (auto& denom : libzerocoin::zerocoinDenomList) {
-        LogPrint("zero","%s My coins for denomination %d pubcoin %s\n", __func__,denom, myZerocoinSupply.at(denom));
-    }
+CAmount CWallet::GetZerocoinBalance(bool fMatureOnly) const
+{
+    // Get Unused coins
+    CAmount nTotal = zerocoinTracker.GetBalance(fMatureOnly);
     LogPrint("zero","Total value of coins %d\n",nTotal);
 
     if (nTotal < 0 ) nTotal = 0; // Sanity never hurts
@@ -1603,35 +1818,12 @@ CAmount CWallet::GetZerocoinBalance(bool fMatureOnly) const
 
 CAmount CWallet::GetImmatureZerocoinBalance() const
 {
-    return GetZerocoinBalance(false) - GetZerocoinBalance(true);
+    return zerocoinTracker.GetBalance(false) - zerocoinTracker.GetBalance(true);
 }
 
 CAmount CWallet::GetUnconfirmedZerocoinBalance() const
 {
-    CAmount nUnconfirmed = 0;
-    CWalletDB walletdb(pwalletMain->strWalletFile);
-    list<CZerocoinMint> listMints = walletdb.ListMintedCoins(true, false, true);
- 
-    std::map<libzerocoin::CoinDenomination, int> mapUnconfirmed;
-    for (const auto& denom : libzerocoin::zerocoinDenomList){
-        mapUnconfirmed.insert(make_pair(denom, 0));
-    }
-
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (auto& mint : listMints){
-            if (!mint.GetHeight() || mint.GetHeight() > chainActive.Height() - Params().Zerocoin_MintRequiredConfirmations()) {
-                libzerocoin::CoinDenomination denom = mint.GetDenomination();
-                nUnconfirmed += libzerocoin::ZerocoinDenominationToAmount(denom);
-                mapUnconfirmed.at(denom)++;
-            }
-        }
-    }
-
-    for (auto& denom : libzerocoin::zerocoinDenomList) {
-        LogPrint("zero","%s My unconfirmed coins for denomination %d pubcoin %s\n", __func__,denom, mapUnconfirmed.at(denom));
-    }
-
+    CAmount nUnconfirmed = zerocoinTracker.GetUnconfirmedBalance();
     LogPrint("zero","Total value of unconfirmed coins %ld\n", nUnconfirmed);
 
     if (nUnconfirmed < 0 ) nUnconfirmed = 0; // Sanity never hurts
@@ -1643,50 +1835,23 @@ CAmount CWallet::GetUnlockedCoins() const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() > 0)
-                nTotal += pcoin->GetUnlockedCredit();
-        }
-    }
-
-    return nTotal;
+    return GetCachedBalance(BALANCE_UNLOCKED);
 }
 
 CAmount CWallet::GetLockedCoins() const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() > 0)
-                nTotal += pcoin->GetLockedCredit();
-        }
-    }
-
-    return nTotal;
+    return GetCachedBalance(BALANCE_LOCKED);
 }
 
 // Get a Map pairing the Denominations with the amount of Zerocoin for each Denomination
 std::map<libzerocoin::CoinDenomination, CAmount> CWallet::GetMyZerocoinDistribution() const
 {
     std::map<libzerocoin::CoinDenomination, CAmount> spread;
+    std::map<libzerocoin::CoinDenomination, int> mapCounts = zerocoinTracker.GetDenominationCounts(true);
     for (const auto& denom : libzerocoin::zerocoinDenomList)
-        spread.insert(std::pair<libzerocoin::CoinDenomination, CAmount>(denom, 0));
-    {
-        LOCK2(cs_main, cs_wallet);
-        list<CZerocoinMint> listPubCoin = CWalletDB(strWalletFile).ListMintedCoins(true, true, true);
-        for (auto& mint : listPubCoin)
-            spread.at(mint.GetDenomination())++;
-    }
+        spread.insert(std::pair<libzerocoin::CoinDenomination, CAmount>(denom, mapCounts.at(denom)));
     return spread;
 }
 
@@ -1695,36 +1860,14 @@ CAmount CWallet::GetAnonymizableBalance() const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizableCredit();
-        }
-    }
-
-    return nTotal;
+    return GetCachedBalance(BALANCE_ANONYMIZABLE);
 }
 
 CAmount CWallet::GetAnonymizedBalance() const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizedCredit();
-        }
-    }
-
-    return nTotal;
+    return GetCachedBalance(BALANCE_ANONYMIZED);
 }
 
 // Note: calculated including unconfirmed,
@@ -1794,100 +1937,92 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            nTotal += pcoin->GetDenominatedCredit(unconfirmed);
-        }
-    }
-
-    return nTotal;
+    return GetCachedBalance(unconfirmed ? BALANCE_DENOMINATED_UNCONFIRMED : BALANCE_DENOMINATED);
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    return GetCachedBalance(BALANCE_UNCONFIRMED);
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    return GetCachedBalance(BALANCE_IMMATURE);
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    return GetCachedBalance(BALANCE_WATCHONLY);
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetCachedBalance(BALANCE_UNCONFIRMED_WATCHONLY);
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetCachedBalance(BALANCE_IMMATURE_WATCHONLY);
 }
 
 CAmount CWallet::GetLockedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() > 0)
-                nTotal += pcoin->GetLockedWatchOnlyCredit();
+    return GetCachedBalance(BALANCE_LOCKED_WATCHONLY);
+}
+
+CWallet::OutputBucket CWallet::GetOutputBucket(CAmount nValue) const
+{
+    if (IsDenominatedAmount(nValue))
+        return OUTPUT_DENOMINATED;
+    if (IsCollateralAmount(nValue))
+        return OUTPUT_COLLATERAL;
+    if (nValue == 25000 * COIN)
+        return OUTPUT_MASTERNODE;
+    return OUTPUT_OTHER;
+}
+
+void CWallet::IndexAvailableOutput(const CWalletTx& wtx, unsigned int n) const
+{
+    AssertLockHeld(cs_wallet);
+    if (!fAvailableOutputsIndexed)
+        return; // picked up when the index is built
+
+    isminetype mine = IsMine(wtx.vout[n]);
+    if (mine == ISMINE_NO || mine == ISMINE_WATCH_ONLY)
+        return;
+    mapAvailableOutputs[GetOutputBucket(wtx.vout[n].nValue)][COutPoint(wtx.GetHash(), n)] = mine;
+}
+
+void CWallet::IndexAvailableOutputs() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    for (int i = 0; i < OUTPUT_BUCKETS; i++)
+        mapAvailableOutputs[i].clear();
+    fAvailableOutputsIndexed = true;
+    nAvailableOutputsDenominations = obfuScationDenominations.size();
+
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        for (unsigned int i = 0; i < it->second.vout.size(); i++) {
+            if (!IsSpentInMainChain(it->first, i))
+                IndexAvailableOutput(it->second, i);
         }
     }
-    return nTotal;
+}
+
+/** Like IsSpent, but only counting spends in the active chain */
+bool CWallet::IsSpentInMainChain(const uint256& hash, unsigned int n) const
+{
+    const COutPoint outpoint(hash, n);
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+    range = mapTxSpends.equal_range(outpoint);
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it) {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain(false) > 0)
+            return true;
+    }
+    return false;
 }
 
 /**
@@ -1899,73 +2034,114 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!CheckFinalTx(*pcoin))
-                continue;
-
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
-
-            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
-                continue;
-
-            int nDepth = pcoin->GetDepthInMainChain(false);
-            // do not use IX for inputs that have less then 6 blockchain confirmations
-            if (fUseIX && nDepth < 6)
-                continue;
-
-            // We should not consider coins which aren't at least in our mempool
-            // It's possible for these to be conflicted via ancestors which we may never be able to detect
-            if (nDepth == 0 && !pcoin->InMempool())
-                continue;
-
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                bool found = false;
-                if (nCoinType == ONLY_DENOMINATED) {
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                } else if (nCoinType == ONLY_NOT25000IFMN) {
-                    found = !(fMasterNode && pcoin->vout[i].nValue == 25000 * COIN);
-                } else if (nCoinType == ONLY_NONDENOMINATED_NOT25000IFMN) {
-                    if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
-                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-                    if (found && fMasterNode) found = pcoin->vout[i].nValue != 25000 * COIN; // do not use Hot MN funds
-                } else if (nCoinType == ONLY_25000) {
-                    found = pcoin->vout[i].nValue == 25000 * COIN;
-                } else {
-                    found = true;
-                }
-                if (!found) continue;
-
-                if (nCoinType == STAKABLE_COINS) {
-                    if (pcoin->vout[i].IsZerocoinMint())
-                        continue;
+        if (!fAvailableOutputsIndexed || nAvailableOutputsDenominations != obfuScationDenominations.size())
+            IndexAvailableOutputs();
+
+        // The buckets that can hold coins of nCoinType; the checks below still apply to each coin
+        bool fBuckets[OUTPUT_BUCKETS];
+        for (int i = 0; i < OUTPUT_BUCKETS; i++)
+            fBuckets[i] = true;
+        if (nCoinType == ONLY_DENOMINATED) {
+            fBuckets[OUTPUT_OTHER] = fBuckets[OUTPUT_COLLATERAL] = fBuckets[OUTPUT_MASTERNODE] = false;
+        } else if (nCoinType == ONLY_NONDENOMINATED_NOT25000IFMN) {
+            fBuckets[OUTPUT_DENOMINATED] = fBuckets[OUTPUT_COLLATERAL] = false;
+            fBuckets[OUTPUT_MASTERNODE] = !fMasterNode;
+        } else if (nCoinType == ONLY_25000) {
+            fBuckets[OUTPUT_OTHER] = fBuckets[OUTPUT_DENOMINATED] = fBuckets[OUTPUT_COLLATERAL] = false;
+        }
+
+        // Merge them back into wallet order, which groups the outputs of each transaction
+        vector<pair<COutPoint, isminetype> > vOutputs;
+        for (int i = 0; i < OUTPUT_BUCKETS; i++) {
+            if (fBuckets[i])
+                vOutputs.insert(vOutputs.end(), mapAvailableOutputs[i].begin(), mapAvailableOutputs[i].end());
+        }
+        sort(vOutputs.begin(), vOutputs.end());
+
+        const CWalletTx* pcoin = NULL;
+        bool fUsable = false;
+        int nDepth = 0;
+        for (vector<pair<COutPoint, isminetype> >::const_iterator it = vOutputs.begin(); it != vOutputs.end(); ++it) {
+            const uint256& wtxid = it->first.hash;
+            unsigned int i = it->first.n;
+
+            if (pcoin == NULL || pcoin->GetHash() != wtxid) {
+                map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(wtxid);
+                if (mi == mapWallet.end()) {
+                    // erased from the wallet
+                    for (int j = 0; j < OUTPUT_BUCKETS; j++)
+                        mapAvailableOutputs[j].erase(it->first);
+                    pcoin = NULL;
+                    continue;
                 }
+                pcoin = &mi->second;
+                nDepth = pcoin->GetDepthInMainChain(false);
+                fUsable = false;
 
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (IsSpent(wtxid, i))
+                if (!CheckFinalTx(*pcoin))
                     continue;
-                if (mine == ISMINE_NO)
+
+                if (fOnlyConfirmed && !pcoin->IsTrusted())
                     continue;
-                if (mine == ISMINE_WATCH_ONLY)
+
+                if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
                     continue;
 
-                if (IsLockedCoin((*it).first, i) && nCoinType != ONLY_25000)
+                // do not use IX for inputs that have less then 6 blockchain confirmations
+                if (fUseIX && nDepth < 6)
                     continue;
-                if (pcoin->vout[i].nValue <= 0 && !fIncludeZeroValue)
+
+                // We should not consider coins which aren't at least in our mempool
+                // It's possible for these to be conflicted via ancestors which we may never be able to detect
+                if (nDepth == 0 && !pcoin->InMempool())
                     continue;
-                if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected((*it).first, i))
+
+                fUsable = true;
+            }
+            if (!fUsable)
+                continue;
+
+            bool found = false;
+            if (nCoinType == ONLY_DENOMINATED) {
+                found = IsDenominatedAmount(pcoin->vout[i].nValue);
+            } else if (nCoinType == ONLY_NOT25000IFMN) {
+                found = !(fMasterNode && pcoin->vout[i].nValue == 25000 * COIN);
+            } else if (nCoinType == ONLY_NONDENOMINATED_NOT25000IFMN) {
+                if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
+                found = !IsDenominatedAmount(pcoin->vout[i].nValue);
+                if (found && fMasterNode) found = pcoin->vout[i].nValue != 25000 * COIN; // do not use Hot MN funds
+            } else if (nCoinType == ONLY_25000) {
+                found = pcoin->vout[i].nValue == 25000 * COIN;
+            } else {
+                found = true;
+            }
+            if (!found) continue;
+
+            if (nCoinType == STAKABLE_COINS) {
+                if (pcoin->vout[i].IsZerocoinMint())
                     continue;
+            }
 
-                bool fIsSpendable = false;
-                if ((mine & ISMINE_SPENDABLE) != ISMINE_NO)
-                    fIsSpendable = true;
-                if ((mine & ISMINE_MULTISIG) != ISMINE_NO)
-                    fIsSpendable = true;
-                vCoins.emplace_back(COutput(pcoin, i, nDepth, fIsSpendable));
+            isminetype mine = it->second;
+            if (IsSpent(wtxid, i)) {
+                if (IsSpentInMainChain(wtxid, i))
+                    mapAvailableOutputs[GetOutputBucket(pcoin->vout[i].nValue)].erase(it->first);
+                continue;
             }
+
+            if (IsLockedCoin(wtxid, i) && nCoinType != ONLY_25000)
+                continue;
+            if (pcoin->vout[i].nValue <= 0 && !fIncludeZeroValue)
+                continue;
+            if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(wtxid, i))
+                continue;
+
+            bool fIsSpendable = false;
+            if ((mine & ISMINE_SPENDABLE) != ISMINE_NO)
+                fIsSpendable = true;
+            if ((mine & ISMINE_MULTISIG) != ISMINE_NO)
+                fIsSpendable = true;
+            vCoins.emplace_back(COutput(pcoin, i, nDepth, fIsSpendable));
         }
     }
 }
@@ -1990,7 +2166,63 @@ map<CBitcoinAddress, vector<COutput> > CWallet::AvailableCoinsByAddress(bool fCo
     return mapCoins;
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
+/**
+ * Find the subset of vValue (sorted by decreasing value) closest above nTargetValue that
+ * overpays by no more than nCostOfChange, so the transaction needs no change output.
+ * Depth-first search over including or leaving out each coin, backtracking once the total
+ * reaches the target or the coins left cannot reach it; a coin is not tried in place of an
+ * equal one just left out. Gives up after COIN_SELECTION_BNB_TRIES steps or at nDeadline.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > >& vValue, const CAmount& nTargetValue, const CAmount& nCostOfChange, int64_t nDeadline, vector<char>& vfBest, CAmount& nBest)
+{
+    // value of the coins from each position on
+    vector<CAmount> vRemaining(vValue.size() + 1, 0);
+    for (unsigned int i = vValue.size(); i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+
+    vector<char> vfIncluded(vValue.size(), false);
+    CAmount nTotal = 0;
+    bool fFound = false;
+    unsigned int i = 0; // the next coin to decide on
+    for (unsigned int nTries = 0; nTries < COIN_SELECTION_BNB_TRIES; nTries++) {
+        if (nTries % 1000 == 999 && GetTimeMillis() > nDeadline)
+            break;
+
+        bool fBacktrack = false;
+        if (nTotal >= nTargetValue) {
+            if (nTotal <= nTargetValue + nCostOfChange && (!fFound || nTotal < nBest)) {
+                fFound = true;
+                nBest = nTotal;
+                vfBest = vfIncluded;
+                if (nBest == nTargetValue)
+                    break;
+            }
+            fBacktrack = true;
+        } else if (nTotal + vRemaining[i] < nTargetValue) {
+            fBacktrack = true;
+        }
+
+        if (fBacktrack) {
+            // leave out the last coin included, and go on from there
+            while (i > 0 && !vfIncluded[i - 1])
+                i--;
+            if (i == 0)
+                break; // searched everything
+            vfIncluded[i - 1] = false;
+            nTotal -= vValue[i - 1].first;
+        } else {
+            if (i == 0 || vfIncluded[i - 1] || vValue[i - 1].first != vValue[i].first) {
+                vfIncluded[i] = true;
+                nTotal += vValue[i].first;
+            }
+            i++;
+        }
+    }
+
+    return fFound;
+}
+
+static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations = 1000, int64_t nDeadline = std::numeric_limits<int64_t>::max())
 {
     vector<char> vfIncluded;
 
@@ -2000,6 +2232,9 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, un
     seed_insecure_rand();
 
     for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++) {
+        if (nRep > 0 && GetTimeMillis() > nDeadline)
+            break;
+
         vfIncluded.assign(vValue.size(), false);
         CAmount nTotal = 0;
         bool fReachedTarget = false;
@@ -2184,14 +2419,28 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         break;
     }
 
-    // Solve subset sum by stochastic approximation
     sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     CAmount nBest;
+    int64_t nDeadline = GetTimeMillis() + nCoinSelectionTime;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+    // Look for a subset that needs no change first
+    CAmount nCostOfChange = CWallet::minTxFee.GetFee(COIN_SELECTION_CHANGE_BYTES);
+    if (SelectCoinsBnB(vValue, nTargetValue, nCostOfChange, nDeadline, vfBest, nBest)) {
+        for (unsigned int i = 0; i < vValue.size(); i++) {
+            if (vfBest[i]) {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+        }
+        LogPrint("selectcoins", "CWallet::SelectCoinsMinConf changeless subset of %u coins - total %s\n", setCoinsRet.size(), FormatMoney(nBest));
+        return true;
+    }
+
+    // Solve subset sum by stochastic approximation
+    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000, nDeadline);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000, nDeadline);
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -3334,6 +3583,76 @@ bool CWallet::SetDefaultKey(const CPubKey& vchPubKey)
     return true;
 }
 
+/** Most threads generating keypool keys */
+static const unsigned int MAX_KEYGEN_THREADS = 8;
+/** Keys added to the keypool per database transaction */
+static const unsigned int KEYPOOL_BATCH_SIZE = 100;
+
+static void ThreadGenerateKeys(std::vector<std::pair<CKey, CPubKey> >* pvKeys, unsigned int nFirst, unsigned int nStep, bool fCompressed)
+{
+    for (unsigned int i = nFirst; i < pvKeys->size(); i += nStep) {
+        CKey& secret = (*pvKeys)[i].first;
+        secret.MakeNewKey(fCompressed);
+        (*pvKeys)[i].second = secret.GetPubKey();
+        assert(secret.VerifyPubKey((*pvKeys)[i].second));
+    }
+}
+
+/** Fill vKeys with new keys, generated on up to MAX_KEYGEN_THREADS threads */
+static void GenerateKeys(std::vector<std::pair<CKey, CPubKey> >& vKeys, bool fCompressed)
+{
+    RandAddSeedPerfmon();
+    unsigned int nThreads = std::max(1u, std::min(boost::thread::hardware_concurrency(), MAX_KEYGEN_THREADS));
+    if (nThreads == 1 || vKeys.size() < 2 * nThreads) {
+        ThreadGenerateKeys(&vKeys, 0, 1, fCompressed);
+        return;
+    }
+
+    boost::thread_group threadGroup;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&ThreadGenerateKeys, &vKeys, i, nThreads, fCompressed));
+    threadGroup.join_all();
+}
+
+bool CWallet::AddKeysToPool(const std::vector<std::pair<CKey, CPubKey> >& vKeys)
+{
+    AssertLockHeld(cs_wallet);
+    assert(!pwalletdbEncryption);
+
+    // Compressed public keys were introduced in version 0.6.0
+    if (!vKeys.empty() && vKeys[0].second.IsCompressed())
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+
+    CWalletDB walletdb(strWalletFile);
+    if (!walletdb.TxnBegin())
+        return false;
+    // The keys, their metadata and pool entries all go into this transaction
+    pwalletdbEncryption = &walletdb;
+
+    int64_t nCreationTime = GetTime();
+    int64_t nEnd = setKeyPool.empty() ? 1 : *(--setKeyPool.end()) + 1;
+    std::vector<int64_t> vIndexes;
+    bool fSuccess = true;
+    for (unsigned int i = 0; i < vKeys.size() && fSuccess; i++) {
+        const CPubKey& pubkey = vKeys[i].second;
+        mapKeyMetadata[pubkey.GetID()] = CKeyMetadata(nCreationTime);
+        if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
+            nTimeFirstKey = nCreationTime;
+        fSuccess = AddKeyPubKey(vKeys[i].first, pubkey) && walletdb.WritePool(nEnd, CKeyPool(pubkey));
+        vIndexes.push_back(nEnd++);
+    }
+
+    pwalletdbEncryption = NULL;
+    if (!fSuccess) {
+        walletdb.TxnAbort();
+        return false;
+    }
+    if (!walletdb.TxnCommit())
+        return false;
+    setKeyPool.insert(vIndexes.begin(), vIndexes.end());
+    return true;
+}
+
 /**
  * Mark old keypool keys as used,
  * and generate all new keys
@@ -3351,10 +3670,12 @@ bool CWallet::NewKeyPool()
             return false;
 
         int64_t nKeys = max(GetArg("-keypool", 1000), (int64_t)0);
-        for (int i = 0; i < nKeys; i++) {
-            int64_t nIndex = i + 1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
+        bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+        for (int64_t nDone = 0; nDone < nKeys; nDone += KEYPOOL_BATCH_SIZE) {
+            std::vector<std::pair<CKey, CPubKey> > vKeys(std::min(nKeys - nDone, (int64_t)KEYPOOL_BATCH_SIZE));
+            GenerateKeys(vKeys, fCompressed);
+            if (!AddKeysToPool(vKeys))
+                throw runtime_error("NewKeyPool() : writing generated keys failed");
         }
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
@@ -3363,30 +3684,42 @@ bool CWallet::NewKeyPool()
 
 bool CWallet::TopUpKeyPool(unsigned int kpSize)
 {
-    {
-        LOCK(cs_wallet);
+    // Top up key pool
+    unsigned int nTargetSize;
+    if (kpSize > 0)
+        nTargetSize = kpSize;
+    else
+        nTargetSize = max(GetArg("-keypool", 1000), (int64_t)0);
 
-        if (IsLocked())
-            return false;
+    while (true) {
+        unsigned int nMissing;
+        bool fCompressed;
+        {
+            LOCK(cs_wallet);
+            if (IsLocked())
+                return false;
+            if (setKeyPool.size() >= nTargetSize + 1)
+                break;
+            nMissing = nTargetSize + 1 - setKeyPool.size();
+            fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+        }
 
-        CWalletDB walletdb(strWalletFile);
+        // The keys are generated without holding cs_wallet (unless the caller does), and
+        // added a batch at a time, so other wallet users only wait for the writes
+        std::vector<std::pair<CKey, CPubKey> > vKeys(std::min(nMissing, KEYPOOL_BATCH_SIZE));
+        GenerateKeys(vKeys, fCompressed);
 
-        // Top up key pool
-        unsigned int nTargetSize;
-        if (kpSize > 0)
-            nTargetSize = kpSize;
-        else
-            nTargetSize = max(GetArg("-keypool", 1000), (int64_t)0);
-
-        while (setKeyPool.size() < (nTargetSize + 1)) {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
-            double dProgress = 100.f * nEnd / (nTargetSize + 1);
+        {
+            LOCK(cs_wallet);
+            if (IsLocked())
+                return false;
+            // someone else may have topped up in the meantime
+            if (setKeyPool.size() >= nTargetSize + 1)
+                break;
+            if (!AddKeysToPool(vKeys))
+                throw runtime_error("TopUpKeyPool() : writing generated keys failed");
+            LogPrintf("keypool added %u keys, size=%u\n", vKeys.size(), setKeyPool.size());
+            double dProgress = 100.f * std::min((unsigned int)setKeyPool.size(), nTargetSize + 1) / (nTargetSize + 1);
             std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
             uiInterface.InitMessage(strMsg);
         }
@@ -3673,18 +4006,21 @@ void CWallet::LockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.insert(output);
+    MarkBalancesDirty();
 }
 
 void CWallet::UnlockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.erase(output);
+    MarkBalancesDirty();
 }
 
 void CWallet::UnlockAllCoins()
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.clear();
+    MarkBalancesDirty();
 }
 
 bool CWallet::IsLockedCoin(uint256 hash, unsigned int n) const
@@ -4350,9 +4686,10 @@ bool CWallet::CreateZerocoinMintTransaction(const CAmount nValue, CMutableTransa
     //add multiple mints that will fit the amount requested as closely as possible
     CAmount nMintingValue = 0;
     CAmount nValueRemaining = 0;
+    vector<libzerocoin::CoinDenomination> vDenoms;
     while (true) {
         //mint a coin with the closest denomination to what is being requested
-        nFeeRet = max(static_cast<int>(txNew.vout.size()), 1) * Params().Zerocoin_MintFee();
+        nFeeRet = max(static_cast<int>(txNew.vout.size() + vDenoms.size()), 1) * Params().Zerocoin_MintFee();
         nValueRemaining = nValue - nMintingValue - (isZCSpendChange ? nFeeRet : 0);
 
         // if this is change of a zerocoinspend, then we can't mint all change, at least something must be given as a fee
@@ -4363,12 +4700,17 @@ bool CWallet::CreateZerocoinMintTransaction(const CAmount nValue, CMutableTransa
         if (denomination == libzerocoin::ZQ_ERROR)
             break;
 
-        CAmount nValueNewMint = libzerocoin::ZerocoinDenominationToAmount(denomination);
-        nMintingValue += nValueNewMint;
+        nMintingValue += libzerocoin::ZerocoinDenominationToAmount(denomination);
+        vDenoms.push_back(denomination);
+    }
+
+    // mint the new coins (create Pedersen Commitments), taking pregenerated ones first
+    vector<CZerocoinMint> vNewMints;
+    zerocoinMintPool.Mint(vDenoms, vNewMints);
 
-        // mint a new coin (create Pedersen Commitment) and extract PublicCoin that is shareable from it
-        libzerocoin::PrivateCoin newCoin(Params().Zerocoin_Params(), denomination);
-        libzerocoin::PublicCoin pubCoin = newCoin.getPublicCoin();
+    BOOST_FOREACH (const CZerocoinMint& mint, vNewMints) {
+        // extract PublicCoin that is shareable from it
+        libzerocoin::PublicCoin pubCoin(Params().Zerocoin_Params(), mint.GetValue(), mint.GetDenomination());
 
         // Validate
         if(!pubCoin.validate()) {
@@ -4377,11 +4719,10 @@ bool CWallet::CreateZerocoinMintTransaction(const CAmount nValue, CMutableTransa
         }
 
         CScript scriptSerializedCoin = CScript() << OP_ZEROCOINMINT << pubCoin.getValue().getvch().size() << pubCoin.getValue().getvch();
-        CTxOut outMint(nValueNewMint, scriptSerializedCoin);
+        CTxOut outMint(libzerocoin::ZerocoinDenominationToAmount(mint.GetDenomination()), scriptSerializedCoin);
         txNew.vout.push_back(outMint);
 
         //store as CZerocoinMint for later use
-        CZerocoinMint mint(denomination, pubCoin.getValue(), newCoin.getRandomness(), newCoin.getSerialNumber(), false);
         vMints.push_back(mint);
     }
 
@@ -4507,18 +4848,15 @@ bool CWallet::MintToTxIn(CZerocoinMint zerocoinSelected, int nSecurityLevel, con
             return false;
         }
 
-        std::list<CBigNum> listCoinSpendSerial = CWalletDB(strWalletFile).ListSpentCoinsSerial();
-        for (const CBigNum& item : listCoinSpendSerial) {
-            if (spend.getCoinSerialNumber() == item) {
-                //Tried to spend an already spent zWgr
-                zerocoinSelected.SetUsed(true);
-                if (!CWalletDB(strWalletFile).WriteZerocoinMint(zerocoinSelected))
-                    LogPrintf("%s failed to write zerocoinmint\n", __func__);
+        if (zerocoinTracker.IsSpentSerial(spend.getCoinSerialNumber())) {
+            //Tried to spend an already spent zWgr
+            zerocoinSelected.SetUsed(true);
+            if (!zerocoinTracker.Write(zerocoinSelected))
+                LogPrintf("%s failed to write zerocoinmint\n", __func__);
 
-                pwalletMain->NotifyZerocoinChanged(pwalletMain, zerocoinSelected.GetValue().GetHex(), "Used", CT_UPDATED);
-                receipt.SetStatus(_("The coin spend has been used"), ZWGR_SPENT_USED_ZWGR);
-                return false;
-            }
+            pwalletMain->NotifyZerocoinChanged(pwalletMain, zerocoinSelected.GetValue().GetHex(), "Used", CT_UPDATED);
+            receipt.SetStatus(_("The coin spend has been used"), ZWGR_SPENT_USED_ZWGR);
+            return false;
         }
 
         uint32_t nAccumulatorChecksum = GetChecksum(accumulator.getValue());
@@ -4554,14 +4892,13 @@ bool CWallet::CreateZerocoinSpendTransaction(CAmount nValue, int nSecurityLevel,
     nStatus = ZWGR_TRX_CREATE;
 
     // If not already given pre-selected mints, then select mints from the wallet
-    CWalletDB walletdb(pwalletMain->strWalletFile);
     list<CZerocoinMint> listMints;
     CAmount nValueSelected = 0;
     int nCoinsReturned = 0; // Number of coins returned in change from function below (for debug)
     int nNeededSpends = 0;  // Number of spends which would be needed if selection failed
     const int nMaxSpends = Params().Zerocoin_MaxSpendsPerTransaction(); // Maximum possible spends for one zWGR transaction
     if (vSelectedMints.empty()) {
-        listMints = walletdb.ListMintedCoins(true, true, true); // need to find mints to spend
+        listMints = zerocoinTracker.ListMints(true, true, true); // need to find mints to spend
         if(listMints.empty()) {
             receipt.SetStatus(_("Failed to find Zerocoins in in wallet.dat"), nStatus);
             return false;
@@ -4592,7 +4929,7 @@ bool CWallet::CreateZerocoinSpendTransaction(CAmount nValue, int nSecurityLevel,
             receipt.SetStatus(_("Trying to spend an already spent serial #, try again."), nStatus);
 
             mint.SetUsed(true);
-            walletdb.WriteZerocoinMint(mint);
+            zerocoinTracker.Write(mint);
 
             return false;
         }
@@ -4611,7 +4948,7 @@ bool CWallet::CreateZerocoinSpendTransaction(CAmount nValue, int nSecurityLevel,
 
         // archive this mint as an orphan
         if (fArchive) {
-            walletdb.ArchiveMintOrphan(mint);
+            zerocoinTracker.Archive(mint);
             nArchived++;
         }
     }
@@ -4713,7 +5050,7 @@ bool CWallet::CreateZerocoinSpendTransaction(CAmount nValue, int nSecurityLevel,
             for (CZerocoinSpend spend : receipt.GetSpends()) {
                 spend.SetTxHash(txHash);
 
-                if (!CWalletDB(strWalletFile).WriteZerocoinSpendSerialEntry(spend)) {
+                if (!zerocoinTracker.WriteSpentSerial(spend)) {
                     receipt.SetStatus(_("Failed to write coin serial number into wallet"), nStatus);
                 }
             }
@@ -4735,9 +5072,8 @@ string CWallet::ResetMintZerocoin(bool fExtendedSearch)
 {
     long updates = 0;
     long deletions = 0;
-    CWalletDB walletdb(pwalletMain->strWalletFile);
 
-    list<CZerocoinMint> listMints = walletdb.ListMintedCoins(false, false, true);
+    list<CZerocoinMint> listMints = zerocoinTracker.ListMints(false, false, true);
     vector<CZerocoinMint> vMintsToFind{ std::make_move_iterator(std::begin(listMints)), std::make_move_iterator(std::end(listMints)) };
     vector<CZerocoinMint> vMintsMissing;
     vector<CZerocoinMint> vMintsToUpdate;
@@ -4748,13 +5084,13 @@ string CWallet::ResetMintZerocoin(bool fExtendedSearch)
     // Update the meta data of mints that were marked for updating
     for (CZerocoinMint mint : vMintsToUpdate) {
         updates++;
-        walletdb.WriteZerocoinMint(mint);
+        zerocoinTracker.Write(mint);
     }
 
     // Delete any mints that were unable to be located on the blockchain
     for (CZerocoinMint mint : vMintsMissing) {
         deletions++;
-        walletdb.ArchiveMintOrphan(mint);
+        zerocoinTracker.Archive(mint);
     }
 
     string strResult = _("ResetMintZerocoin finished: ") + to_string(updates) + _(" mints updated, ") + to_string(deletions) + _(" mints deleted\n");
@@ -4766,7 +5102,7 @@ string CWallet::ResetSpentZerocoin()
     long removed = 0;
     CWalletDB walletdb(pwalletMain->strWalletFile);
 
-    list<CZerocoinMint> listMints = walletdb.ListMintedCoins(false, false, false);
+    list<CZerocoinMint> listMints = zerocoinTracker.ListMints(false, false, false);
     list<CZerocoinSpend> listSpends = walletdb.ListSpentCoins();
     list<CZerocoinSpend> listUnconfirmedSpends;
 
@@ -4789,8 +5125,8 @@ string CWallet::ResetSpentZerocoin()
                 removed++;
                 mint.SetUsed(false);
                 RemoveSerialFromDB(spend.GetSerial());
-                walletdb.WriteZerocoinMint(mint);
-                walletdb.EraseZerocoinSpendSerialEntry(spend.GetSerial());
+                zerocoinTracker.Write(mint);
+                zerocoinTracker.EraseSpentSerial(spend.GetSerial());
                 continue;
             }
         }
@@ -4823,7 +5159,7 @@ void CWallet::ReconsiderZerocoins(std::list<CZerocoinMint>& listMintsRestored)
 
         mint.SetTxHash(txHash);
         mint.SetHeight(mapBlockIndex.at(hashBlock)->nHeight);
-        if (!walletdb.UnarchiveZerocoin(mint)) {
+        if (!zerocoinTracker.Unarchive(mint)) {
             LogPrintf("%s : failed to unarchive mint %s\n", __func__, mint.GetValue().GetHex());
         }
         listMintsRestored.emplace_back(mint);
@@ -4912,10 +5248,9 @@ string CWallet::MintZerocoin(CAmount nValue, CWalletTx& wtxNew, vector<CZerocoin
         return _("Error: The transaction was rejected! This might happen if some of the coins in your wallet were already spent, such as if you used a copy of wallet.dat and coins were spent in the copy but not marked as spent here.");
     } else {
         //update mints with full transaction hash and then database them
-        CWalletDB walletdb(pwalletMain->strWalletFile);
         for (CZerocoinMint mint : vMints) {
             mint.SetTxHash(wtxNew.GetHash());
-            walletdb.WriteZerocoinMint(mint);
+            zerocoinTracker.Write(mint);
             pwalletMain->NotifyZerocoinChanged(pwalletMain, mint.GetValue().GetHex(), "Used", CT_UPDATED);
         }
     }
@@ -4946,7 +5281,6 @@ bool CWallet::SpendZerocoin(CAmount nAmount, int nSecurityLevel, CWalletTx& wtxN
     if (fMintChange && fBackupMints)
         ZWgrBackupWallet();
 
-    CWalletDB walletdb(pwalletMain->strWalletFile);
     if (!CommitTransaction(wtxNew, reserveKey)) {
         LogPrintf("%s: failed to commit\n", __func__);
         nStatus = ZWGR_COMMIT_FAILED;
@@ -4954,13 +5288,13 @@ bool CWallet::SpendZerocoin(CAmount nAmount, int nSecurityLevel, CWalletTx& wtxN
         //reset all mints
         for (CZerocoinMint mint : vMintsSelected) {
             mint.SetUsed(false); // having error, so set to false, to be able to use again
-            walletdb.WriteZerocoinMint(mint);
+            zerocoinTracker.Write(mint);
             pwalletMain->NotifyZerocoinChanged(pwalletMain, mint.GetValue().GetHex(), "New", CT_UPDATED);
         }
 
         //erase spends
         for (CZerocoinSpend spend : receipt.GetSpends()) {
-            if (!walletdb.EraseZerocoinSpendSerialEntry(spend.GetSerial())) {
+            if (!zerocoinTracker.EraseSpentSerial(spend.GetSerial())) {
                 receipt.SetStatus("Error: It cannot delete coin serial number in wallet", ZWGR_ERASE_SPENDS_FAILED);
             }
 
@@ -4970,7 +5304,7 @@ bool CWallet::SpendZerocoin(CAmount nAmount, int nSecurityLevel, CWalletTx& wtxN
 
         // erase new mints
         for (auto& mint : vNewMints) {
-            if (!walletdb.EraseZerocoinMint(mint)) {
+            if (!zerocoinTracker.Erase(mint)) {
                 receipt.SetStatus("Error: Unable to cannot delete zerocoin mint in wallet", ZWGR_ERASE_NEW_MINTS_FAILED);
             }
         }
@@ -4981,13 +5315,13 @@ bool CWallet::SpendZerocoin(CAmount nAmount, int nSecurityLevel, CWalletTx& wtxN
 
     for (CZerocoinMint mint : vMintsSelected) {
         mint.SetUsed(true);
-        if (!walletdb.WriteZerocoinMint(mint)) {
+        if (!zerocoinTracker.Write(mint)) {
             receipt.SetStatus("Failed to write mint to db", nStatus);
             return false;
         }
 
         CZerocoinMint mintCheck;
-        if (!walletdb.ReadZerocoinMint(mint.GetValue(), mintCheck)) {
+        if (!zerocoinTracker.Get(mint.GetValue(), mintCheck)) {
             receipt.SetStatus("failed to read mintcheck", nStatus);
             return false;
         }
@@ -5001,7 +5335,7 @@ bool CWallet::SpendZerocoin(CAmount nAmount, int nSecurityLevel, CWalletTx& wtxN
     // write new Mints to db
     for (CZerocoinMint mint : vNewMints) {
         mint.SetTxHash(wtxNew.GetHash());
-        walletdb.WriteZerocoinMint(mint);
+        zerocoinTracker.Write(mint);
     }
 
     receipt.SetStatus("Spend Successful", ZWGR_SPEND_OKAY);  // When we reach this point spending zWGR was successful
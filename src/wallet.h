@@ -24,6 +24,7 @@
 #include "validationinterface.h"
 #include "wallet_ismine.h"
 #include "walletdb.h"
+#include "zerocointracker.h"
 
 #include <algorithm>
 #include <map>
@@ -44,6 +45,7 @@ extern bool bSpendZeroConfChange;
 extern bool bdisableSystemnotifications;
 extern bool fSendFreeTransactions;
 extern bool fPayAtLeastCustomFee;
+extern unsigned int nCoinSelectionTime;
 
 //! -paytxfee default
 static const CAmount DEFAULT_TRANSACTION_FEE = 0;
@@ -55,6 +57,8 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 1 * COIN;
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
+//! -coinselectiontime default (milliseconds)
+static const unsigned int DEFAULT_COIN_SELECTION_TIME = 100;
 
 // Zerocoin denomination which creates exactly one of each denominations:
 // 6666 = 1*5000 + 1*1000 + 1*500 + 1*100 + 1*50 + 1*10 + 1*5 + 1
@@ -106,6 +110,24 @@ enum ZerocoinSpendStatus {
     ZWGR_TX_TOO_LARGE = 15                          // The transaction is larger than the max tx size
 };
 
+// Balances of the wallet that are cached between changes
+enum WalletBalanceType {
+    BALANCE_AVAILABLE = 0,
+    BALANCE_UNCONFIRMED = 1,
+    BALANCE_IMMATURE = 2,
+    BALANCE_WATCHONLY = 3,
+    BALANCE_UNCONFIRMED_WATCHONLY = 4,
+    BALANCE_IMMATURE_WATCHONLY = 5,
+    BALANCE_LOCKED_WATCHONLY = 6,
+    BALANCE_UNLOCKED = 7,
+    BALANCE_LOCKED = 8,
+    BALANCE_ANONYMIZABLE = 9,
+    BALANCE_ANONYMIZED = 10,
+    BALANCE_DENOMINATED = 11,
+    BALANCE_DENOMINATED_UNCONFIRMED = 12,
+    BALANCE_TYPES = 13
+};
+
 struct CompactTallyItem {
     CBitcoinAddress address;
     CAmount nAmount;
@@ -164,8 +186,12 @@ private:
     bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl = NULL, AvailableCoinsType coin_type = ALL_COINS, bool useIX = true) const;
     //it was public bool SelectCoins(int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = true) const;
 
+    //! batch the key writes go to while the wallet is encrypted or its keypool is topped up
     CWalletDB* pwalletdbEncryption;
 
+    //! Add generated keys to the wallet and the end of the keypool, written in one transaction
+    bool AddKeysToPool(const std::vector<std::pair<CKey, CPubKey> >& vKeys);
+
     //! the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -187,6 +213,52 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Balances are cached until something they depend on changes: the wallet's transactions or
+     * locked coins (nBalanceEpoch, which also moves with every transaction of a connected or
+     * disconnected block, as each is passed to SyncTransaction), the mempool or the completed
+     * SwiftX locks. A cached balance is read under cs_wallet alone.
+     */
+    struct CBalanceCache {
+        bool fValid;
+        uint64_t nEpoch;
+        unsigned int nMempoolUpdated;
+        int nTXLocks;
+        CAmount nValue;
+    };
+    mutable CBalanceCache balanceCache[BALANCE_TYPES];
+    uint64_t nBalanceEpoch;
+
+    CAmount GetCachedBalance(WalletBalanceType type) const;
+    CAmount ComputeBalance(WalletBalanceType type) const;
+    void MarkBalancesDirty() { nBalanceEpoch++; }
+
+    /** Buckets of the wallet's outputs, by the kind of coin they hold */
+    enum OutputBucket {
+        OUTPUT_OTHER = 0,
+        OUTPUT_DENOMINATED = 1,
+        OUTPUT_COLLATERAL = 2,
+        OUTPUT_MASTERNODE = 3, // 25000 WGR
+        OUTPUT_BUCKETS = 4
+    };
+
+    /**
+     * Outputs of the wallet's transactions that are ours (not watch-only) and not spent by a
+     * transaction in the active chain, with how they are ours. AvailableCoins only looks at
+     * these. Outputs are added with their transaction and when a transaction spending them is
+     * synced (it may have left the chain); they are dropped once AvailableCoins finds them
+     * spent in the chain. The index is built on first use and rebuilt after MarkDirty, as
+     * importing keys changes which outputs are ours, and when the denominations change.
+     */
+    mutable std::map<COutPoint, isminetype> mapAvailableOutputs[OUTPUT_BUCKETS];
+    mutable bool fAvailableOutputsIndexed;
+    mutable unsigned int nAvailableOutputsDenominations;
+
+    OutputBucket GetOutputBucket(CAmount nValue) const;
+    void IndexAvailableOutput(const CWalletTx& wtx, unsigned int n) const;
+    void IndexAvailableOutputs() const;
+    bool IsSpentInMainChain(const uint256& hash, unsigned int n) const;
+
 public:
     bool MintableCoins();
     bool SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, CAmount nTargetAmount) const;
@@ -227,6 +299,8 @@ public:
     bool fWalletUnlockAnonymizeOnly;
     std::string strWalletFile;
     bool fBackupMints;
+    //! the wallet's zerocoin mints; has its own lock
+    mutable CZerocoinTracker zerocoinTracker;
 
     std::set<int64_t> setKeyPool;
     std::map<CKeyID, CKeyMetadata> mapKeyMetadata;
@@ -265,6 +339,7 @@ public:
 
         strWalletFile = strWalletFileIn;
         fFileBacked = true;
+        zerocoinTracker.SetWalletFile(strWalletFile);
     }
 
     ~CWallet()
@@ -285,6 +360,11 @@ public:
         nTimeFirstKey = 0;
         fWalletUnlockAnonymizeOnly = false;
         fBackupMints = false;
+        nBalanceEpoch = 0;
+        for (int i = 0; i < BALANCE_TYPES; i++)
+            balanceCache[i].fValid = false;
+        fAvailableOutputsIndexed = false;
+        nAvailableOutputsDenominations = 0;
 
         // Stake Settings
         nHashDrift = 45;
@@ -439,6 +519,8 @@ public:
 
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet = false);
+    //! Index the transactions CWalletDB::LoadWallet read into mapWallet, all at once
+    void LoadWalletTxs(const std::vector<uint256>& vHashes);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256& hash);
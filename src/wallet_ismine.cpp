@@ -38,6 +38,11 @@ isminetype IsMine(const CKeyStore& keystore, const CTxDestination& dest)
 
 isminetype IsMine(const CKeyStore& keystore, const CScript& scriptPubKey)
 {
+    // Most outputs are someone else's; rule out the common forms with one lookup
+    uint160 id;
+    if (GetScriptTemplateId(scriptPubKey, id) && !keystore.MayHaveTemplateId(id))
+        return ISMINE_NO;
+
     if(keystore.HaveWatchOnly(scriptPubKey))
         return ISMINE_WATCH_ONLY;
     if(keystore.HaveMultiSig(scriptPubKey))
@@ -16,6 +16,7 @@
 #include "utiltime.h"
 #include "wallet.h"
 
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
 #include <boost/scoped_ptr.hpp>
@@ -27,6 +28,11 @@ using namespace std;
 
 static uint64_t nAccountingEntryNumber = 0;
 
+/** Most threads that deserialize wallet transactions at load */
+static const unsigned int MAX_LOAD_THREADS = 8;
+/** Wallets with fewer transactions are loaded on the calling thread */
+static const unsigned int MIN_PARALLEL_LOAD_TXS = 1000;
+
 //
 // CWalletDB
 //
@@ -297,7 +303,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error("CWalletDB::ListAccountCreditDebit() : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -417,6 +423,34 @@ public:
     }
 };
 
+/** Deserialize and check a "tx" record; fUpgradeRet is set if it needs writing back in the current format */
+static bool ReadWalletTx(const uint256& hash, CDataStream& ssValue, CWalletTx& wtx, bool& fUpgradeRet, string& strErr)
+{
+    fUpgradeRet = false;
+    ssValue >> wtx;
+    CValidationState state;
+    // false because there is no reason to go through the zerocoin checks for our own wallet
+    if (!(CheckTransaction(wtx, false, false, state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    // Undo serialize changes in 31600
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703) {
+        if (!ssValue.empty()) {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        } else {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgradeRet = true;
+    }
+    return true;
+}
+
 bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CWalletScanState& wss, string& strType, string& strErr)
 {
     try {
@@ -436,27 +470,11 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CW
             uint256 hash;
             ssKey >> hash;
             CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            // false because there is no reason to go through the zerocoin checks for our own wallet
-            if (!(CheckTransaction(wtx, false, false, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgrade;
+            if (!ReadWalletTx(hash, ssValue, wtx, fUpgrade, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703) {
-                if (!ssValue.empty()) {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                        wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                } else {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
+            if (fUpgrade)
                 wss.vWalletUpgrade.push_back(hash);
-            }
 
             if (wtx.nOrderPos == -1)
                 wss.fAnyUnordered = true;
@@ -671,6 +689,59 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+/** Whether a serialized key is of a record of this type, without unserializing it */
+static bool IsRecordType(const CDataStream& ssKey, const char* pszType)
+{
+    size_t nLen = strlen(pszType);
+    return ssKey.size() > nLen && (unsigned char)ssKey[0] == nLen && memcmp(&ssKey[1], pszType, nLen) == 0;
+}
+
+/** A "tx" record read by LoadWallet, to be deserialized straight into its mapWallet entry */
+struct CWalletTxRecord {
+    uint256 hash;
+    CDataStream ssValue;
+    CWalletTx* pwtx;
+    bool fValid;
+    bool fUpgrade;
+    string strErr;
+
+    CWalletTxRecord(const uint256& hashIn, const CDataStream& ssValueIn)
+        : hash(hashIn), ssValue(ssValueIn), pwtx(NULL), fValid(false), fUpgrade(false) {}
+};
+
+static void ThreadReadWalletTxs(vector<CWalletTxRecord>* pvRecords, unsigned int nFirst, unsigned int nStep)
+{
+    for (unsigned int i = nFirst; i < pvRecords->size(); i += nStep) {
+        CWalletTxRecord& record = (*pvRecords)[i];
+        try {
+            record.fValid = ReadWalletTx(record.hash, record.ssValue, *record.pwtx, record.fUpgrade, record.strErr);
+        } catch (...) {
+            record.fValid = false;
+        }
+    }
+}
+
+/**
+ * Deserialize and check the transactions of a wallet. The records are split over up to
+ * MAX_LOAD_THREADS threads; each thread only writes its own records and the mapWallet
+ * entries they point to.
+ */
+static void ReadWalletTxs(vector<CWalletTxRecord>& vRecords)
+{
+    unsigned int nThreads = 1;
+    if (vRecords.size() >= MIN_PARALLEL_LOAD_TXS)
+        nThreads = std::max(1u, std::min(boost::thread::hardware_concurrency(), MAX_LOAD_THREADS));
+    if (nThreads == 1) {
+        ThreadReadWalletTxs(&vRecords, 0, 1);
+        return;
+    }
+
+    boost::thread_group threadGroup;
+    for (unsigned int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&ThreadReadWalletTxs, &vRecords, i, nThreads));
+    threadGroup.join_all();
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -688,12 +759,13 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor) {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
         }
 
+        vector<CWalletTxRecord> vTxRecords;
         while (true) {
             // Read next record
             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
@@ -706,6 +778,15 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 return DB_CORRUPT;
             }
 
+            // Transactions are set aside and deserialized together once the cursor is done
+            if (IsRecordType(ssKey, "tx")) {
+                string strType;
+                uint256 hash;
+                ssKey >> strType >> hash;
+                vTxRecords.push_back(CWalletTxRecord(hash, ssValue));
+                continue;
+            }
+
             // Try to be tolerant of single corrupt records:
             string strType, strErr;
             if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr)) {
@@ -725,6 +806,33 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 LogPrintf("%s\n", strErr);
         }
         pcursor->close();
+
+        // The transactions are deserialized into their own mapWallet entries, which the
+        // workers fill in while this thread waits
+        int64_t nStart = GetTimeMillis();
+        BOOST_FOREACH (CWalletTxRecord& record, vTxRecords)
+            record.pwtx = &pwallet->mapWallet[record.hash];
+        ReadWalletTxs(vTxRecords);
+        vector<uint256> vTxLoaded;
+        vTxLoaded.reserve(vTxRecords.size());
+        BOOST_FOREACH (const CWalletTxRecord& record, vTxRecords) {
+            if (!record.fValid) {
+                pwallet->mapWallet.erase(record.hash);
+                fNoncriticalErrors = true;
+                // Rescan if there is a bad transaction record:
+                SoftSetBoolArg("-rescan", true);
+            } else {
+                if (record.fUpgrade)
+                    wss.vWalletUpgrade.push_back(record.hash);
+                if (record.pwtx->nOrderPos == -1)
+                    wss.fAnyUnordered = true;
+                vTxLoaded.push_back(record.hash);
+            }
+            if (!record.strErr.empty())
+                LogPrintf("%s\n", record.strErr);
+        }
+        pwallet->LoadWalletTxs(vTxLoaded);
+        LogPrint("db", "Loaded %u wallet transactions in %dms\n", vTxLoaded.size(), GetTimeMillis() - nStart);
     } catch (boost::thread_interrupted) {
         throw;
     } catch (...) {
@@ -786,7 +894,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor) {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
@@ -871,6 +979,19 @@ void ThreadFlushWalletDB(const string& strFile)
         }
 
         if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2) {
+            CWalletLog* plog = walletlogs.Get(strFile);
+            if (plog) {
+                // A wallet log only needs syncing, and compacting once it has grown enough
+                boost::this_thread::interruption_point();
+                nLastFlushed = nWalletDBUpdated;
+                int64_t nStart = GetTimeMillis();
+                plog->Flush();
+                if (plog->NeedsCompaction())
+                    plog->Compact();
+                LogPrint("db", "Flushed %s %dms\n", plog->GetPath().filename().string(), GetTimeMillis() - nStart);
+                continue;
+            }
+
             TRY_LOCK(bitdb.cs_db, lockDb);
             if (lockDb) {
                 // Don't do this if any databases are in use
@@ -906,6 +1027,21 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
 {
     if (!wallet.fFileBacked)
         return false;
+
+    CWalletLog* plog = walletlogs.Get(wallet.strWalletFile);
+    if (plog) {
+        // A wallet log is backed up as a compacted copy of itself
+        filesystem::path pathDest(strDest);
+        if (filesystem::is_directory(pathDest))
+            pathDest /= plog->GetPath().filename();
+        if (!plog->Backup(pathDest)) {
+            LogPrintf("error copying %s to %s\n", plog->GetPath().filename().string(), pathDest.string());
+            return false;
+        }
+        LogPrintf("copied %s to %s\n", plog->GetPath().filename().string(), pathDest.string());
+        return true;
+    }
+
     while (true) {
         {
             LOCK(bitdb.cs_db);
@@ -1021,6 +1157,60 @@ bool CWalletDB::Recover(CDBEnv& dbenv, std::string filename)
     return CWalletDB::Recover(dbenv, filename, false);
 }
 
+bool CWalletDB::MigrateToLog(const std::string& strFile)
+{
+    LogPrintf("Migrating %s to a wallet log...\n", strFile);
+    int64_t nStart = GetTimeMillis();
+    std::vector<CWalletLogRecord> vRecords;
+    {
+        CWalletDB db(strFile, "r");
+        CDBCursor* pcursor = db.GetCursor();
+        if (!pcursor)
+            return error("%s : Error getting wallet database cursor", __func__);
+        while (true) {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
+            if (ret == DB_NOTFOUND)
+                break;
+            else if (ret != 0) {
+                pcursor->close();
+                return error("%s : Error reading %s", __func__, strFile);
+            }
+            vRecords.push_back(CWalletLogRecord(std::vector<unsigned char>(ssKey.begin(), ssKey.end()), std::vector<unsigned char>(ssValue.begin(), ssValue.end())));
+        }
+        pcursor->close();
+    }
+
+    // The log only appears once it is complete, so an interrupted migration is simply run again
+    if (!CWalletLog::Create(CWalletLogEnv::GetPath(strFile), vRecords))
+        return false;
+    LogPrintf("Migrated %u records of %s in %dms\n", vRecords.size(), strFile, GetTimeMillis() - nStart);
+
+    // Move the Berkeley DB file out of the way: it keeps every key as it is now, and encrypting
+    // the wallet later only rewrites the log
+    {
+        LOCK(bitdb.cs_db);
+        bitdb.CloseDb(strFile);
+        bitdb.CheckpointLSN(strFile);
+        bitdb.mapFileUseCount.erase(strFile);
+    }
+    if (!RenameOver(GetDataDir() / strFile, CWalletLogEnv::GetMigratedPath(strFile)))
+        return error("%s : Failed to move %s to %s", __func__, strFile, CWalletLogEnv::GetMigratedPath(strFile).string());
+    return true;
+}
+
+bool CWalletDB::GetPreLogFile(const std::string& strFile, boost::filesystem::path& pathRet)
+{
+    if (!walletlogs.Get(strFile))
+        return false;
+    pathRet = GetDataDir() / strFile;
+    if (boost::filesystem::exists(pathRet))
+        return true;
+    pathRet = CWalletLogEnv::GetMigratedPath(strFile);
+    return boost::filesystem::exists(pathRet);
+}
+
 bool CWalletDB::WriteDestData(const std::string& address, const std::string& key, const std::string& value)
 {
     nWalletDBUpdated++;
@@ -1109,15 +1299,13 @@ bool CWalletDB::UnarchiveZerocoin(const CZerocoinMint& mint)
     return WriteZerocoinMint(mint);
 }
 
-std::list<CZerocoinMint> CWalletDB::ListMintedCoins(bool fUnusedOnly, bool fMaturedOnly, bool fUpdateStatus)
+std::list<CZerocoinMint> CWalletDB::ListMintedCoins()
 {
     std::list<CZerocoinMint> listPubCoin;
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error(std::string(__func__)+" : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
-    vector<CZerocoinMint> vOverWrite;
-    vector<CZerocoinMint> vArchive;
     for (;;)
     {
         // Read next record
@@ -1146,101 +1334,17 @@ std::list<CZerocoinMint> CWalletDB::ListMintedCoins(bool fUnusedOnly, bool fMatu
 
         CZerocoinMint mint;
         ssValue >> mint;
-
-        if (fUnusedOnly) {
-            if (mint.IsUsed())
-                continue;
-
-            //double check that we have no record of this serial being used
-            if (ReadZerocoinSpendSerialEntry(mint.GetSerialNumber())) {
-                mint.SetUsed(true);
-                vOverWrite.emplace_back(mint);
-                continue;
-            }
-        }
-
-        if (fMaturedOnly || fUpdateStatus) {
-            //if there is not a record of the block height, then look it up and assign it
-            if (!mint.GetHeight()) {
-                CTransaction tx;
-                uint256 hashBlock;
-                if(!GetTransaction(mint.GetTxHash(), tx, hashBlock, true)) {
-                    LogPrintf("%s failed to find tx for mint txid=%s\n", __func__, mint.GetTxHash().GetHex());
-                    vArchive.emplace_back(mint);
-                    continue;
-                }
-
-                //if not in the block index, most likely is unconfirmed tx
-                if (mapBlockIndex.count(hashBlock)) {
-                    mint.SetHeight(mapBlockIndex[hashBlock]->nHeight);
-                    vOverWrite.emplace_back(mint);
-                } else if (fMaturedOnly){
-                    continue;
-                }
-            }
-
-            //not mature
-            if (mint.GetHeight() > chainActive.Height() - Params().Zerocoin_MintRequiredConfirmations()) {
-                if (!fMaturedOnly)
-                    listPubCoin.emplace_back(mint);
-                continue;
-            }
-
-            //if only requesting an update (fUpdateStatus) then skip the rest and add to list
-            if (fMaturedOnly) {
-                // check to make sure there are at least 3 other mints added to the accumulators after this
-                if (chainActive.Height() < mint.GetHeight() + 1)
-                    continue;
-
-                CBlockIndex *pindex = chainActive[mint.GetHeight() + 1];
-                int nMintsAdded = 0;
-                while(pindex->nHeight < chainActive.Height() - 30) { // 30 just to make sure that its at least 2 checkpoints from the top block
-                    nMintsAdded += count(pindex->vMintDenominationsInBlock.begin(), pindex->vMintDenominationsInBlock.end(), mint.GetDenomination());
-                    if(nMintsAdded >= Params().Zerocoin_RequiredAccumulation())
-                        break;
-                    pindex = chainActive[pindex->nHeight + 1];
-                }
-
-                if(nMintsAdded < Params().Zerocoin_RequiredAccumulation())
-                    continue;
-            }
-        }
         listPubCoin.emplace_back(mint);
     }
 
     pcursor->close();
-
-    //overwrite any updates
-    for (CZerocoinMint mint : vOverWrite) {
-        if(!this->WriteZerocoinMint(mint))
-            LogPrintf("%s failed to update mint from tx %s\n", __func__, mint.GetTxHash().GetHex());
-    }
-
-    // archive mints
-    for (CZerocoinMint mint : vArchive) {
-        if (!this->ArchiveMintOrphan(mint))
-            LogPrintf("%s failed to archive mint from %s\n", __func__, mint.GetTxHash().GetHex());
-    }
-
-    return listPubCoin;
-}
-// Just get the Serial Numbers
-std::list<CBigNum> CWalletDB::ListMintedCoinsSerial()
-{
-    std::list<CBigNum> listPubCoin;
-    std::list<CZerocoinMint> listCoins = ListMintedCoins(true, false, false);
-    
-    for ( auto& coin : listCoins) {
-        listPubCoin.push_back(coin.GetSerialNumber());
-    }
     return listPubCoin;
 }
 
-
 std::list<CZerocoinSpend> CWalletDB::ListSpentCoins()
 {
     std::list<CZerocoinSpend> listCoinSpend;
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error(std::string(__func__)+" : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -1295,7 +1399,7 @@ std::list<CBigNum> CWalletDB::ListSpentCoinsSerial()
 std::list<CZerocoinMint> CWalletDB::ListArchivedZerocoins()
 {
     std::list<CZerocoinMint> listMints;
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error(std::string(__func__)+" : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
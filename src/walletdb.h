@@ -151,15 +151,19 @@ public:
     DBErrors ZapWalletTx(CWallet* pwallet, std::vector<CWalletTx>& vWtx);
     static bool Recover(CDBEnv& dbenv, std::string filename, bool fOnlyKeys);
     static bool Recover(CDBEnv& dbenv, std::string filename);
+    /** Copy all records of a Berkeley DB wallet file into a new wallet log, then move the file to <file>.migrated */
+    static bool MigrateToLog(const std::string& strFile);
+    /** The Berkeley DB file of a wallet kept in a log, if one is still around; it holds the keys as they were before the migration */
+    static bool GetPreLogFile(const std::string& strFile, boost::filesystem::path& pathRet);
 
     bool WriteZerocoinMint(const CZerocoinMint& zerocoinMint);
     bool EraseZerocoinMint(const CZerocoinMint& zerocoinMint);
     bool ReadZerocoinMint(const CBigNum &bnSerial, CZerocoinMint& zerocoinMint);
     bool ArchiveMintOrphan(const CZerocoinMint& zerocoinMint);
     bool UnarchiveZerocoin(const CZerocoinMint& mint);
-    std::list<CZerocoinMint> ListMintedCoins(bool fUnusedOnly, bool fMaturedOnly, bool fUpdateStatus);
+    /// All unarchived mints; the wallet reads them once into its CZerocoinTracker
+    std::list<CZerocoinMint> ListMintedCoins();
     std::list<CZerocoinSpend> ListSpentCoins();
-    std::list<CBigNum> ListMintedCoinsSerial();
     std::list<CBigNum> ListSpentCoinsSerial();
     std::list<CZerocoinMint> ListArchivedZerocoins();
     bool WriteZerocoinSpendSerialEntry(const CZerocoinSpend& zerocoinSpend);
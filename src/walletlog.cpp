@@ -0,0 +1,435 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletlog.h"
+
+#include "clientversion.h"
+#include "hash.h"
+#include "serialize.h"
+#include "streams.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+CWalletLogEnv walletlogs;
+
+static const char pchWalletLogMagic[8] = {'W', 'G', 'R', 'W', 'L', 'O', 'G', '\0'};
+static const size_t WALLETLOG_HEADER_SIZE = sizeof(pchWalletLogMagic) + 4;
+
+// record flags
+static const unsigned char RECORD_WRITE = 0x01;
+static const unsigned char RECORD_ERASE = 0x02;
+static const unsigned char RECORD_MORE = 0x80; // more records of the batch follow
+
+static uint64_t GetRecordSize(const vector<unsigned char>& vchKey, const vector<unsigned char>* pvchValue)
+{
+    uint64_t nSize = 1 + GetSizeOfCompactSize(vchKey.size()) + vchKey.size() + 4;
+    if (pvchValue)
+        nSize += GetSizeOfCompactSize(pvchValue->size()) + pvchValue->size();
+    return nSize;
+}
+
+static void SerializeBatch(CDataStream& ss, const vector<CWalletLogRecord>& vRecords)
+{
+    for (unsigned int i = 0; i < vRecords.size(); i++) {
+        const CWalletLogRecord& record = vRecords[i];
+        size_t nStart = ss.size();
+        unsigned char nFlags = record.fErase ? RECORD_ERASE : RECORD_WRITE;
+        if (i + 1 < vRecords.size())
+            nFlags |= RECORD_MORE;
+        ss << nFlags << record.vchKey;
+        if (!record.fErase)
+            ss << record.vchValue;
+        uint256 hash = Hash(ss.begin() + nStart, ss.end());
+        ss.write((const char*)&hash, 4);
+    }
+}
+
+static bool ReadLength(const vector<unsigned char>& vch, size_t& nPos, uint64_t& nRet)
+{
+    if (nPos >= vch.size())
+        return false;
+    unsigned char chSize = vch[nPos++];
+    unsigned int nBytes = chSize < 253 ? 0 : chSize == 253 ? 2 : chSize == 254 ? 4 : 8;
+    if (vch.size() - nPos < nBytes)
+        return false;
+    nRet = chSize < 253 ? chSize : 0;
+    for (unsigned int i = 0; i < nBytes; i++)
+        nRet |= (uint64_t)vch[nPos++] << (8 * i);
+    return true;
+}
+
+static bool ReadBytes(const vector<unsigned char>& vch, size_t& nPos, vector<unsigned char>& vchRet)
+{
+    uint64_t nSize;
+    if (!ReadLength(vch, nPos, nSize) || nSize > vch.size() - nPos)
+        return false;
+    vchRet.assign(vch.begin() + nPos, vch.begin() + nPos + nSize);
+    nPos += nSize;
+    return true;
+}
+
+/** Read the record at nPos, advancing nPos past it; false if it is incomplete or fails its checksum */
+static bool ReadRecord(const vector<unsigned char>& vch, size_t& nPos, CWalletLogRecord& recordRet, unsigned char& nFlagsRet)
+{
+    size_t nStart = nPos;
+    if (nPos >= vch.size())
+        return false;
+    nFlagsRet = vch[nPos++];
+    recordRet.fErase = (nFlagsRet & RECORD_ERASE) != 0;
+    if (!ReadBytes(vch, nPos, recordRet.vchKey))
+        return false;
+    if (!recordRet.fErase && !ReadBytes(vch, nPos, recordRet.vchValue))
+        return false;
+    if (vch.size() - nPos < 4)
+        return false;
+    uint256 hash = Hash(vch.begin() + nStart, vch.begin() + nPos);
+    if (memcmp(&vch[nPos], &hash, 4) != 0)
+        return false;
+    nPos += 4;
+    return true;
+}
+
+/** Whether a complete, intact record starts anywhere at or after nFrom */
+static bool FindRecord(const vector<unsigned char>& vch, size_t nFrom)
+{
+    for (size_t nStart = nFrom; nStart < vch.size(); nStart++) {
+        unsigned char nFlags = vch[nStart] & ~RECORD_MORE;
+        if (nFlags != RECORD_WRITE && nFlags != RECORD_ERASE)
+            continue;
+        size_t nPos = nStart;
+        CWalletLogRecord record;
+        if (ReadRecord(vch, nPos, record, nFlags))
+            return true;
+    }
+    return false;
+}
+
+CWalletLog::CWalletLog() : file(NULL), nFileSize(0), nLiveSize(0), fDirty(false)
+{
+}
+
+CWalletLog::~CWalletLog()
+{
+    Close();
+}
+
+bool CWalletLog::Create(const boost::filesystem::path& pathNew, const vector<CWalletLogRecord>& vRecords)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss.write(pchWalletLogMagic, sizeof(pchWalletLogMagic));
+    ss << WALLETLOG_VERSION;
+    SerializeBatch(ss, vRecords);
+
+    boost::filesystem::path pathTmp = pathNew;
+    pathTmp += ".new";
+    FILE* fileNew = fopen(pathTmp.string().c_str(), "wb");
+    if (!fileNew)
+        return error("%s : Failed to open %s", __func__, pathTmp.string());
+    bool fSuccess = ss.empty() || fwrite(&ss[0], 1, ss.size(), fileNew) == ss.size();
+    if (fSuccess)
+        FileCommit(fileNew);
+    fclose(fileNew);
+    if (!fSuccess || !RenameOver(pathTmp, pathNew)) {
+        boost::filesystem::remove(pathTmp);
+        return error("%s : Failed to write %s", __func__, pathNew.string());
+    }
+    return true;
+}
+
+void CWalletLog::Apply(const CWalletLogRecord& record)
+{
+    RecordMap::iterator it = mapRecords.find(record.vchKey);
+    if (it != mapRecords.end()) {
+        nLiveSize -= GetRecordSize(it->first, &it->second);
+        if (record.fErase)
+            mapRecords.erase(it);
+    }
+    if (!record.fErase) {
+        mapRecords[record.vchKey] = record.vchValue;
+        nLiveSize += GetRecordSize(record.vchKey, &record.vchValue);
+    }
+}
+
+bool CWalletLog::Replay()
+{
+    vector<unsigned char> vchLog;
+    if (fseek(file, 0, SEEK_END) != 0)
+        return error("%s : Failed to read %s", __func__, path.string());
+    long nSize = ftell(file);
+    if (nSize < 0 || fseek(file, 0, SEEK_SET) != 0)
+        return error("%s : Failed to read %s", __func__, path.string());
+    vchLog.resize(nSize);
+    if (nSize > 0 && fread(&vchLog[0], 1, nSize, file) != (size_t)nSize)
+        return error("%s : Failed to read %s", __func__, path.string());
+
+    if (vchLog.size() < WALLETLOG_HEADER_SIZE || memcmp(&vchLog[0], pchWalletLogMagic, sizeof(pchWalletLogMagic)) != 0)
+        return error("%s : %s is not a wallet log", __func__, path.string());
+    int nVersion = 0;
+    for (unsigned int i = 0; i < 4; i++)
+        nVersion |= (int)vchLog[sizeof(pchWalletLogMagic) + i] << (8 * i);
+    if (nVersion > WALLETLOG_VERSION)
+        return error("%s : %s has unsupported version %d", __func__, path.string(), nVersion);
+
+    size_t nPos = WALLETLOG_HEADER_SIZE;
+    size_t nGoodEnd = nPos;
+    vector<CWalletLogRecord> vBatch;
+    while (nPos < vchLog.size()) {
+        size_t nStart = nPos;
+        unsigned char nFlags;
+        CWalletLogRecord record;
+        if (!ReadRecord(vchLog, nPos, record, nFlags)) {
+            // A crash during an append leaves a torn batch at the end and nothing after it. Intact
+            // records past the damage mean the log itself is corrupt: truncating it would throw
+            // away everything written since, so leave the file as it is for recovery.
+            if (FindRecord(vchLog, nStart + 1))
+                return error("%s : %s is corrupt at offset %u, with intact records after it. The file was left unchanged; restore the wallet from a backup", __func__, path.string(), nStart);
+            break;
+        }
+
+        vBatch.push_back(record);
+        if (!(nFlags & RECORD_MORE)) {
+            BOOST_FOREACH (const CWalletLogRecord& recordBatch, vBatch)
+                Apply(recordBatch);
+            vBatch.clear();
+            nGoodEnd = nPos;
+        }
+    }
+
+    if (nGoodEnd < vchLog.size()) {
+        LogPrintf("%s : Dropping %u bytes of an incomplete batch at the end of %s\n", __func__, vchLog.size() - nGoodEnd, path.string());
+        if (!TruncateFile(file, nGoodEnd))
+            return error("%s : Failed to truncate %s", __func__, path.string());
+    }
+    nFileSize = nGoodEnd;
+    return fseek(file, nGoodEnd, SEEK_SET) == 0;
+}
+
+bool CWalletLog::Open(const boost::filesystem::path& pathIn, bool fCreate)
+{
+    LOCK(cs);
+    if (file)
+        return false;
+    path = pathIn;
+    if (!boost::filesystem::exists(path)) {
+        if (!fCreate)
+            return false;
+        if (!Create(path, vector<CWalletLogRecord>()))
+            return false;
+    }
+
+    file = fopen(path.string().c_str(), "rb+");
+    if (!file)
+        return error("%s : Failed to open %s", __func__, path.string());
+    mapRecords.clear();
+    nLiveSize = 0;
+    if (!Replay()) {
+        fclose(file);
+        file = NULL;
+        mapRecords.clear();
+        return false;
+    }
+    LogPrint("db", "%s : Loaded %u records from %s\n", __func__, mapRecords.size(), path.string());
+    return true;
+}
+
+void CWalletLog::Close()
+{
+    LOCK(cs);
+    if (!file)
+        return;
+    if (fDirty)
+        FileCommit(file);
+    fclose(file);
+    file = NULL;
+    fDirty = false;
+}
+
+bool CWalletLog::Read(const vector<unsigned char>& vchKey, vector<unsigned char>& vchValueRet) const
+{
+    LOCK(cs);
+    RecordMap::const_iterator it = mapRecords.find(vchKey);
+    if (it == mapRecords.end())
+        return false;
+    vchValueRet = it->second;
+    return true;
+}
+
+bool CWalletLog::Exists(const vector<unsigned char>& vchKey) const
+{
+    LOCK(cs);
+    return mapRecords.count(vchKey) > 0;
+}
+
+bool CWalletLog::Write(const vector<CWalletLogRecord>& vRecords)
+{
+    if (vRecords.empty())
+        return true;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    SerializeBatch(ss, vRecords);
+
+    LOCK(cs);
+    if (!file)
+        return false;
+    if (fwrite(&ss[0], 1, ss.size(), file) != ss.size() || fflush(file) != 0) {
+        // cut off whatever part of the batch made it, so later appends follow a complete batch
+        TruncateFile(file, nFileSize);
+        fseek(file, nFileSize, SEEK_SET);
+        return error("%s : Failed to append to %s", __func__, path.string());
+    }
+    nFileSize += ss.size();
+    fDirty = true;
+    BOOST_FOREACH (const CWalletLogRecord& record, vRecords)
+        Apply(record);
+    return true;
+}
+
+bool CWalletLog::Seek(const vector<unsigned char>& vchKey, bool fAfter, vector<unsigned char>& vchKeyRet, vector<unsigned char>& vchValueRet) const
+{
+    LOCK(cs);
+    RecordMap::const_iterator it = fAfter ? mapRecords.upper_bound(vchKey) : mapRecords.lower_bound(vchKey);
+    if (it == mapRecords.end())
+        return false;
+    vchKeyRet = it->first;
+    vchValueRet = it->second;
+    return true;
+}
+
+bool CWalletLog::Flush()
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+    if (fDirty) {
+        FileCommit(file);
+        fDirty = false;
+    }
+    return true;
+}
+
+bool CWalletLog::NeedsCompaction() const
+{
+    LOCK(cs);
+    return file && nFileSize > WALLETLOG_MIN_COMPACT_SIZE && nFileSize > 2 * (nLiveSize + WALLETLOG_HEADER_SIZE);
+}
+
+bool CWalletLog::Compact(const char* pszSkip)
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+    int64_t nStart = GetTimeMillis();
+    uint64_t nSizeBefore = nFileSize;
+
+    size_t nSkip = pszSkip ? strlen(pszSkip) : 0;
+    vector<CWalletLogRecord> vRecords;
+    vRecords.reserve(mapRecords.size());
+    for (RecordMap::const_iterator it = mapRecords.begin(); it != mapRecords.end(); ++it) {
+        if (pszSkip && memcmp(&it->first[0], pszSkip, min(it->first.size(), nSkip)) == 0)
+            continue;
+        vRecords.push_back(CWalletLogRecord(it->first, it->second));
+    }
+
+    boost::filesystem::path pathCompact = path;
+    pathCompact += ".compact";
+    if (!Create(pathCompact, vRecords))
+        return false;
+    fclose(file);
+    file = NULL;
+    fDirty = false;
+    if (!RenameOver(pathCompact, path)) {
+        boost::filesystem::remove(pathCompact);
+        LogPrintf("%s : Failed to replace %s\n", __func__, path.string());
+    }
+
+    // reopen whichever log is in place now
+    file = fopen(path.string().c_str(), "rb+");
+    if (!file)
+        return error("%s : Failed to reopen %s", __func__, path.string());
+    mapRecords.clear();
+    nLiveSize = 0;
+    if (!Replay()) {
+        fclose(file);
+        file = NULL;
+        return false;
+    }
+    LogPrint("db", "%s : Compacted %s from %u to %u bytes in %dms\n", __func__, path.string(), nSizeBefore, nFileSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CWalletLog::Backup(const boost::filesystem::path& pathDest) const
+{
+    vector<CWalletLogRecord> vRecords;
+    {
+        LOCK(cs);
+        vRecords.reserve(mapRecords.size());
+        for (RecordMap::const_iterator it = mapRecords.begin(); it != mapRecords.end(); ++it)
+            vRecords.push_back(CWalletLogRecord(it->first, it->second));
+    }
+    return Create(pathDest, vRecords);
+}
+
+size_t CWalletLog::GetCount() const
+{
+    LOCK(cs);
+    return mapRecords.size();
+}
+
+
+CWalletLogEnv::~CWalletLogEnv()
+{
+    for (map<string, CWalletLog*>::iterator it = mapLogs.begin(); it != mapLogs.end(); ++it)
+        delete it->second;
+    mapLogs.clear();
+}
+
+boost::filesystem::path CWalletLogEnv::GetPath(const string& strFile)
+{
+    return GetDataDir() / (strFile + ".log");
+}
+
+boost::filesystem::path CWalletLogEnv::GetMigratedPath(const string& strFile)
+{
+    return GetDataDir() / (strFile + ".migrated");
+}
+
+bool CWalletLogEnv::Open(const string& strFile, bool fCreate)
+{
+    LOCK(cs);
+    if (mapLogs.count(strFile))
+        return true;
+    CWalletLog* plog = new CWalletLog();
+    if (!plog->Open(GetPath(strFile), fCreate)) {
+        delete plog;
+        return false;
+    }
+    mapLogs[strFile] = plog;
+    return true;
+}
+
+CWalletLog* CWalletLogEnv::Get(const string& strFile)
+{
+    LOCK(cs);
+    map<string, CWalletLog*>::iterator it = mapLogs.find(strFile);
+    return it == mapLogs.end() ? NULL : it->second;
+}
+
+void CWalletLogEnv::Flush(bool fShutdown)
+{
+    LOCK(cs);
+    for (map<string, CWalletLog*>::iterator it = mapLogs.begin(); it != mapLogs.end(); ++it) {
+        CWalletLog* plog = it->second;
+        LogPrint("db", "CWalletLogEnv::Flush : Flushing %s\n", it->first);
+        plog->Flush();
+        if (plog->NeedsCompaction())
+            plog->Compact();
+        if (fShutdown)
+            plog->Close();
+    }
+}
@@ -0,0 +1,129 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLETLOG_H
+#define BITCOIN_WALLETLOG_H
+
+#include "sync.h"
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+/**
+ * A wallet file kept as an append-only log of records instead of a Berkeley DB file.
+ *
+ * The log holds the same (key, value) records CDB writes, serialized the same way. After
+ * a header every change is appended as one record: a flags byte, the key and the value
+ * (none for an erase), each with a CompactSize length, and a checksum over all of it.
+ * Records written together in one transaction form a batch; every record but the last
+ * of a batch has the continuation flag set, so a batch is replayed entirely or not at all.
+ *
+ * When the log is opened it is replayed into an in-memory map, which serves all reads
+ * afterwards. A torn or corrupt tail, left behind by a crash during an append, is cut off.
+ * Once the log has grown well beyond its live records it is compacted: the live records
+ * are written to a new file, which then replaces the log.
+ */
+
+/** Version of the wallet log format */
+static const int WALLETLOG_VERSION = 1;
+
+/** Logs are not compacted below this size */
+static const uint64_t WALLETLOG_MIN_COMPACT_SIZE = 1 << 20;
+
+/** A change to a wallet log: a key and its new value, or the erasure of the key */
+struct CWalletLogRecord {
+    std::vector<unsigned char> vchKey;
+    std::vector<unsigned char> vchValue;
+    bool fErase;
+
+    CWalletLogRecord() : fErase(false) {}
+    CWalletLogRecord(const std::vector<unsigned char>& vchKeyIn, const std::vector<unsigned char>& vchValueIn)
+        : vchKey(vchKeyIn), vchValue(vchValueIn), fErase(false) {}
+    explicit CWalletLogRecord(const std::vector<unsigned char>& vchKeyIn) : vchKey(vchKeyIn), fErase(true) {}
+};
+
+class CWalletLog
+{
+public:
+    typedef std::map<std::vector<unsigned char>, std::vector<unsigned char> > RecordMap;
+
+private:
+    mutable CCriticalSection cs;
+    boost::filesystem::path path;
+    FILE* file;
+    RecordMap mapRecords;
+    // bytes in the log file, and bytes the live records take when written out again
+    uint64_t nFileSize;
+    uint64_t nLiveSize;
+    // records appended since the log was last flushed to disk
+    bool fDirty;
+
+    void Apply(const CWalletLogRecord& record);
+    bool Replay();
+
+public:
+    CWalletLog();
+    ~CWalletLog();
+
+    /** Write a new log at pathNew holding these records, replacing any file there */
+    static bool Create(const boost::filesystem::path& pathNew, const std::vector<CWalletLogRecord>& vRecords);
+
+    /** Open and replay the log, creating it if it is missing and fCreate is set */
+    bool Open(const boost::filesystem::path& pathIn, bool fCreate);
+    void Close();
+
+    bool Read(const std::vector<unsigned char>& vchKey, std::vector<unsigned char>& vchValueRet) const;
+    bool Exists(const std::vector<unsigned char>& vchKey) const;
+    /** Append a batch of changes, which all take effect or none do */
+    bool Write(const std::vector<CWalletLogRecord>& vRecords);
+
+    /**
+     * The first record at or after vchKey, or strictly after it if fAfter is set. Records
+     * are ordered by their serialized keys, as in Berkeley DB.
+     */
+    bool Seek(const std::vector<unsigned char>& vchKey, bool fAfter, std::vector<unsigned char>& vchKeyRet, std::vector<unsigned char>& vchValueRet) const;
+
+    /** Sync appended records to disk */
+    bool Flush();
+    /** Whether most of the log consists of overwritten and erased records */
+    bool NeedsCompaction() const;
+    /** Replace the log by one holding only its live records, leaving out keys starting with pszSkip */
+    bool Compact(const char* pszSkip = NULL);
+    /** Write the live records as a new log at pathDest */
+    bool Backup(const boost::filesystem::path& pathDest) const;
+
+    const boost::filesystem::path& GetPath() const { return path; }
+    size_t GetCount() const;
+};
+
+/** The open wallet logs, by wallet file name */
+class CWalletLogEnv
+{
+private:
+    CCriticalSection cs;
+    std::map<std::string, CWalletLog*> mapLogs;
+
+public:
+    ~CWalletLogEnv();
+
+    /** Path of the log of a wallet file in the data directory */
+    static boost::filesystem::path GetPath(const std::string& strFile);
+    /** Where a wallet file is moved once it has been migrated to its log */
+    static boost::filesystem::path GetMigratedPath(const std::string& strFile);
+
+    bool Open(const std::string& strFile, bool fCreate);
+    /** The log of a wallet file, or NULL if the wallet is kept in Berkeley DB */
+    CWalletLog* Get(const std::string& strFile);
+    /** Sync all logs, compacting those that need it; on shutdown also close them */
+    void Flush(bool fShutdown);
+};
+
+extern CWalletLogEnv walletlogs;
+
+#endif // BITCOIN_WALLETLOG_H
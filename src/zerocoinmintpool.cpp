@@ -0,0 +1,144 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "zerocoinmintpool.h"
+
+#include "chainparams.h"
+#include "libzerocoin/Coin.h"
+#include "primitives/zerocoin.h"
+#include "util.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+
+CZerocoinMintPool zerocoinMintPool;
+
+CZerocoinMintPool::CZerocoinMintPool() : nTargetSize(0), nGenerating(0), fStop(false)
+{
+}
+
+CZerocoinMintPool::~CZerocoinMintPool()
+{
+    Stop();
+}
+
+void CZerocoinMintPool::Generate(CMintSecret& secret)
+{
+    // the denomination is only attached to the public coin, the search is the same for all
+    libzerocoin::PrivateCoin coin(Params().Zerocoin_Params(), libzerocoin::ZQ_ONE);
+    secret.bnValue = coin.getPublicCoin().getValue();
+    secret.bnRandomness = coin.getRandomness();
+    secret.bnSerial = coin.getSerialNumber();
+}
+
+void CZerocoinMintPool::ThreadRefill()
+{
+    RenameThread("wagerr-zeromint");
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && queSecrets.size() + nGenerating >= nTargetSize)
+                condRefill.wait(lock);
+            if (fStop)
+                return;
+            nGenerating++;
+        }
+
+        CMintSecret secret;
+        bool fGenerated = true;
+        try {
+            Generate(secret);
+        } catch (const std::exception& e) {
+            LogPrintf("CZerocoinMintPool::ThreadRefill() : %s\n", e.what());
+            fGenerated = false;
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nGenerating--;
+        if (fGenerated)
+            queSecrets.push_back(secret);
+    }
+}
+
+void CZerocoinMintPool::Start(unsigned int nSize)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nTargetSize = nSize;
+    fStop = false;
+    if (nTargetSize == 0 || threadGroup.size() > 0)
+        return;
+
+    unsigned int nThreads = std::max(1u, std::min(boost::thread::hardware_concurrency() / 2, MAX_ZEROMINT_THREADS));
+    for (unsigned int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CZerocoinMintPool::ThreadRefill, this));
+    LogPrint("zero", "CZerocoinMintPool : keeping %u mint secrets ready on %u threads\n", nTargetSize, nThreads);
+}
+
+void CZerocoinMintPool::Stop()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        condRefill.notify_all();
+    }
+    // a thread in the middle of a search finishes it first
+    threadGroup.join_all();
+}
+
+static void ThreadGenerateSecrets(std::vector<CZerocoinMintPool::CMintSecret>* pvSecrets, std::vector<bool>* pvGenerated, unsigned int nFirst, unsigned int nStep)
+{
+    for (unsigned int i = nFirst; i < pvSecrets->size(); i += nStep) {
+        try {
+            CZerocoinMintPool::Generate((*pvSecrets)[i]);
+            (*pvGenerated)[i] = true;
+        } catch (const std::exception& e) {
+            LogPrintf("CZerocoinMintPool::Mint() : %s\n", e.what());
+        }
+    }
+}
+
+void CZerocoinMintPool::Mint(const std::vector<libzerocoin::CoinDenomination>& vDenoms, std::vector<CZerocoinMint>& vMintsRet)
+{
+    std::vector<CMintSecret> vSecrets;
+    vSecrets.reserve(vDenoms.size());
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (vSecrets.size() < vDenoms.size() && !queSecrets.empty()) {
+            vSecrets.push_back(queSecrets.front());
+            queSecrets.pop_front();
+        }
+        condRefill.notify_all();
+    }
+    LogPrint("zero", "CZerocoinMintPool::Mint() : %u of %u mint secrets taken from the pool\n", vSecrets.size(), vDenoms.size());
+
+    if (vSecrets.size() < vDenoms.size()) {
+        std::vector<CMintSecret> vNew(vDenoms.size() - vSecrets.size());
+        std::vector<bool> vGenerated(vNew.size(), false);
+        unsigned int nThreads = std::min((unsigned int)vNew.size(), std::max(1u, std::min(boost::thread::hardware_concurrency(), MAX_ZEROMINT_THREADS)));
+        if (nThreads == 1) {
+            ThreadGenerateSecrets(&vNew, &vGenerated, 0, 1);
+        } else {
+            boost::thread_group threadGroupMint;
+            for (unsigned int i = 0; i < nThreads; i++)
+                threadGroupMint.create_thread(boost::bind(&ThreadGenerateSecrets, &vNew, &vGenerated, i, nThreads));
+            threadGroupMint.join_all();
+        }
+        if (std::count(vGenerated.begin(), vGenerated.end(), false) > 0)
+            throw std::runtime_error("Unable to mint a new Zerocoin (too many attempts)");
+        vSecrets.insert(vSecrets.end(), vNew.begin(), vNew.end());
+    }
+
+    for (unsigned int i = 0; i < vDenoms.size(); i++)
+        vMintsRet.push_back(CZerocoinMint(vDenoms[i], vSecrets[i].bnValue, vSecrets[i].bnRandomness, vSecrets[i].bnSerial, false));
+}
+
+size_t CZerocoinMintPool::GetReadyCount()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return queSecrets.size();
+}
@@ -0,0 +1,82 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ZEROCOINMINTPOOL_H
+#define BITCOIN_ZEROCOINMINTPOOL_H
+
+#include "libzerocoin/Denominations.h"
+#include "libzerocoin/bignum.h"
+
+#include <deque>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+class CZerocoinMint;
+
+/** -zeromintpool default: mint secrets kept pregenerated */
+static const unsigned int DEFAULT_ZEROMINT_POOL_SIZE = 10;
+/** Most threads generating mint secrets, for the pool or for one batch of mints */
+static const unsigned int MAX_ZEROMINT_THREADS = 4;
+
+/**
+ * Pregenerated zerocoin mint secrets.
+ *
+ * Minting a coin means searching for a serial number whose Pedersen commitment is a prime
+ * in the accumulator's range, which takes many modular exponentiations and primality
+ * tests. The result does not depend on the denomination, so background threads at the
+ * lowest priority keep a pool of them ready, and a mint only has to take one and attach
+ * its denomination. Whatever a batch of mints needs beyond the pool is generated on
+ * parallel threads.
+ *
+ * The pool is held in memory only. A secret reaches the wallet database once it is used
+ * for a mint, and then it is stored like any other mint.
+ */
+class CZerocoinMintPool
+{
+public:
+    /** A prime commitment value, and the randomness and serial number it commits to */
+    struct CMintSecret {
+        CBigNum bnValue;
+        CBigNum bnRandomness;
+        CBigNum bnSerial;
+    };
+
+private:
+    boost::mutex mutex;
+    boost::condition_variable condRefill;
+    std::deque<CMintSecret> queSecrets;
+    unsigned int nTargetSize;
+    // secrets being generated for the pool right now
+    unsigned int nGenerating;
+    bool fStop;
+    boost::thread_group threadGroup;
+
+    void ThreadRefill();
+
+public:
+    CZerocoinMintPool();
+    ~CZerocoinMintPool();
+
+    /** Generate one secret; throws if no prime commitment turned up */
+    static void Generate(CMintSecret& secret);
+
+    /** Start keeping nSize secrets ready */
+    void Start(unsigned int nSize);
+    void Stop();
+
+    /**
+     * New mints of these denominations, with secrets from the pool first. The rest are
+     * generated before this returns; throws if any of them fails.
+     */
+    void Mint(const std::vector<libzerocoin::CoinDenomination>& vDenoms, std::vector<CZerocoinMint>& vMintsRet);
+
+    size_t GetReadyCount();
+};
+
+extern CZerocoinMintPool zerocoinMintPool;
+
+#endif // BITCOIN_ZEROCOINMINTPOOL_H
@@ -0,0 +1,375 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "zerocointracker.h"
+
+#include "chainparams.h"
+#include "hash.h"
+#include "main.h"
+#include "util.h"
+#include "walletdb.h"
+
+#include <algorithm>
+#include <vector>
+
+CZerocoinTracker::CZerocoinTracker() : fLoaded(false), pindexState(NULL), fStateDirty(false)
+{
+}
+
+uint256 CZerocoinTracker::GetPubCoinHash(const CBigNum& bnPubCoinValue)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << bnPubCoinValue;
+    return Hash(ss.begin(), ss.end());
+}
+
+void CZerocoinTracker::SetWalletFile(const std::string& strWalletFileIn)
+{
+    LOCK(cs);
+    strWalletFile = strWalletFileIn;
+    fLoaded = false;
+}
+
+// requires LOCK(cs)
+void CZerocoinTracker::Load()
+{
+    if (fLoaded)
+        return;
+    fLoaded = true;
+
+    mapMints.clear();
+    mapSerials.clear();
+    setSpentSerials.clear();
+    mapUnused.clear();
+    for (int i = 0; i < MINT_STATES; i++)
+        mapCounts[i].clear();
+    pindexState = NULL;
+    fStateDirty = true;
+    if (strWalletFile.empty())
+        return;
+
+    CWalletDB walletdb(strWalletFile);
+    std::list<CBigNum> listSpentSerials = walletdb.ListSpentCoinsSerial();
+    setSpentSerials.insert(listSpentSerials.begin(), listSpentSerials.end());
+
+    std::list<CZerocoinMint> listMints = walletdb.ListMintedCoins();
+    for (CZerocoinMint& mint : listMints) {
+        //double check that we have no record of this serial being used
+        if (!mint.IsUsed() && setSpentSerials.count(mint.GetSerialNumber())) {
+            mint.SetUsed(true);
+            if (!walletdb.WriteZerocoinMint(mint))
+                LogPrintf("%s failed to update mint from tx %s\n", __func__, mint.GetTxHash().GetHex());
+        }
+        Index(GetPubCoinHash(mint.GetValue()), mint);
+    }
+
+    LogPrint("zero", "%s : loaded %u zerocoin mints, %u unused\n", __func__, mapMints.size(), mapUnused.size());
+}
+
+// requires LOCK(cs)
+void CZerocoinTracker::Index(const uint256& hashPubCoin, const CZerocoinMint& mint)
+{
+    Unindex(hashPubCoin);
+    mapMints.insert(std::make_pair(hashPubCoin, mint));
+    mapSerials[mint.GetSerialNumber()] = hashPubCoin;
+    if (!mint.IsUsed()) {
+        // the state is worked out by the next UpdateState()
+        mapUnused.insert(std::make_pair(hashPubCoin, MINT_PENDING));
+        mapCounts[MINT_PENDING][mint.GetDenomination()]++;
+        fStateDirty = true;
+    }
+}
+
+// requires LOCK(cs)
+void CZerocoinTracker::Unindex(const uint256& hashPubCoin)
+{
+    std::map<uint256, CZerocoinMint>::iterator it = mapMints.find(hashPubCoin);
+    if (it == mapMints.end())
+        return;
+
+    std::map<CBigNum, uint256>::iterator itSerial = mapSerials.find(it->second.GetSerialNumber());
+    if (itSerial != mapSerials.end() && itSerial->second == hashPubCoin)
+        mapSerials.erase(itSerial);
+
+    std::map<uint256, MintState>::iterator itUnused = mapUnused.find(hashPubCoin);
+    if (itUnused != mapUnused.end()) {
+        mapCounts[itUnused->second][it->second.GetDenomination()]--;
+        mapUnused.erase(itUnused);
+    }
+
+    mapMints.erase(it);
+}
+
+// requires LOCK(cs)
+void CZerocoinTracker::SetState(const uint256& hashPubCoin, MintState state)
+{
+    std::map<uint256, MintState>::iterator it = mapUnused.find(hashPubCoin);
+    if (it == mapUnused.end() || it->second == state)
+        return;
+
+    libzerocoin::CoinDenomination denom = mapMints[hashPubCoin].GetDenomination();
+    mapCounts[it->second][denom]--;
+    mapCounts[state][denom]++;
+    it->second = state;
+}
+
+// requires LOCK(cs)
+bool CZerocoinTracker::WriteMint(const CZerocoinMint& mint)
+{
+    if (!strWalletFile.empty() && !CWalletDB(strWalletFile).WriteZerocoinMint(mint))
+        return false;
+
+    Index(GetPubCoinHash(mint.GetValue()), mint);
+    return true;
+}
+
+// check that there are enough other mints of the same denomination added to the accumulators after this one
+// requires LOCK(cs_main)
+bool CZerocoinTracker::IsAccumulated(const CZerocoinMint& mint) const
+{
+    if (chainActive.Height() < mint.GetHeight() + 1)
+        return false;
+
+    CBlockIndex* pindex = chainActive[mint.GetHeight() + 1];
+    int nMintsAdded = 0;
+    while (pindex->nHeight < chainActive.Height() - 30) { // 30 just to make sure that its at least 2 checkpoints from the top block
+        nMintsAdded += std::count(pindex->vMintDenominationsInBlock.begin(), pindex->vMintDenominationsInBlock.end(), mint.GetDenomination());
+        if (nMintsAdded >= Params().Zerocoin_RequiredAccumulation())
+            return true;
+        pindex = chainActive[pindex->nHeight + 1];
+    }
+
+    return false;
+}
+
+// requires LOCK2(cs_main, cs)
+void CZerocoinTracker::UpdateState()
+{
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip == pindexState && !fStateDirty)
+        return;
+
+    // a mint that was mature stays mature while the chain it matured on is only extended
+    bool fReorganized = pindexState != NULL && !chainActive.Contains(pindexState);
+
+    std::vector<std::pair<uint256, MintState> > vStates;
+    std::vector<CZerocoinMint> vOverWrite;
+    std::vector<CZerocoinMint> vArchive;
+    for (std::map<uint256, MintState>::const_iterator it = mapUnused.begin(); it != mapUnused.end(); ++it) {
+        if (it->second == MINT_MATURE && !fReorganized)
+            continue;
+
+        CZerocoinMint mint = mapMints[it->first];
+
+        //if there is not a record of the block height, then look it up and assign it
+        if (!mint.GetHeight()) {
+            CTransaction tx;
+            uint256 hashBlock;
+            if (!GetTransaction(mint.GetTxHash(), tx, hashBlock, true)) {
+                LogPrintf("%s failed to find tx for mint txid=%s\n", __func__, mint.GetTxHash().GetHex());
+                vArchive.push_back(mint);
+                continue;
+            }
+
+            //if not in the block index, most likely is unconfirmed tx
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            if (mi == mapBlockIndex.end()) {
+                vStates.push_back(std::make_pair(it->first, MINT_PENDING));
+                continue;
+            }
+            mint.SetHeight(mi->second->nHeight);
+            vOverWrite.push_back(mint);
+        }
+
+        MintState state;
+        if (mint.GetHeight() > chainActive.Height() - Params().Zerocoin_MintRequiredConfirmations())
+            state = MINT_CONFIRMING;
+        else
+            state = IsAccumulated(mint) ? MINT_MATURE : MINT_CONFIRMED;
+        vStates.push_back(std::make_pair(it->first, state));
+    }
+
+    //overwrite any updates
+    for (const CZerocoinMint& mint : vOverWrite) {
+        if (!WriteMint(mint))
+            LogPrintf("%s failed to update mint from tx %s\n", __func__, mint.GetTxHash().GetHex());
+    }
+
+    // archive mints
+    for (const CZerocoinMint& mint : vArchive) {
+        if (!strWalletFile.empty() && !CWalletDB(strWalletFile).ArchiveMintOrphan(mint)) {
+            LogPrintf("%s failed to archive mint from %s\n", __func__, mint.GetTxHash().GetHex());
+            continue;
+        }
+        Unindex(GetPubCoinHash(mint.GetValue()));
+    }
+
+    for (unsigned int i = 0; i < vStates.size(); i++)
+        SetState(vStates[i].first, vStates[i].second);
+
+    pindexState = pindexTip;
+    fStateDirty = false;
+}
+
+bool CZerocoinTracker::Write(const CZerocoinMint& mint)
+{
+    LOCK(cs);
+    Load();
+    return WriteMint(mint);
+}
+
+bool CZerocoinTracker::Erase(const CZerocoinMint& mint)
+{
+    LOCK(cs);
+    Load();
+    if (!strWalletFile.empty() && !CWalletDB(strWalletFile).EraseZerocoinMint(mint))
+        return false;
+
+    Unindex(GetPubCoinHash(mint.GetValue()));
+    return true;
+}
+
+bool CZerocoinTracker::Archive(const CZerocoinMint& mint)
+{
+    LOCK(cs);
+    Load();
+    if (!strWalletFile.empty() && !CWalletDB(strWalletFile).ArchiveMintOrphan(mint))
+        return false;
+
+    Unindex(GetPubCoinHash(mint.GetValue()));
+    return true;
+}
+
+bool CZerocoinTracker::Unarchive(const CZerocoinMint& mint)
+{
+    LOCK(cs);
+    Load();
+    if (!strWalletFile.empty() && !CWalletDB(strWalletFile).UnarchiveZerocoin(mint))
+        return false;
+
+    Index(GetPubCoinHash(mint.GetValue()), mint);
+    return true;
+}
+
+bool CZerocoinTracker::Get(const CBigNum& bnPubCoinValue, CZerocoinMint& mintRet)
+{
+    LOCK(cs);
+    Load();
+    std::map<uint256, CZerocoinMint>::const_iterator it = mapMints.find(GetPubCoinHash(bnPubCoinValue));
+    if (it == mapMints.end())
+        return false;
+
+    mintRet = it->second;
+    return true;
+}
+
+bool CZerocoinTracker::HasUnusedSerial(const CBigNum& bnSerial)
+{
+    LOCK(cs);
+    Load();
+    std::map<CBigNum, uint256>::const_iterator it = mapSerials.find(bnSerial);
+    return it != mapSerials.end() && mapUnused.count(it->second);
+}
+
+bool CZerocoinTracker::WriteSpentSerial(const CZerocoinSpend& spend)
+{
+    LOCK(cs);
+    Load();
+    if (!strWalletFile.empty() && !CWalletDB(strWalletFile).WriteZerocoinSpendSerialEntry(spend))
+        return false;
+    setSpentSerials.insert(spend.GetSerial());
+
+    // the mint of a serial we spent is used
+    std::map<CBigNum, uint256>::const_iterator it = mapSerials.find(spend.GetSerial());
+    if (it != mapSerials.end() && mapUnused.count(it->second)) {
+        CZerocoinMint mint = mapMints[it->second];
+        mint.SetUsed(true);
+        if (!WriteMint(mint))
+            LogPrintf("%s failed to update mint from tx %s\n", __func__, mint.GetTxHash().GetHex());
+    }
+    return true;
+}
+
+bool CZerocoinTracker::EraseSpentSerial(const CBigNum& bnSerial)
+{
+    LOCK(cs);
+    Load();
+    if (!strWalletFile.empty() && !CWalletDB(strWalletFile).EraseZerocoinSpendSerialEntry(bnSerial))
+        return false;
+
+    setSpentSerials.erase(bnSerial);
+    return true;
+}
+
+bool CZerocoinTracker::IsSpentSerial(const CBigNum& bnSerial)
+{
+    LOCK(cs);
+    Load();
+    return setSpentSerials.count(bnSerial) > 0;
+}
+
+std::list<CZerocoinMint> CZerocoinTracker::ListMints(bool fUnusedOnly, bool fMatureOnly, bool fUpdateStatus)
+{
+    LOCK2(cs_main, cs);
+    Load();
+    if (fMatureOnly || fUpdateStatus)
+        UpdateState();
+
+    std::list<CZerocoinMint> listMints;
+    for (std::map<uint256, CZerocoinMint>::const_iterator it = mapMints.begin(); it != mapMints.end(); ++it) {
+        std::map<uint256, MintState>::const_iterator itUnused = mapUnused.find(it->first);
+        if (fUnusedOnly && itUnused == mapUnused.end())
+            continue;
+        if (fMatureOnly && (itUnused == mapUnused.end() || itUnused->second != MINT_MATURE))
+            continue;
+        listMints.push_back(it->second);
+    }
+
+    return listMints;
+}
+
+CAmount CZerocoinTracker::SumBalance(int nStateFirst, int nStateLast) const
+{
+    CAmount nTotal = 0;
+    for (int i = nStateFirst; i <= nStateLast; i++) {
+        for (std::map<libzerocoin::CoinDenomination, int>::const_iterator it = mapCounts[i].begin(); it != mapCounts[i].end(); ++it)
+            nTotal += libzerocoin::ZerocoinDenominationToAmount(it->first) * it->second;
+    }
+    return nTotal;
+}
+
+CAmount CZerocoinTracker::GetBalance(bool fMatureOnly)
+{
+    LOCK2(cs_main, cs);
+    Load();
+    UpdateState();
+    return SumBalance(fMatureOnly ? MINT_MATURE : MINT_PENDING, MINT_MATURE);
+}
+
+CAmount CZerocoinTracker::GetUnconfirmedBalance()
+{
+    LOCK2(cs_main, cs);
+    Load();
+    UpdateState();
+    return SumBalance(MINT_PENDING, MINT_CONFIRMING);
+}
+
+std::map<libzerocoin::CoinDenomination, int> CZerocoinTracker::GetDenominationCounts(bool fMatureOnly)
+{
+    LOCK2(cs_main, cs);
+    Load();
+    UpdateState();
+
+    std::map<libzerocoin::CoinDenomination, int> mapDenominations;
+    for (const libzerocoin::CoinDenomination& denom : libzerocoin::zerocoinDenomList) {
+        int nCount = 0;
+        for (int i = fMatureOnly ? MINT_MATURE : MINT_PENDING; i <= MINT_MATURE; i++) {
+            std::map<libzerocoin::CoinDenomination, int>::const_iterator it = mapCounts[i].find(denom);
+            if (it != mapCounts[i].end())
+                nCount += it->second;
+        }
+        mapDenominations.insert(std::make_pair(denom, nCount));
+    }
+    return mapDenominations;
+}
@@ -0,0 +1,114 @@
+// Copyright (c) 2018 The Wagerr developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ZEROCOINTRACKER_H
+#define BITCOIN_ZEROCOINTRACKER_H
+
+#include "amount.h"
+#include "primitives/zerocoin.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+
+class CBlockIndex;
+
+/**
+ * The wallet's zerocoin mints, held in memory and written through to the wallet database.
+ *
+ * Mints are indexed by pubcoin value and by serial, and the unused ones by their state on
+ * the active chain. That state is brought up to date once per chain tip: block heights are
+ * looked up for mints that have none yet, and confirmed mints are checked for enough
+ * accumulated mints after them. Mints that were mature on the previous tip stay mature as
+ * long as that tip is still on the active chain, so a new block only looks at the others.
+ * Balances are kept as counts per state and denomination.
+ *
+ * Archived (orphaned) mints are not tracked; they stay in the database only.
+ */
+class CZerocoinTracker
+{
+public:
+    /** States of an unused mint, as seen from the chain tip */
+    enum MintState {
+        MINT_PENDING,    // no block height yet
+        MINT_CONFIRMING, // fewer than Zerocoin_MintRequiredConfirmations() confirmations
+        MINT_CONFIRMED,  // confirmed, but not enough mints accumulated after it to be spent
+        MINT_MATURE,     // spendable
+        MINT_STATES
+    };
+
+private:
+    mutable CCriticalSection cs;
+    std::string strWalletFile;
+    bool fLoaded;
+
+    // all unarchived mints, by the hash of the pubcoin value (their wallet database key)
+    std::map<uint256, CZerocoinMint> mapMints;
+    std::map<CBigNum, uint256> mapSerials;
+    // serials of the spends this wallet has made ("zcserial" records)
+    std::set<CBigNum> setSpentSerials;
+
+    // unused mints and their state, and how many mints there are in each state by denomination
+    std::map<uint256, MintState> mapUnused;
+    std::map<libzerocoin::CoinDenomination, int> mapCounts[MINT_STATES];
+
+    // the tip the states were last brought up to date for, and whether mints were added since
+    const CBlockIndex* pindexState;
+    bool fStateDirty;
+
+    void Load();
+    void Index(const uint256& hashPubCoin, const CZerocoinMint& mint);
+    void Unindex(const uint256& hashPubCoin);
+    void SetState(const uint256& hashPubCoin, MintState state);
+    bool WriteMint(const CZerocoinMint& mint);
+    bool IsAccumulated(const CZerocoinMint& mint) const;
+    void UpdateState();
+    CAmount SumBalance(int nStateFirst, int nStateLast) const;
+
+public:
+    CZerocoinTracker();
+
+    /** Hash of a pubcoin value, the key of its mint in the wallet database */
+    static uint256 GetPubCoinHash(const CBigNum& bnPubCoinValue);
+
+    /** The mints persist in this wallet file; without one they are kept in memory only */
+    void SetWalletFile(const std::string& strWalletFileIn);
+
+    /** Add or update a mint and write it to the wallet */
+    bool Write(const CZerocoinMint& mint);
+    /** Remove a mint from the tracker and the wallet */
+    bool Erase(const CZerocoinMint& mint);
+    /** Move a mint to the wallet's archive of orphaned mints */
+    bool Archive(const CZerocoinMint& mint);
+    /** Move a mint out of the archive */
+    bool Unarchive(const CZerocoinMint& mint);
+
+    bool Get(const CBigNum& bnPubCoinValue, CZerocoinMint& mintRet);
+    /** Whether one of our unused mints has this serial */
+    bool HasUnusedSerial(const CBigNum& bnSerial);
+
+    /** Record the serial of a spend; its mint is used from now on */
+    bool WriteSpentSerial(const CZerocoinSpend& spend);
+    bool EraseSpentSerial(const CBigNum& bnSerial);
+    bool IsSpentSerial(const CBigNum& bnSerial);
+
+    /**
+     * The mints, optionally only the unused and/or mature ones. fUpdateStatus brings the mint
+     * states up to date first, archiving mints whose transaction cannot be found; listing the
+     * mature mints always does.
+     */
+    std::list<CZerocoinMint> ListMints(bool fUnusedOnly, bool fMatureOnly, bool fUpdateStatus);
+
+    /** Value of the unused mints, or only of the mature ones */
+    CAmount GetBalance(bool fMatureOnly);
+    /** Value of the unused mints without enough confirmations */
+    CAmount GetUnconfirmedBalance();
+    /** Number of unused mints per denomination, or only of the mature ones */
+    std::map<libzerocoin::CoinDenomination, int> GetDenominationCounts(bool fMatureOnly);
+};
+
+#endif // BITCOIN_ZEROCOINTRACKER_H